@@ -7,18 +7,21 @@
 #include "bits.h"
 #include "config.h"
 #include "fdt.h"
+#include "boot_trace.h"
+#include "hsm.h"
+#include "mcall.h"
 #include <string.h>
 
 #ifdef BBL_PAYLOAD
 extern char _payload_start, _payload_end; /* internal payload */
+static uintptr_t payload_end = (uintptr_t)&_payload_end; /* grows if compressed */
 # define PAYLOAD_START &_payload_start
-# define PAYLOAD_END ROUNDUP((uintptr_t)&_payload_end, MEGAPAGE_SIZE)
+# define PAYLOAD_END ROUNDUP(payload_end, MEGAPAGE_SIZE)
 #else
 # define PAYLOAD_START (void*)(MEM_START + MEGAPAGE_SIZE)
 # define PAYLOAD_END (void*)(MEM_START + 0x2200000)
 #endif
-static const void* entry_point;
-long disabled_hart_mask;
+hart_mask_t disabled_hart_mask;
 
 static uintptr_t dtb_output()
 {
@@ -35,19 +38,41 @@ static uintptr_t dtb_output()
   return end;
 }
 
+// How large the DTB at dtb_output() may grow as bbl adds to it: the
+// memory after the payload is free up to the FDT index, which sits at
+// the top of memory
+static uint32_t dtb_output_max_size()
+{
+  uintptr_t end = fdt_index_base();
+  if (dtb_output() >= end)
+    return 0;
+  return MIN(end - dtb_output(), (uint32_t)-1);
+}
+
 static void filter_dtb(uintptr_t source)
 {
   uintptr_t dest = dtb_output();
   uint32_t size = fdt_size(source);
+  if (size > dtb_output_max_size())
+    die("bbl: no room for the DTB at %lx", (long)dest);
   memcpy((void*)dest, (void*)source, size);
+  fdt_index_copy(dest, source);
 
 #ifndef CUSTOM_DTS
   // Remove information from the chained FDT
   filter_harts(dest, &disabled_hart_mask);
   filter_plic(dest);
   filter_compat(dest, "riscv,clint0");
+  // the S-mode part of an ACLINT, riscv,aclint-sswi, stays
+  filter_compat(dest, "riscv,aclint-mswi");
+  filter_compat(dest, "riscv,aclint-mtimer");
   filter_compat(dest, "riscv,debug-013");
 #endif
+
+  // Advertise Sstc so the payload programs stimecmp instead of calling
+  // SBI_SET_TIMER
+  if (HLS()->sstc)
+    fdt_add_isa_extension(dest, dtb_output_max_size(), "sstc");
 }
 
 static void protect_memory(void)
@@ -85,6 +110,9 @@ static void protect_memory(void)
   cfg |= (PMP_NAPOT | PMP_R | PMP_W | PMP_X) << 16;
   // No use for PMP 3 just yet.
   a3 = 0;
+  // Nor may S-mode reach it through SBI calls.
+  smode_denied_start = (uintptr_t)&_ftext;
+  smode_denied_end = (uintptr_t)&_end;
 
   // Plug it all in.
   asm volatile ("csrw pmpaddr0, %[a0]\n\t"
@@ -96,43 +124,72 @@ static void protect_memory(void)
                    [cfg] "r" (cfg));
 }
 
+#ifdef BBL_BOOT_ALL_HARTS
+static const void* volatile entry_point;
+#endif
+
+static void enter_payload(const void* entry)
+{
+  // the payload may have been decompressed by other harts
+  asm volatile ("fence.i");
+
+#ifdef BBL_BOOT_MACHINE
+  enter_machine_mode(entry, read_csr(mhartid), dtb_output());
+#else /* Run bbl in supervisor mode */
+  protect_memory();
+  enter_supervisor_mode(entry, read_csr(mhartid), dtb_output());
+#endif
+}
+
+// Harts besides the boot hart stay stopped until the payload starts them
+// through SBI HSM.  Meanwhile they sleep, but for helping decompress the
+// payload when the boot hart rings.  With --enable-boot-all-harts, they
+// instead enter the payload alongside the boot hart, for payloads that
+// do not start harts themselves.
 void boot_other_hart(uintptr_t unused __attribute__((unused)))
 {
+#ifdef BBL_BOOT_ALL_HARTS
   const void* entry;
-  do {
-    entry = entry_point;
-    mb();
-  } while (!entry);
-
-  long hartid = read_csr(mhartid);
-  if ((1 << hartid) & disabled_hart_mask) {
-    while (1) {
-      __asm__ volatile("wfi");
-#ifdef __riscv_div
-      __asm__ volatile("div x0, x0, x0");
-#endif
-    }
+  while (!(entry = entry_point))
+    decompress_help();
+  mb();
+
+  if (!hart_mask_test(&disabled_hart_mask, read_csr(mhartid))) {
+    HLS()->hsm_state = SBI_HSM_STATE_STARTED;
+    enter_payload(entry);
   }
+#endif
 
-#ifdef BBL_BOOT_MACHINE
-  enter_machine_mode(entry, hartid, dtb_output());
-#else /* Run bbl in supervisor mode */
+#ifndef BBL_BOOT_MACHINE
   protect_memory();
-  enter_supervisor_mode(entry, hartid, dtb_output());
 #endif
+  hsm_stopped(decompress_help);
 }
 
 void boot_loader(uintptr_t dtb)
 {
+#ifdef BBL_PAYLOAD
+  if (!kernel_start)
+    payload_end = decompress_payload(PAYLOAD_START, payload_end, dtb);
+#endif
   filter_dtb(dtb);
+  boot_trace("filter dtb");
+#ifdef BBL_BOOT_TRACE
+  boot_trace_print(printm);
+  boot_trace_export(dtb_output(), dtb_output_max_size());
+#endif
 #ifdef PK_ENABLE_LOGO
   print_logo();
 #endif
 #ifdef PK_PRINT_DEVICE_TREE
   fdt_print(dtb_output());
 #endif
-  mb();
   /* Use optional FDT preloaded external payload if present */
-  entry_point = kernel_start ? kernel_start : PAYLOAD_START;
-  boot_other_hart(0);
+  const void* entry = kernel_start ? kernel_start : PAYLOAD_START;
+
+#ifdef BBL_BOOT_ALL_HARTS
+  mb();
+  entry_point = entry;
+#endif
+  enter_payload(entry);
 }
@@ -10,6 +10,11 @@
 
 void print_logo();
 
+// Decompress an LZ4 frame payload in place; returns the new payload end.
+// Dies rather than write past memory or over the DTB at dtb.
+uintptr_t decompress_payload(void *payload, uintptr_t end, uintptr_t dtb);
+void decompress_help();
+
 #endif // !__ASSEMBLER__
 
 #endif
@@ -0,0 +1,357 @@
+// See LICENSE for license details.
+
+#include <string.h>
+#include "bbl.h"
+#include "mtrap.h"
+#include "atomic.h"
+#include "bits.h"
+#include "config.h"
+#include "boot_trace.h"
+#include "fdt.h"
+
+// An LZ4 frame payload is decompressed where the payload would have
+// been, at its own start.  The frame is first slid up just far enough
+// that no block's output overruns input not yet read.
+
+#define LZ4_MAGIC               0x184D2204
+#define LZ4_FLG_VERSION         0xC0
+#define LZ4_FLG_INDEPENDENT     0x20
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_DICT_ID         0x01
+#define LZ4_BD_BLOCK_MAX(bd)    (1UL << (2 * (((bd) >> 4) & 7) + 8))
+#define LZ4_BLOCK_STORED        0x80000000
+#define LZ4_MIN_MATCH           4
+
+// Room LZ4 needs between the end of a block's output and the end of its
+// input for the output never to catch up with the input
+#define LZ4_INPLACE_MARGIN(len) (((len) >> 8) + 32)
+
+struct lz4_frame {
+  const uint8_t *start;
+  const uint8_t *blocks;  // the first block header
+  const uint8_t *end;
+  uintptr_t size;         // decompressed
+  uintptr_t block_max;
+  int independent;
+  int block_checksum;
+};
+
+static uint32_t le32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int lz4_frame_parse(const uint8_t *src, uintptr_t len, struct lz4_frame *f)
+{
+  if (len < 15 || le32(src) != LZ4_MAGIC)
+    return -1;
+
+  uint8_t flg = src[4], bd = src[5];
+  // bbl has to know how much room the payload takes before decoding it
+  if ((flg & LZ4_FLG_VERSION) != 0x40 || !(flg & LZ4_FLG_CONTENT_SIZE))
+    return -1;
+
+  uint64_t size = le32(src + 6) | (uint64_t)le32(src + 10) << 32;
+  if (size != (uintptr_t)size)
+    return -1;
+
+  f->start = src;
+  f->blocks = src + 4 + 2 + 8 + (flg & LZ4_FLG_DICT_ID ? 4 : 0) + 1;
+  f->end = src + len;
+  f->size = size;
+  f->block_max = LZ4_BD_BLOCK_MAX(bd);
+  f->independent = !!(flg & LZ4_FLG_INDEPENDENT);
+  f->block_checksum = !!(flg & LZ4_FLG_BLOCK_CHECKSUM);
+  return 0;
+}
+
+// Step *p over one block header; NULL at the end mark
+static const uint8_t *lz4_next_block(const struct lz4_frame *f, const uint8_t **p,
+                                     uint32_t *len, int *stored)
+{
+  if (f->end - *p < 4)
+    die("bbl: truncated compressed payload");
+
+  uint32_t header = le32(*p);
+  const uint8_t *data = *p + 4;
+  if (header == 0)
+    return NULL;
+
+  *len = header & ~LZ4_BLOCK_STORED;
+  *stored = !!(header & LZ4_BLOCK_STORED);
+  if (f->end - data < *len)
+    die("bbl: truncated compressed payload");
+  *p = data + *len + (f->block_checksum ? 4 : 0);
+  return data;
+}
+
+// Forward copy that tolerates dst overlapping the source from below
+static inline void lz4_copy(uint8_t *dst, const uint8_t *src, uintptr_t n)
+{
+  if (dst + n <= src || src + n <= dst)
+    memcpy(dst, src, n);
+  else
+    while (n--)
+      *dst++ = *src++;
+}
+
+// Decode one LZ4 block to out; matches may reach back as far as base
+static uintptr_t lz4_block(uint8_t *out, uintptr_t out_len, const uint8_t *base,
+                           const uint8_t *in, uint32_t in_len)
+{
+  const uint8_t *in_end = in + in_len;
+  uint8_t *out_start = out, *out_end = out + out_len;
+
+  while (1) {
+    if (in == in_end)
+      goto corrupt;
+    uint8_t token = *in++;
+
+    uintptr_t lit = token >> 4;
+    if (lit == 15) {
+      uint8_t b;
+      do {
+        if (in == in_end)
+          goto corrupt;
+        b = *in++;
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > in_end - in || lit > out_end - out)
+      goto corrupt;
+    lz4_copy(out, in, lit);
+    out += lit;
+    in += lit;
+
+    if (in == in_end) // the last sequence has no match
+      break;
+    if (in_end - in < 2)
+      goto corrupt;
+    uintptr_t offset = in[0] | in[1] << 8;
+    in += 2;
+
+    uintptr_t match = token & 15;
+    if (match == 15) {
+      uint8_t b;
+      do {
+        if (in == in_end)
+          goto corrupt;
+        b = *in++;
+        match += b;
+      } while (b == 255);
+    }
+    match += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > out - base || match > out_end - out)
+      goto corrupt;
+    lz4_copy(out, out - offset, match);
+    out += match;
+  }
+
+  return out - out_start;
+
+corrupt:
+  die("bbl: corrupt compressed payload");
+}
+
+static uintptr_t lz4_decode(const uint8_t *data, uint32_t len, int stored,
+                            uint8_t *out, uintptr_t out_len, const uint8_t *base)
+{
+  if (!stored)
+    return lz4_block(out, out_len, base, data, len);
+  if (len > out_len)
+    die("bbl: corrupt compressed payload");
+  lz4_copy(out, data, len);
+  return len;
+}
+
+// How far above the output the frame has to sit: each block's input
+// must end LZ4_INPLACE_MARGIN past that block's output, which is bounded
+// by block_max per block.
+static uintptr_t lz4_inplace_offset(const struct lz4_frame *f)
+{
+  const uint8_t *p = f->blocks, *data;
+  uintptr_t offset = 0, out = 0;
+  uint32_t len;
+  int stored;
+
+  while ((data = lz4_next_block(f, &p, &len, &stored))) {
+    uintptr_t in_end = data + len - f->start;
+    out = MIN(out + f->block_max, f->size);
+    if (out + LZ4_INPLACE_MARGIN(len) > in_end)
+      offset = MAX(offset, out + LZ4_INPLACE_MARGIN(len) - in_end);
+  }
+
+  return ROUNDUP(offset, sizeof(uintptr_t));
+}
+
+// Copy n bytes up to dst > src, from the end down
+static void move_up(uint8_t *dst, const uint8_t *src, uintptr_t n)
+{
+  while (n % sizeof(uintptr_t)) {
+    n--;
+    dst[n] = src[n];
+  }
+  if ((uintptr_t)dst % sizeof(uintptr_t) == 0 && (uintptr_t)src % sizeof(uintptr_t) == 0) {
+    uintptr_t *d = (uintptr_t *)dst, *s = (uintptr_t *)src;
+    for (n /= sizeof(uintptr_t); n--; )
+      d[n] = s[n];
+  } else {
+    while (n--)
+      dst[n] = src[n];
+  }
+}
+
+static struct {
+  struct lz4_frame frame;
+  uint8_t *out;
+  long blocks;
+  long next;              // block to claim
+  long done;
+  long harts;
+  int error;              // a block did not fill block_max
+  volatile int active;
+} parallel;
+
+static void decompress_blocks()
+{
+  const struct lz4_frame *f = &parallel.frame;
+  const uint8_t *p = f->blocks, *data = NULL;
+  uint32_t len;
+  int stored;
+  long index = -1, mine, decoded = 0;
+
+  while ((mine = atomic_add(&parallel.next, 1)) < parallel.blocks) {
+    for (; index < mine; index++)
+      data = lz4_next_block(f, &p, &len, &stored);
+
+    uint8_t *out = parallel.out + mine * f->block_max;
+    uintptr_t out_len = MIN(f->block_max, f->size - mine * f->block_max);
+    if (lz4_decode(data, len, stored, out, out_len, out) != out_len)
+      parallel.error = 1;
+
+    if (!decoded++)
+      atomic_add(&parallel.harts, 1);
+    mb();
+    atomic_add(&parallel.done, 1);
+  }
+}
+
+void decompress_help()
+{
+  if (parallel.active) {
+    mb();
+    decompress_blocks();
+  }
+}
+
+// Start the other harts, still stopped, on
+// the blocks of an independent-block frame; returns the harts used, or
+// 0 if the frame was not split up after all.
+static long decompress_parallel(const struct lz4_frame *f, uint8_t *out)
+{
+  const uint8_t *p = f->blocks;
+  uint32_t len;
+  int stored;
+
+  parallel.frame = *f;
+  parallel.out = out;
+  parallel.blocks = 0;
+  while (lz4_next_block(f, &p, &len, &stored))
+    parallel.blocks++;
+
+  mb();
+  parallel.active = 1;
+  mb();
+  // the other harts sleep until rung
+  for_each_hart(hart, &hart_mask)
+    if (hart != read_csr(mhartid))
+      *OTHER_HLS(hart)->ipi = 1;
+  decompress_blocks();
+  while (atomic_read(&parallel.done) < parallel.blocks)
+    ;
+  parallel.active = 0;
+  mb();
+
+  return parallel.error ? 0 : parallel.harts;
+}
+
+static void decompress_serial(const struct lz4_frame *f, uint8_t *out)
+{
+  const uint8_t *p = f->blocks, *data;
+  uintptr_t pos = 0;
+  uint32_t len;
+  int stored;
+
+  while ((data = lz4_next_block(f, &p, &len, &stored))) {
+    const uint8_t *base = f->independent ? out + pos : out;
+    pos += lz4_decode(data, len, stored, out + pos, f->size - pos, base);
+  }
+
+  if (pos != f->size)
+    die("bbl: compressed payload is %ld bytes, expected %ld", (long)pos, (long)f->size);
+}
+
+// The payload is decompressed over whatever follows it, so the output
+// must stay within memory and clear of the DTB that bbl filters next
+// and of the index, at the top of memory, it is filtered through.
+static void decompress_check(uintptr_t start, uintptr_t extent, uintptr_t dtb)
+{
+  uintptr_t mem_end = MEM_START + mem_size;
+  if (extent < start || extent > mem_end)
+    die("bbl: payload decompresses to %lx, past the end of memory at %lx",
+        (long)extent, (long)mem_end);
+  if (extent > dtb && start < dtb + fdt_size(dtb))
+    die("bbl: payload decompresses to %lx, over the DTB at %lx",
+        (long)extent, (long)dtb);
+  if (extent > fdt_index_base())
+    die("bbl: payload decompresses to %lx, over the FDT index at %lx",
+        (long)extent, (long)fdt_index_base());
+}
+
+uintptr_t decompress_payload(void *payload, uintptr_t end, uintptr_t dtb)
+{
+  uint8_t *out = payload;
+  uintptr_t len = end - (uintptr_t)payload;
+  struct lz4_frame f;
+
+  if (lz4_frame_parse(out, len, &f))
+    return end;
+
+  uintptr_t start_cycle = read_csr(mcycle);
+  uintptr_t offset = lz4_inplace_offset(&f);
+  long harts = 1;
+
+#ifdef BBL_PAYLOAD_PARALLEL
+  // blocks may be decoded in any order once the frame clears the output
+  if (f.independent)
+    offset = MAX(offset, ROUNDUP(f.size, sizeof(uintptr_t)));
+#endif
+
+  decompress_check((uintptr_t)out, (uintptr_t)out + MAX(f.size, offset + len), dtb);
+
+  if (offset) {
+    move_up(out + offset, out, len);
+    f.blocks += offset;
+    f.end += offset;
+    f.start += offset;
+  }
+
+#ifdef BBL_PAYLOAD_PARALLEL
+  if (f.independent)
+    harts = decompress_parallel(&f, out);
+  if (!f.independent || !harts) {
+    harts = 1;
+    decompress_serial(&f, out);
+  }
+#else
+  decompress_serial(&f, out);
+#endif
+
+  uintptr_t cycles = read_csr(mcycle) - start_cycle;
+  printm("bbl: decompressed %ld bytes to %ld in %ld cycles (%ld bytes/kcycle, %ld harts)\r\n",
+         (long)len, (long)f.size, (long)cycles, (long)(f.size / (cycles / 1000 + 1)), harts);
+  boot_trace("decompress");
+
+  return (uintptr_t)out + MAX(f.size, offset + len);
+}
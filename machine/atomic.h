@@ -20,6 +20,7 @@ typedef struct { int lock; } spinlock_t;
 #ifdef __riscv_atomic
 # define atomic_add(ptr, inc) __sync_fetch_and_add(ptr, inc)
 # define atomic_or(ptr, inc) __sync_fetch_and_or(ptr, inc)
+# define atomic_and(ptr, inc) __sync_fetch_and_and(ptr, inc)
 # define atomic_swap(ptr, swp) __sync_lock_test_and_set(ptr, swp)
 # define atomic_cas(ptr, cmp, swp) __sync_val_compare_and_swap(ptr, cmp, swp)
 #else
@@ -31,6 +32,7 @@ typedef struct { int lock; } spinlock_t;
   res; })
 # define atomic_add(ptr, inc) atomic_binop(ptr, inc, res + (inc))
 # define atomic_or(ptr, inc) atomic_binop(ptr, inc, res | (inc))
+# define atomic_and(ptr, inc) atomic_binop(ptr, inc, res & (inc))
 # define atomic_swap(ptr, inc) atomic_binop(ptr, inc, (inc))
 # define atomic_cas(ptr, cmp, swp) ({ \
   long flags = disable_irqsave(); \
@@ -40,6 +42,33 @@ typedef struct { int lock; } spinlock_t;
   res; })
 #endif
 
+// Zihintpause pause; older harts execute it as an ordinary fence
+#define cpu_relax() asm volatile (".insn i 0x0F, 0, x0, x0, 0x010")
+
+#define LOCK_BACKOFF_MAX 1024
+
+static inline void lock_backoff(unsigned long n)
+{
+  while (n--)
+    cpu_relax();
+}
+
+// Contention counters, updated by the lock holder
+typedef struct {
+  unsigned long acquired;
+  unsigned long contended;
+  unsigned long spins;
+} lock_stat_t;
+
+static inline void lock_stat_update(lock_stat_t* stat, unsigned long spins)
+{
+  stat->acquired++;
+  if (spins) {
+    stat->contended++;
+    stat->spins += spins;
+  }
+}
+
 static inline int spinlock_trylock(spinlock_t* lock)
 {
   int res = atomic_swap(&lock->lock, -1);
@@ -49,10 +78,15 @@ static inline int spinlock_trylock(spinlock_t* lock)
 
 static inline void spinlock_lock(spinlock_t* lock)
 {
+  unsigned long backoff = 1;
+
   do
   {
-    while (atomic_read(&lock->lock))
-      ;
+    while (atomic_read(&lock->lock)) {
+      lock_backoff(backoff);
+      if (backoff < LOCK_BACKOFF_MAX)
+        backoff *= 2;
+    }
   } while (spinlock_trylock(lock));
 }
 
@@ -75,4 +109,87 @@ static inline void spinlock_unlock_irqrestore(spinlock_t* lock, long flags)
   enable_irqrestore(flags);
 }
 
+// Ticket lock: FIFO fair, and holds no pointers, so harts running in
+// different address spaces (M-mode and pk's S-mode) can share one.
+typedef struct {
+  volatile unsigned int next;
+  volatile unsigned int owner;
+  lock_stat_t stat;
+} ticketlock_t;
+#define TICKETLOCK_INIT {0}
+
+static inline void ticketlock_lock(ticketlock_t* lock)
+{
+  unsigned int ticket = atomic_add(&lock->next, 1);
+  unsigned long spins = 0;
+
+  while (1) {
+    unsigned int ahead = ticket - atomic_read(&lock->owner);
+    if (ahead == 0)
+      break;
+    // back off in proportion to our place in the queue
+    lock_backoff(ahead < LOCK_BACKOFF_MAX / 16 ? ahead * 16 : LOCK_BACKOFF_MAX);
+    spins++;
+  }
+  mb();
+
+  lock_stat_update(&lock->stat, spins);
+}
+
+static inline void ticketlock_unlock(ticketlock_t* lock)
+{
+  mb();
+  atomic_set(&lock->owner, lock->owner + 1);
+}
+
+// MCS lock: each waiter spins on its own queue node, so a contended lock
+// does not bounce a shared line between harts.  Nodes are linked by
+// address, so all users must share an address space.
+typedef struct mcs_node {
+  struct mcs_node* volatile next;
+  volatile int locked;
+} mcs_node_t;
+
+typedef struct {
+  mcs_node_t* volatile tail;
+  lock_stat_t stat;
+} mcs_lock_t;
+#define MCS_LOCK_INIT {0}
+
+static inline void mcs_lock(mcs_lock_t* lock, mcs_node_t* node)
+{
+  unsigned long spins = 0, backoff = 1;
+
+  node->next = 0;
+  node->locked = 1;
+  mb();
+
+  mcs_node_t* prev = atomic_swap(&lock->tail, node);
+  if (prev) {
+    atomic_set(&prev->next, node);
+    while (atomic_read(&node->locked)) {
+      lock_backoff(backoff);
+      if (backoff < LOCK_BACKOFF_MAX)
+        backoff *= 2;
+      spins++;
+    }
+  }
+  mb();
+
+  lock_stat_update(&lock->stat, spins);
+}
+
+static inline void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node)
+{
+  mb();
+  if (!atomic_read(&node->next)) {
+    if (atomic_cas(&lock->tail, node, (mcs_node_t*)0) == node)
+      return;
+    // a successor is between its swap and linking itself in
+    while (!atomic_read(&node->next))
+      cpu_relax();
+  }
+  atomic_set(&node->next->locked, 0);
+}
+
 #endif
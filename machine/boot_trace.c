@@ -0,0 +1,75 @@
+// See LICENSE for license details.
+
+#include "boot_trace.h"
+#include "encoding.h"
+#include "fdt.h"
+#include <string.h>
+
+boot_trace_entry_t boot_trace_buf[BOOT_TRACE_MAX];
+size_t boot_trace_len;
+
+static uint64_t read_cycle()
+{
+#if __riscv_xlen == 32
+  uint32_t lo, hi;
+  do {
+    hi = read_csr(cycleh);
+    lo = read_csr(cycle);
+  } while (hi != read_csr(cycleh));
+  return ((uint64_t)hi << 32) | lo;
+#else
+  return read_csr(cycle);
+#endif
+}
+
+void boot_trace(const char* name)
+{
+  if (boot_trace_len == BOOT_TRACE_MAX)
+    return;
+
+  boot_trace_entry_t* e = &boot_trace_buf[boot_trace_len++];
+  e->cycle = read_cycle();
+  for (size_t i = 0; i < BOOT_TRACE_NAME_LEN - 1 && name[i]; i++)
+    e->name[i] = name[i];
+}
+
+void boot_trace_print(void (*print)(const char* s, ...))
+{
+  uint64_t prev = 0;
+  for (size_t i = 0; i < boot_trace_len; i++) {
+    uint64_t cycle = boot_trace_buf[i].cycle;
+    print("boot: %s: %lld cycles (%lld total)\n", boot_trace_buf[i].name,
+          (long long)(cycle - prev), (long long)cycle);
+    prev = cycle;
+  }
+}
+
+static uint32_t cpu_to_fdt32(uint32_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+#else
+  return x;
+#endif
+}
+
+// Pass the trace on in /chosen: a string list of phase names and the
+// matching 64-bit cycle counts, if the FDT has room for them.
+void boot_trace_export(uintptr_t fdt, uint32_t max_size)
+{
+  char names[BOOT_TRACE_MAX * BOOT_TRACE_NAME_LEN];
+  uint32_t cycles[BOOT_TRACE_MAX * 2];
+  size_t names_len = 0;
+
+  for (size_t i = 0; i < boot_trace_len; i++) {
+    size_t len = strlen(boot_trace_buf[i].name) + 1;
+    memcpy(names + names_len, boot_trace_buf[i].name, len);
+    names_len += len;
+
+    cycles[2*i] = cpu_to_fdt32(boot_trace_buf[i].cycle >> 32);
+    cycles[2*i+1] = cpu_to_fdt32(boot_trace_buf[i].cycle);
+  }
+
+  if (fdt_add_chosen_prop(fdt, max_size, "riscv-pk,boot-phases", names, names_len) == 0)
+    fdt_add_chosen_prop(fdt, max_size, "riscv-pk,boot-cycles", cycles, boot_trace_len * 8);
+}
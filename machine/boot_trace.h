@@ -0,0 +1,27 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_BOOT_TRACE_H
+#define _RISCV_BOOT_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BOOT_TRACE_MAX 16
+#define BOOT_TRACE_NAME_LEN 16
+
+// Names are stored inline, as the buffer is written from M-mode and
+// read back from pk's S-mode, where pointers differ.
+typedef struct {
+  char name[BOOT_TRACE_NAME_LEN];
+  uint64_t cycle;
+} boot_trace_entry_t;
+
+extern boot_trace_entry_t boot_trace_buf[BOOT_TRACE_MAX];
+extern size_t boot_trace_len;
+
+// Record that the boot phase called name has just finished
+void boot_trace(const char* name);
+void boot_trace_print(void (*print)(const char* s, ...));
+void boot_trace_export(uintptr_t fdt, uint32_t max_size);
+
+#endif
@@ -0,0 +1,188 @@
+// See LICENSE for license details.
+
+#include "console.h"
+#include "mtrap.h"
+#include "atomic.h"
+#include "htif.h"
+#include "uart.h"
+#include "uart16550.h"
+#include "uart_litex.h"
+#include "config.h"
+
+// The UART's transmit FIFO is filled in bursts of whatever it says it
+// has room for, and the bytes it has no room for wait in tx_ring.  With
+// PK_CONSOLE_IRQ the UART's TX-ready interrupt drains tx_ring and its RX
+// interrupt fills rx_ring; without it writers wait and readers poll.
+
+#define CONSOLE_RING_SIZE 256 // a power of 2
+
+typedef struct {
+  char buf[CONSOLE_RING_SIZE];
+  unsigned head; // next to put
+  unsigned tail; // next to take
+} console_ring_t;
+
+static console_ring_t tx_ring, rx_ring;
+static spinlock_t console_lock = SPINLOCK_INIT;
+static uint32_t console_irq; // serviced in M-mode, or 0
+
+static inline int ring_empty(console_ring_t* r)
+{
+  return r->head == r->tail;
+}
+
+static inline int ring_full(console_ring_t* r)
+{
+  return r->head - r->tail == CONSOLE_RING_SIZE;
+}
+
+static inline void ring_put(console_ring_t* r, char ch)
+{
+  r->buf[r->head++ % CONSOLE_RING_SIZE] = ch;
+}
+
+static inline char ring_take(console_ring_t* r)
+{
+  return r->buf[r->tail++ % CONSOLE_RING_SIZE];
+}
+
+static console_uart_t* console_uart()
+{
+  if (uart)
+    return &uart_console;
+  if (uart16550)
+    return &uart16550_console;
+  if (uart_litex)
+    return &uart_litex_console;
+  return NULL;
+}
+
+// Move as much of tx_ring as the FIFO has room for; never waits
+static void console_drain(console_uart_t* u)
+{
+  size_t room;
+
+  while (!ring_empty(&tx_ring) && (room = u->tx_room()))
+    for (; room && !ring_empty(&tx_ring); room--)
+      u->tx(ring_take(&tx_ring));
+}
+
+static void console_receive(console_uart_t* u)
+{
+  int ch;
+
+  // with the ring full, newer bytes are lost, as in an overrun
+  while ((ch = u->rx()) >= 0)
+    if (!ring_full(&rx_ring))
+      ring_put(&rx_ring, ch);
+}
+
+void console_write(const char* buf, size_t len)
+{
+  console_uart_t* u = console_uart();
+
+  if (!u) {
+    if (htif)
+      htif_console_write(buf, len);
+    return;
+  }
+
+  spinlock_lock(&console_lock);
+  while (len) {
+    for (; len && !ring_full(&tx_ring); len--)
+      ring_put(&tx_ring, *buf++);
+    console_drain(u);
+  }
+
+  if (console_irq) {
+    u->irq_enable(!ring_empty(&tx_ring));
+  } else {
+    // nothing else will finish the job
+    while (!ring_empty(&tx_ring))
+      console_drain(u);
+  }
+  spinlock_unlock(&console_lock);
+}
+
+void console_putchar(uint8_t ch)
+{
+  if (!console_uart() && htif)
+    htif_console_putchar(ch);
+  else
+    console_write((const char*)&ch, 1);
+}
+
+int console_getchar()
+{
+  console_uart_t* u = console_uart();
+
+  if (!u)
+    return htif ? htif_console_getchar() : -1;
+
+  spinlock_lock(&console_lock);
+  console_receive(u);
+  int ch = ring_empty(&rx_ring) ? -1 : (uint8_t)ring_take(&rx_ring);
+  spinlock_unlock(&console_lock);
+
+  return ch;
+}
+
+// Push out what is still buffered, e.g. before powering off.  This may
+// be reached from die() with the lock held, so it does not wait for it.
+void console_flush()
+{
+  console_uart_t* u = console_uart();
+  if (!u)
+    return;
+
+  int locked = !spinlock_trylock(&console_lock);
+  while (!ring_empty(&tx_ring))
+    console_drain(u);
+  if (locked)
+    spinlock_unlock(&console_lock);
+}
+
+void console_irq_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  volatile uint32_t* claim = HLS()->plic_m_thresh + 1;
+  console_uart_t* u = console_uart();
+  uint32_t source;
+
+  while ((source = *claim)) {
+    if (source == console_irq) {
+      spinlock_lock(&console_lock);
+      console_receive(u);
+      console_drain(u);
+      u->irq_enable(!ring_empty(&tx_ring));
+      spinlock_unlock(&console_lock);
+    }
+    *claim = source;
+  }
+}
+
+// The UART's interrupt goes to the boot hart's M-mode context only.  The
+// payload then has to use the SBI console rather than the UART itself.
+void console_irq_init(int boot_hart)
+{
+#ifdef PK_CONSOLE_IRQ
+  console_uart_t* u = console_uart();
+  if (!u || !u->irq || u->irq > plic_ndevs || !HLS()->plic_m_ie)
+    return;
+
+  uint32_t word = u->irq / 32, bit = 1U << (u->irq % 32);
+  if (HLS()->plic_s_ie)
+    HLS()->plic_s_ie[word] &= ~bit;
+  if (!boot_hart)
+    return;
+
+  plic_priorities[u->irq] = 2; // above the M-mode threshold of 1
+  HLS()->plic_m_ie[word] |= bit;
+
+  spinlock_lock(&console_lock);
+  console_irq = u->irq;
+  u->irq_enable(0);
+  spinlock_unlock(&console_lock);
+
+  set_csr(mie, MIP_MEIP);
+#endif
+}
@@ -0,0 +1,24 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_CONSOLE_H
+#define _RISCV_CONSOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// What the buffered console needs from a UART driver
+typedef struct {
+  size_t (*tx_room)();        // bytes the TX FIFO takes without waiting
+  void (*tx)(uint8_t ch);     // only as many as tx_room said
+  int (*rx)();                // -1 if nothing has arrived
+  void (*irq_enable)(int tx); // RX always, TX-ready only if tx
+  uint32_t irq;               // PLIC source, or 0 if unknown
+} console_uart_t;
+
+void console_putchar(uint8_t ch);
+void console_write(const char* buf, size_t len);
+int console_getchar();
+void console_flush();
+void console_irq_init(int boot_hart);
+
+#endif
@@ -5,6 +5,10 @@
 #include "config.h"
 #include "unprivileged_memory.h"
 #include "mtrap.h"
+#include "pmu.h"
+#include "emulation_stat.h"
+#include "insn_cache.h"
+#include "mcall.h"
 #include <limits.h>
 
 static DECLARE_EMULATION_FUNC(emulate_rvc)
@@ -21,44 +25,44 @@ static DECLARE_EMULATION_FUNC(emulate_rvc)
   if ((insn & MASK_C_FLD) == MATCH_C_FLD) {
     uintptr_t addr = GET_RS1S(insn, regs) + RVC_LD_IMM(insn);
     if (unlikely(addr % sizeof(uintptr_t)))
-      return misaligned_load_trap(regs, mcause, mepc);
+      return misaligned_load(regs, mcause, mepc);
     SET_F64_RD(RVC_RS2S(insn) << SH_RD, regs, load_uint64_t((void *)addr, mepc));
   } else if ((insn & MASK_C_FLDSP) == MATCH_C_FLDSP) {
     uintptr_t addr = GET_SP(regs) + RVC_LDSP_IMM(insn);
     if (unlikely(addr % sizeof(uintptr_t)))
-      return misaligned_load_trap(regs, mcause, mepc);
+      return misaligned_load(regs, mcause, mepc);
     SET_F64_RD(insn, regs, load_uint64_t((void *)addr, mepc));
   } else if ((insn & MASK_C_FSD) == MATCH_C_FSD) {
     uintptr_t addr = GET_RS1S(insn, regs) + RVC_LD_IMM(insn);
     if (unlikely(addr % sizeof(uintptr_t)))
-      return misaligned_store_trap(regs, mcause, mepc);
+      return misaligned_store(regs, mcause, mepc);
     store_uint64_t((void *)addr, GET_F64_RS2(RVC_RS2S(insn) << SH_RS2, regs), mepc);
   } else if ((insn & MASK_C_FSDSP) == MATCH_C_FSDSP) {
     uintptr_t addr = GET_SP(regs) + RVC_SDSP_IMM(insn);
     if (unlikely(addr % sizeof(uintptr_t)))
-      return misaligned_store_trap(regs, mcause, mepc);
+      return misaligned_store(regs, mcause, mepc);
     store_uint64_t((void *)addr, GET_F64_RS2(RVC_RS2(insn) << SH_RS2, regs), mepc);
   } else
 #  if __riscv_xlen == 32
   if ((insn & MASK_C_FLW) == MATCH_C_FLW) {
     uintptr_t addr = GET_RS1S(insn, regs) + RVC_LW_IMM(insn);
     if (unlikely(addr % 4))
-      return misaligned_load_trap(regs, mcause, mepc);
+      return misaligned_load(regs, mcause, mepc);
     SET_F32_RD(RVC_RS2S(insn) << SH_RD, regs, load_int32_t((void *)addr, mepc));
   } else if ((insn & MASK_C_FLWSP) == MATCH_C_FLWSP) {
     uintptr_t addr = GET_SP(regs) + RVC_LWSP_IMM(insn);
     if (unlikely(addr % 4))
-      return misaligned_load_trap(regs, mcause, mepc);
+      return misaligned_load(regs, mcause, mepc);
     SET_F32_RD(insn, regs, load_int32_t((void *)addr, mepc));
   } else if ((insn & MASK_C_FSW) == MATCH_C_FSW) {
     uintptr_t addr = GET_RS1S(insn, regs) + RVC_LW_IMM(insn);
     if (unlikely(addr % 4))
-      return misaligned_store_trap(regs, mcause, mepc);
+      return misaligned_store(regs, mcause, mepc);
     store_uint32_t((void *)addr, GET_F32_RS2(RVC_RS2S(insn) << SH_RS2, regs), mepc);
   } else if ((insn & MASK_C_FSWSP) == MATCH_C_FSWSP) {
     uintptr_t addr = GET_SP(regs) + RVC_SWSP_IMM(insn);
     if (unlikely(addr % 4))
-      return misaligned_store_trap(regs, mcause, mepc);
+      return misaligned_store(regs, mcause, mepc);
     store_uint32_t((void *)addr, GET_F32_RS2(RVC_RS2(insn) << SH_RS2, regs), mepc);
   } else
 #  endif
@@ -68,6 +72,47 @@ static DECLARE_EMULATION_FUNC(emulate_rvc)
   return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
 }
 
+// Which emulation an illegal instruction gets, by major opcode; those
+// not emulated after all become EMULATION_ILLEGAL in truly_illegal_insn
+static int illegal_insn_category(insn_t insn)
+{
+  switch ((insn & 0x7c) >> 2)
+  {
+    case 0x0c: // OP
+    case 0x0e: // OP-32
+      return EMULATION_MULDIV;
+    case 0x1c: // SYSTEM
+      return EMULATION_SYSTEM;
+    default:
+      return EMULATION_FP;
+  }
+}
+
+static emulation_func illegal_insn_emulator(insn_t insn)
+{
+  extern uint32_t illegal_insn_trap_table[];
+  int32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
+  return (emulation_func)((void*)illegal_insn_trap_table + *pf);
+}
+
+// An illegal instruction's emulator and the kind of emulation it does,
+// from the cache if the instruction has been decoded before
+static emulation_func illegal_insn_decode(uintptr_t mepc, insn_t insn, int* category)
+{
+  const decoded_insn_t* d = insn_cache_lookup(mepc, insn);
+  if (d && d->f) {
+    *category = d->category;
+    return d->f;
+  }
+
+  emulation_func f = illegal_insn_emulator(insn);
+  *category = illegal_insn_category(insn);
+  if (f != truly_illegal_insn)
+    insn_cache_fill(&(decoded_insn_t){
+      .mepc = mepc, .insn = insn, .f = f, .category = *category });
+  return f;
+}
+
 void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   asm (".pushsection .rodata\n"
@@ -130,27 +175,37 @@ void illegal_insn_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
        "  .word truly_illegal_insn - illegal_insn_trap_table\n"
        "  .popsection");
 
+  uintptr_t cycle0 = emulation_begin(EMULATION_FP);
   uintptr_t mstatus = read_csr(mstatus);
   insn_t insn = read_csr(mtval);
 
+  pmu_fw_event(SBI_PMU_FW_ILLEGAL_INSN);
+
   if (unlikely((insn & 3) != 3)) {
     if (insn == 0)
       insn = get_insn(mepc, &mstatus);
-    if ((insn & 3) != 3)
-      return emulate_rvc(regs, mcause, mepc, mstatus, insn);
+    if ((insn & 3) != 3) {
+      emulate_rvc(regs, mcause, mepc, mstatus, insn);
+      emulation_end(mepc, cycle0);
+      emulate_run_ahead(regs, mepc, EMULATION_FP);
+      return;
+    }
   }
 
   write_csr(mepc, mepc + 4);
 
-  extern uint32_t illegal_insn_trap_table[];
-  int32_t* pf = (void*)illegal_insn_trap_table + (insn & 0x7c);
-  emulation_func f = (emulation_func)((void*)illegal_insn_trap_table + *pf);
+  int category;
+  emulation_func f = illegal_insn_decode(mepc, insn, &category);
+  emulation_category(category);
   f(regs, mcause, mepc, mstatus, insn);
+  emulation_end(mepc, cycle0);
+  emulate_run_ahead(regs, mepc, category);
 }
 
 __attribute__((noinline))
 DECLARE_EMULATION_FUNC(truly_illegal_insn)
 {
+  emulation_category(EMULATION_ILLEGAL);
   return redirect_trap(mepc, mstatus, insn);
 }
 
@@ -177,15 +232,10 @@ static inline int emulate_read_csr(int num, uintptr_t mstatus, uintptr_t* result
         return -1;
       *result = read_csr(minstret);
       return 0;
-    case CSR_MHPMCOUNTER3:
-      if (!((counteren >> (3 + CSR_MHPMCOUNTER3 - CSR_MHPMCOUNTER3)) & 1))
+    case CSR_MHPMCOUNTER3 ... CSR_MHPMCOUNTER31:
+      if (!((counteren >> (3 + num - CSR_MHPMCOUNTER3)) & 1))
         return -1;
-      *result = read_csr(mhpmcounter3);
-      return 0;
-    case CSR_MHPMCOUNTER4:
-      if (!((counteren >> (3 + CSR_MHPMCOUNTER4 - CSR_MHPMCOUNTER3)) & 1))
-        return -1;
-      *result = read_csr(mhpmcounter4);
+      *result = pmu_read_hpmcounter(3 + num - CSR_MHPMCOUNTER3);
       return 0;
 #if __riscv_xlen == 32
     case CSR_CYCLEH:
@@ -203,22 +253,14 @@ static inline int emulate_read_csr(int num, uintptr_t mstatus, uintptr_t* result
         return -1;
       *result = read_csr(minstreth);
       return 0;
-    case CSR_MHPMCOUNTER3H:
-      if (!((counteren >> (3 + CSR_MHPMCOUNTER3 - CSR_MHPMCOUNTER3)) & 1))
-        return -1;
-      *result = read_csr(mhpmcounter3h);
-      return 0;
-    case CSR_MHPMCOUNTER4H:
-      if (!((counteren >> (3 + CSR_MHPMCOUNTER4 - CSR_MHPMCOUNTER3)) & 1))
+    case CSR_MHPMCOUNTER3H ... CSR_MHPMCOUNTER31H:
+      if (!((counteren >> (3 + num - CSR_MHPMCOUNTER3H)) & 1))
         return -1;
-      *result = read_csr(mhpmcounter4h);
+      *result = pmu_read_hpmcounterh(3 + num - CSR_MHPMCOUNTER3H);
       return 0;
 #endif
-    case CSR_MHPMEVENT3:
-      *result = read_csr(mhpmevent3);
-      return 0;
-    case CSR_MHPMEVENT4:
-      *result = read_csr(mhpmevent4);
+    case CSR_MHPMEVENT3 ... CSR_MHPMEVENT31:
+      *result = pmu_read_hpmevent(3 + num - CSR_MHPMEVENT3);
       return 0;
 #if !defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)
     case CSR_FRM:
@@ -244,16 +286,19 @@ static inline int emulate_write_csr(int num, uintptr_t value, uintptr_t mstatus)
   {
     case CSR_CYCLE: write_csr(mcycle, value); return 0;
     case CSR_INSTRET: write_csr(minstret, value); return 0;
-    case CSR_MHPMCOUNTER3: write_csr(mhpmcounter3, value); return 0;
-    case CSR_MHPMCOUNTER4: write_csr(mhpmcounter4, value); return 0;
+    case CSR_MHPMCOUNTER3 ... CSR_MHPMCOUNTER31:
+      pmu_write_hpmcounter(3 + num - CSR_MHPMCOUNTER3, value);
+      return 0;
 #if __riscv_xlen == 32
     case CSR_CYCLEH: write_csr(mcycleh, value); return 0;
     case CSR_INSTRETH: write_csr(minstreth, value); return 0;
-    case CSR_MHPMCOUNTER3H: write_csr(mhpmcounter3h, value); return 0;
-    case CSR_MHPMCOUNTER4H: write_csr(mhpmcounter4h, value); return 0;
+    case CSR_MHPMCOUNTER3H ... CSR_MHPMCOUNTER31H:
+      pmu_write_hpmcounterh(3 + num - CSR_MHPMCOUNTER3H, value);
+      return 0;
 #endif
-    case CSR_MHPMEVENT3: write_csr(mhpmevent3, value); return 0;
-    case CSR_MHPMEVENT4: write_csr(mhpmevent4, value); return 0;
+    case CSR_MHPMEVENT3 ... CSR_MHPMEVENT31:
+      pmu_write_hpmevent(3 + num - CSR_MHPMEVENT3, value);
+      return 0;
 #if !defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)
     case CSR_FRM: SET_FRM(value); return 0;
     case CSR_FFLAGS: SET_FFLAGS(value); return 0;
@@ -292,3 +337,344 @@ DECLARE_EMULATION_FUNC(emulate_system_opcode)
 
   SET_RD(insn, regs, csr_val);
 }
+
+#ifdef PK_RUN_AHEAD_EMULATION
+
+// An emulated instruction tends to be followed by more that trap, as in
+// soft-float arithmetic or a copy through misaligned words, so rather
+// than return to the payload after each, go on emulating them in the
+// same trap, along with the integer instructions between them.  Only the
+// page the trapping instruction was fetched from is known to be
+// executable, so emulation stops at its end.
+
+#define RUN_AHEAD_MAX        32 // instructions per trap
+#define RUN_AHEAD_MAX_SIMPLE 8  // integer instructions in a row
+
+#ifdef __riscv_compressed
+# define RUN_AHEAD_ALIGN 2
+#else
+# define RUN_AHEAD_ALIGN 4
+#endif
+
+#define B_IMM(x) (((RV_X(x, 8, 4) << 1) | (RV_X(x, 25, 6) << 5) | (RV_X(x, 7, 1) << 11)) - (RV_X(x, 31, 1) << 12))
+#define J_IMM(x) (((RV_X(x, 21, 10) << 1) | (RV_X(x, 20, 1) << 11) | (RV_X(x, 12, 8) << 12)) - (RV_X(x, 31, 1) << 20))
+#define U_IMM(x) ((intptr_t)(int32_t)((x) & 0xfffff000))
+#define RVC_IMM(x) (RV_X(x, 2, 5) - (RV_X(x, 12, 1) << 5))
+#define RVC_ADDI4SPN_IMM(x) ((RV_X(x, 6, 1) << 2) | (RV_X(x, 5, 1) << 3) | (RV_X(x, 11, 2) << 4) | (RV_X(x, 7, 4) << 6))
+#define RVC_B_IMM(x) (((RV_X(x, 3, 2) << 1) | (RV_X(x, 10, 2) << 3) | (RV_X(x, 2, 1) << 5) | (RV_X(x, 5, 2) << 6)) - (RV_X(x, 12, 1) << 8))
+#define RVC_J_IMM(x) (((RV_X(x, 3, 3) << 1) | (RV_X(x, 11, 1) << 4) | (RV_X(x, 2, 1) << 5) | (RV_X(x, 7, 1) << 6) | (RV_X(x, 6, 1) << 7) | (RV_X(x, 9, 2) << 8) | (RV_X(x, 8, 1) << 10)) - (RV_X(x, 12, 1) << 11))
+
+// The emulator for an instruction that traps as illegal, or NULL
+static emulation_func run_ahead_emulator(uintptr_t pc, insn_t insn, int* category)
+{
+  *category = EMULATION_FP;
+  if ((insn & 3) != 3) {
+#if defined(__riscv_compressed) && !defined(__riscv_flen) && defined(PK_ENABLE_FP_EMULATION)
+    if ((insn & MASK_C_FLD) == MATCH_C_FLD || (insn & MASK_C_FLDSP) == MATCH_C_FLDSP
+        || (insn & MASK_C_FSD) == MATCH_C_FSD || (insn & MASK_C_FSDSP) == MATCH_C_FSDSP
+# if __riscv_xlen == 32
+        || (insn & MASK_C_FLW) == MATCH_C_FLW || (insn & MASK_C_FLWSP) == MATCH_C_FLWSP
+        || (insn & MASK_C_FSW) == MATCH_C_FSW || (insn & MASK_C_FSWSP) == MATCH_C_FSWSP
+# endif
+       )
+      return emulate_rvc;
+#endif
+    return NULL;
+  }
+
+  switch ((insn & 0x7c) >> 2)
+  {
+    case 0x0c: // OP
+    case 0x0e: // OP-32
+      if (RV_X(insn, 25, 7) != 1) // not M
+        return NULL;
+      break;
+    case 0x1c: // SYSTEM: the CSRs the hart has are not emulated
+      return NULL;
+    default:
+#ifdef __riscv_flen
+      // FP arithmetic traps only to emulate what the FPU lacks
+      return NULL;
+#endif
+      break;
+  }
+
+  emulation_func f = illegal_insn_decode(pc, insn, category);
+  return f == truly_illegal_insn ? NULL : f;
+}
+
+// The kind of misaligned integer load or store an instruction is, with
+// its address, or -1 if it is not
+static int run_ahead_misaligned(uintptr_t* regs, insn_t insn, uintptr_t* addr)
+{
+  int category = EMULATION_MISALIGNED_LOAD, len;
+
+  if ((insn & MASK_LH) == MATCH_LH || (insn & MASK_LHU) == MATCH_LHU)
+    len = 2, *addr = GET_RS1(insn, regs) + IMM_I(insn);
+  else if ((insn & MASK_LW) == MATCH_LW)
+    len = 4, *addr = GET_RS1(insn, regs) + IMM_I(insn);
+#if __riscv_xlen == 64
+  else if ((insn & MASK_LWU) == MATCH_LWU)
+    len = 4, *addr = GET_RS1(insn, regs) + IMM_I(insn);
+  else if ((insn & MASK_LD) == MATCH_LD)
+    len = 8, *addr = GET_RS1(insn, regs) + IMM_I(insn);
+#endif
+  else if ((insn & MASK_SH) == MATCH_SH)
+    len = 2, *addr = GET_RS1(insn, regs) + IMM_S(insn), category = EMULATION_MISALIGNED_STORE;
+  else if ((insn & MASK_SW) == MATCH_SW)
+    len = 4, *addr = GET_RS1(insn, regs) + IMM_S(insn), category = EMULATION_MISALIGNED_STORE;
+#if __riscv_xlen == 64
+  else if ((insn & MASK_SD) == MATCH_SD)
+    len = 8, *addr = GET_RS1(insn, regs) + IMM_S(insn), category = EMULATION_MISALIGNED_STORE;
+#endif
+#ifdef __riscv_compressed
+  else if ((insn & MASK_C_LW) == MATCH_C_LW)
+    len = 4, *addr = GET_RS1S(insn, regs) + RVC_LW_IMM(insn);
+  else if ((insn & MASK_C_LWSP) == MATCH_C_LWSP && RV_X(insn, SH_RD, 5))
+    len = 4, *addr = GET_SP(regs) + RVC_LWSP_IMM(insn);
+  else if ((insn & MASK_C_SW) == MATCH_C_SW)
+    len = 4, *addr = GET_RS1S(insn, regs) + RVC_LW_IMM(insn), category = EMULATION_MISALIGNED_STORE;
+  else if ((insn & MASK_C_SWSP) == MATCH_C_SWSP)
+    len = 4, *addr = GET_SP(regs) + RVC_SWSP_IMM(insn), category = EMULATION_MISALIGNED_STORE;
+# if __riscv_xlen == 64
+  else if ((insn & MASK_C_LD) == MATCH_C_LD)
+    len = 8, *addr = GET_RS1S(insn, regs) + RVC_LD_IMM(insn);
+  else if ((insn & MASK_C_LDSP) == MATCH_C_LDSP && RV_X(insn, SH_RD, 5))
+    len = 8, *addr = GET_SP(regs) + RVC_LDSP_IMM(insn);
+  else if ((insn & MASK_C_SD) == MATCH_C_SD)
+    len = 8, *addr = GET_RS1S(insn, regs) + RVC_LD_IMM(insn), category = EMULATION_MISALIGNED_STORE;
+  else if ((insn & MASK_C_SDSP) == MATCH_C_SDSP)
+    len = 8, *addr = GET_SP(regs) + RVC_SDSP_IMM(insn), category = EMULATION_MISALIGNED_STORE;
+# endif
+#endif
+  else
+    return -1;
+
+  return *addr % len ? category : -1;
+}
+
+static int run_ahead_alu(int funct3, int alt, uintptr_t a, uintptr_t b, uintptr_t* val)
+{
+  int shamt = b & (__riscv_xlen - 1);
+
+  switch (funct3)
+  {
+    case 0: *val = alt ? a - b : a + b; return 0;
+    case 1: *val = a << shamt; return alt;
+    case 2: *val = (intptr_t)a < (intptr_t)b; return alt;
+    case 3: *val = a < b; return alt;
+    case 4: *val = a ^ b; return alt;
+    case 5: *val = alt ? (uintptr_t)((intptr_t)a >> shamt) : a >> shamt; return 0;
+    case 6: *val = a | b; return alt;
+    case 7: *val = a & b; return alt;
+    default: __builtin_unreachable();
+  }
+}
+
+#if __riscv_xlen == 64
+static int run_ahead_alu32(int funct3, int alt, uint32_t a, uint32_t b, uintptr_t* val)
+{
+  int shamt = b & 31;
+
+  switch (funct3)
+  {
+    case 0: *val = (int32_t)(alt ? a - b : a + b); return 0;
+    case 1: *val = (int32_t)(a << shamt); return alt;
+    case 5: *val = alt ? (int32_t)a >> shamt : (int32_t)(a >> shamt); return 0;
+    default: return -1;
+  }
+}
+#endif
+
+#ifdef __riscv_compressed
+static uintptr_t run_ahead_simple_rvc(uintptr_t* regs, uintptr_t pc, insn_t insn)
+{
+  int rd = RV_X(insn, SH_RD, 5), rs2 = RVC_RS2(insn);
+  uintptr_t next = pc + 2;
+
+  switch (insn & MASK_C_ADDI)
+  {
+    case MATCH_C_ADDI4SPN:
+      if (!RVC_ADDI4SPN_IMM(insn))
+        return 0;
+      regs[RVC_RS2S(insn)] = GET_SP(regs) + RVC_ADDI4SPN_IMM(insn);
+      break;
+    case MATCH_C_ADDI:
+      regs[rd] += RVC_IMM(insn);
+      break;
+# if __riscv_xlen == 64
+    case MATCH_C_ADDIW:
+      if (!rd)
+        return 0;
+      regs[rd] = (int32_t)(regs[rd] + RVC_IMM(insn));
+      break;
+# endif
+    case MATCH_C_LI:
+      regs[rd] = RVC_IMM(insn);
+      break;
+    case MATCH_C_J:
+      next = pc + RVC_J_IMM(insn);
+      break;
+    case MATCH_C_BEQZ:
+      if (regs[RVC_RS1S(insn)] == 0)
+        next = pc + RVC_B_IMM(insn);
+      break;
+    case MATCH_C_BNEZ:
+      if (regs[RVC_RS1S(insn)] != 0)
+        next = pc + RVC_B_IMM(insn);
+      break;
+    case MATCH_C_MV & MASK_C_ADDI: // and C.ADD
+      if (!rs2)
+        return 0; // C.JR, C.JALR, C.EBREAK
+      regs[rd] = (insn & (1 << 12) ? regs[rd] : 0) + regs[rs2];
+      break;
+    default:
+      return 0;
+  }
+
+  return next;
+}
+#endif
+
+// Do an integer instruction just as the hart would have, returning the
+// address of the next one, or 0 if the instruction is not one of these
+static uintptr_t run_ahead_simple(uintptr_t* regs, uintptr_t pc, insn_t insn)
+{
+  uintptr_t rs1 = GET_RS1(insn, regs), rs2 = GET_RS2(insn, regs), val;
+  uintptr_t next = pc + 4;
+  int funct3 = RV_X(insn, 12, 3), funct7 = RV_X(insn, 25, 7);
+
+  switch (insn & 0x7f)
+  {
+    case 0x13: // OP-IMM
+      // only SRAI has the bit that makes ADD a SUB, and the shifts have
+      // nothing else above their shift amount
+      if ((funct3 == 1 || funct3 == 5)
+          && (RV_X(insn, 20, 12) & ~(__riscv_xlen - 1) & ~0x400))
+        return 0;
+      if (run_ahead_alu(funct3, (funct3 == 1 || funct3 == 5) && (funct7 & 0x20), rs1, IMM_I(insn), &val))
+        return 0;
+      break;
+    case 0x33: // OP
+      if ((funct7 & ~0x20) || run_ahead_alu(funct3, funct7, rs1, rs2, &val))
+        return 0;
+      break;
+#if __riscv_xlen == 64
+    case 0x1b: // OP-IMM-32
+      if (funct3 != 0 && (funct7 & ~0x20))
+        return 0;
+      if (run_ahead_alu32(funct3, funct3 != 0 && funct7, rs1, IMM_I(insn), &val))
+        return 0;
+      break;
+    case 0x3b: // OP-32
+      if ((funct7 & ~0x20) || run_ahead_alu32(funct3, funct7, rs1, rs2, &val))
+        return 0;
+      break;
+#endif
+    case 0x37: // LUI
+      val = U_IMM(insn);
+      break;
+    case 0x17: // AUIPC
+      val = pc + U_IMM(insn);
+      break;
+    case 0x6f: // JAL
+      val = pc + 4;
+      next = pc + J_IMM(insn);
+      break;
+    case 0x63: // BRANCH
+      switch (funct3)
+      {
+        case 0: val = rs1 == rs2; break;
+        case 1: val = rs1 != rs2; break;
+        case 4: val = (intptr_t)rs1 < (intptr_t)rs2; break;
+        case 5: val = (intptr_t)rs1 >= (intptr_t)rs2; break;
+        case 6: val = rs1 < rs2; break;
+        case 7: val = rs1 >= rs2; break;
+        default: return 0;
+      }
+      if (val)
+        next = pc + B_IMM(insn);
+      return next % RUN_AHEAD_ALIGN ? 0 : next;
+#ifdef __riscv_compressed
+    default:
+      return run_ahead_simple_rvc(regs, pc, insn);
+#else
+    default:
+      return 0;
+#endif
+  }
+
+  if (next % RUN_AHEAD_ALIGN)
+    return 0;
+  SET_RD(insn, regs, val);
+  return next;
+}
+
+void emulate_run_ahead(uintptr_t* regs, uintptr_t mepc, int category)
+{
+  // CSR accesses are not run ahead of, nor over: they may change state
+  // the instructions after them depend on, and time is often polled
+  if (category == EMULATION_SYSTEM)
+    return;
+
+  // Only what has trapped is emulated: a hart may well do misaligned
+  // accesses, or FP arithmetic, that bbl would also emulate
+  static int trapped;
+  trapped |= 1 << category;
+
+  uintptr_t page = mepc & -RISCV_PGSIZE;
+  uintptr_t pc = read_csr(mepc), mstatus;
+
+  for (int n = 0, simple = 0; n < RUN_AHEAD_MAX; n++) {
+    // an instruction with rd x0 leaves its result in x0's slot
+    regs[0] = 0;
+    if (pc - page > RISCV_PGSIZE - 4 || (read_csr(mip) & read_csr(mie)))
+      break;
+
+    insn_t insn = get_insn(pc, &mstatus);
+    emulation_func f = run_ahead_emulator(pc, insn, &category);
+    uintptr_t addr, next;
+
+    if (f && (trapped & (1 << category))) {
+      write_csr(mcause, CAUSE_ILLEGAL_INSTRUCTION);
+      write_csr(mtval, insn);
+      uintptr_t cycle0 = emulation_begin(category);
+      if ((insn & 3) == 3)
+        write_csr(mepc, pc + 4);
+      f(regs, CAUSE_ILLEGAL_INSTRUCTION, pc, mstatus, insn);
+      emulation_end_run_ahead(pc, cycle0);
+    } else if ((category = run_ahead_misaligned(regs, insn, &addr)) >= 0
+               && (trapped & (1 << category))) {
+      uintptr_t cause = category == EMULATION_MISALIGNED_LOAD ? CAUSE_MISALIGNED_LOAD : CAUSE_MISALIGNED_STORE;
+      write_csr(mcause, cause);
+      write_csr(mtval, addr);
+      uintptr_t cycle0 = emulation_begin(category);
+      if (cause == CAUSE_MISALIGNED_LOAD)
+        emulate_misaligned_load(regs, cause, pc, mstatus, insn);
+      else
+        emulate_misaligned_store(regs, cause, pc, mstatus, insn);
+      emulation_end_run_ahead(pc, cycle0);
+    } else if (simple < RUN_AHEAD_MAX_SIMPLE && (next = run_ahead_simple(regs, pc, insn))) {
+      // left where it is, should nothing follow that traps, as the
+      // payload would just have done it itself
+      simple++;
+      pc = next;
+      continue;
+    } else {
+      break;
+    }
+
+    simple = 0;
+    pc = read_csr(mepc);
+  }
+
+  write_csr(mepc, pc);
+}
+
+#else
+
+void emulate_run_ahead(uintptr_t* regs, uintptr_t mepc, int category)
+{
+}
+
+#endif
@@ -13,6 +13,14 @@ typedef void (*emulation_func)(uintptr_t*, uintptr_t, uintptr_t, uintptr_t, insn
 
 void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
 void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
+// the same, for emulators that find a misaligned access themselves
+void misaligned_load(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
+void misaligned_store(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc);
+// and for those that have the instruction already
+DECLARE_EMULATION_FUNC(emulate_misaligned_load);
+DECLARE_EMULATION_FUNC(emulate_misaligned_store);
+// go on to emulate what follows an instruction emulated at mepc
+void emulate_run_ahead(uintptr_t* regs, uintptr_t mepc, int category);
 void redirect_trap(uintptr_t epc, uintptr_t mstatus, uintptr_t badaddr);
 DECLARE_EMULATION_FUNC(truly_illegal_insn);
 DECLARE_EMULATION_FUNC(emulate_rvc_0);
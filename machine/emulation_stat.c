@@ -0,0 +1,73 @@
+// See LICENSE for license details.
+
+#include "emulation_stat.h"
+#include "mtrap.h"
+#include "hart_mask.h"
+#include <string.h>
+
+// Only its own hart updates these, with M-mode interrupts off.  Another
+// hart's reads race with the updates, which is fine for statistics.
+static emulation_stat_t emulation_stats[MAX_HARTS];
+static int emulation_current[MAX_HARTS];
+
+uintptr_t emulation_begin(int category)
+{
+  emulation_current[read_csr(mhartid)] = category;
+  return read_csr(mcycle);
+}
+
+// An emulation that turns out to be of another kind than it was
+// begun as, such as a misaligned access from a vector instruction
+void emulation_category(int category)
+{
+  emulation_current[read_csr(mhartid)] = category;
+}
+
+void emulation_end(uintptr_t mepc, uintptr_t cycle0)
+{
+  uintptr_t cycles = read_csr(mcycle) - cycle0;
+  uintptr_t hart = read_csr(mhartid);
+  emulation_stat_t* s = &emulation_stats[hart];
+
+  s->category[emulation_current[hart]].count++;
+  s->category[emulation_current[hart]].cycles += cycles;
+
+  // A PC not in the table takes the place of the one with the fewest
+  // emulations and inherits its count, so a PC that keeps trapping
+  // cannot be pushed out by a stream of one-off ones.  Counts are thus
+  // upper bounds.
+  int victim = 0;
+  for (int i = 0; i < EMULATION_HOT_PCS; i++) {
+    if (s->hot[i].mepc == mepc && s->hot[i].total.count) {
+      s->hot[i].total.count++;
+      s->hot[i].total.cycles += cycles;
+      return;
+    }
+    if (s->hot[i].total.count < s->hot[victim].total.count)
+      victim = i;
+  }
+
+  s->hot[victim].mepc = mepc;
+  s->hot[victim].total.count++;
+  s->hot[victim].total.cycles = cycles;
+}
+
+// The same, for an instruction emulated while running ahead of a trap
+void emulation_end_run_ahead(uintptr_t mepc, uintptr_t cycle0)
+{
+  emulation_stats[read_csr(mhartid)].run_ahead++;
+  emulation_end(mepc, cycle0);
+}
+
+const emulation_stat_t* emulation_stat(uintptr_t hartid)
+{
+  if (hartid >= MAX_HARTS)
+    return NULL;
+  return &emulation_stats[hartid];
+}
+
+void emulation_stat_reset(uintptr_t hartid)
+{
+  if (hartid < MAX_HARTS)
+    memset(&emulation_stats[hartid], 0, sizeof(emulation_stats[hartid]));
+}
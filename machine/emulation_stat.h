@@ -0,0 +1,46 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_EMULATION_STAT_H
+#define _RISCV_EMULATION_STAT_H
+
+#include <stdint.h>
+
+// Where M-mode spends its time emulating for the payload, per hart: a
+// count and cycle total per kind of emulation, and the trapping PCs that
+// cost the most.  The layout is the same on RV32 and RV64, as the SBI
+// hands it to the payload as is.
+
+#define EMULATION_MISALIGNED_LOAD   0
+#define EMULATION_MISALIGNED_STORE  1
+#define EMULATION_MISALIGNED_VECTOR 2
+#define EMULATION_FP                3
+#define EMULATION_MULDIV            4
+#define EMULATION_SYSTEM            5 // CSRs, mostly time
+#define EMULATION_ILLEGAL           6 // not emulated: sent on to the payload
+#define EMULATION_CATEGORIES        7
+
+#define EMULATION_HOT_PCS 8
+
+typedef struct {
+  uint64_t count;
+  uint64_t cycles;
+} emulation_count_t;
+
+typedef struct {
+  emulation_count_t category[EMULATION_CATEGORIES];
+  struct {
+    uint64_t mepc;
+    emulation_count_t total;
+  } hot[EMULATION_HOT_PCS];
+  uint64_t run_ahead; // emulated without a trap of their own
+} emulation_stat_t;
+
+uintptr_t emulation_begin(int category);
+void emulation_category(int category);
+void emulation_end(uintptr_t mepc, uintptr_t cycle0);
+void emulation_end_run_ahead(uintptr_t mepc, uintptr_t cycle0);
+
+const emulation_stat_t* emulation_stat(uintptr_t hartid); // NULL if no such hart
+void emulation_stat_reset(uintptr_t hartid);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include "bits.h"
 #include "config.h"
 #include "fdt.h"
 #include "mtrap.h"
@@ -149,306 +150,618 @@ int fdt_string_list_index(const struct fdt_scan_prop *prop, const char *str)
   return -1;
 }
 
-//////////////////////////////////////////// MEMORY SCAN /////////////////////////////////////////
+//////////////////////////////////////////// INDEX //////////////////////////////////////////////
+
+// The queries and filters below look nodes up in a table built by one
+// pass over the FDT, instead of each walking the whole tree again.
+// Only properties with a known name are kept; those names are resolved
+// to string-table offsets once, so indexing compares integers.
+//
+// A first pass counts the nodes and properties, so the table fits any
+// tree.  It is carved once from the top of the memory holding this
+// code, below whatever the FDT says is in use there, and is only
+// needed until the payload runs.
+
+struct fdt_index_node {
+  uint32_t name;          // offset from the FDT base; FDT_BEGIN_NODE is just before
+  uint32_t end;           // offset just past FDT_END_NODE
+  int32_t parent;         // -1 for the root
+  uint32_t first_prop;    // the props run up to the next node's first_prop
+  uint8_t address_cells;  // for the children's reg
+  uint8_t size_cells;
+  uint8_t deleted;
+};
+
+struct fdt_index_prop {
+  uint32_t value;         // offset from the FDT base
+  uint32_t len;
+  uint32_t name;          // FDT_NAME_*
+};
 
-struct mem_scan {
-  int memory;
-  const uint32_t *reg_value;
-  int reg_len;
+static const char *const fdt_names[FDT_NAMES] = {
+  [FDT_NAME_ADDRESS_CELLS]        = "#address-cells",
+  [FDT_NAME_SIZE_CELLS]           = "#size-cells",
+  [FDT_NAME_COMPATIBLE]           = "compatible",
+  [FDT_NAME_DEVICE_TYPE]          = "device_type",
+  [FDT_NAME_REG]                  = "reg",
+  [FDT_NAME_STATUS]               = "status",
+  [FDT_NAME_PHANDLE]              = "phandle",
+  [FDT_NAME_MMU_TYPE]             = "mmu-type",
+  [FDT_NAME_INTERRUPT_CONTROLLER] = "interrupt-controller",
+  [FDT_NAME_INTERRUPT_CELLS]      = "#interrupt-cells",
+  [FDT_NAME_INTERRUPTS_EXTENDED]  = "interrupts-extended",
+  [FDT_NAME_INTERRUPTS]           = "interrupts",
+  [FDT_NAME_NDEV]                 = "riscv,ndev",
+  [FDT_NAME_CBOZ_BLOCK_SIZE]      = "riscv,cboz-block-size",
+  [FDT_NAME_KERNEL_START]         = "riscv,kernel-start",
+  [FDT_NAME_KERNEL_END]           = "riscv,kernel-end",
+  [FDT_NAME_REG_SHIFT]            = "reg-shift",
+  [FDT_NAME_REG_OFFSET]           = "reg-offset",
+  [FDT_NAME_CURRENT_SPEED]        = "current-speed",
+  [FDT_NAME_CLOCK_FREQUENCY]      = "clock-frequency",
+  [FDT_NAME_ISA]                  = "riscv,isa",
+  [FDT_NAME_ISA_EXTENSIONS]       = "riscv,isa-extensions",
 };
 
-static void mem_open(const struct fdt_scan_node *node, void *extra)
+static struct fdt_index_node *index_nodes; // index_nnodes + 1; the last ends the last node's props
+static struct fdt_index_prop *index_props;
+static int index_nnodes;
+static uintptr_t index_fdt; // the FDT described, or 0
+static uintptr_t index_arena; // where the tables live, or 0
+static uintptr_t index_arena_size;
+static uint32_t index_name_offs[FDT_NAMES];
+static bool index_dup_names;
+
+// What the first pass finds
+struct fdt_index_plan {
+  int nnodes;
+  int nprops;
+  uint64_t mem_end;       // of the memory node holding this code, or 0
+  uint64_t kernel[2];     // /chosen's riscv,kernel-start and -end
+  uint64_t initrd[2];     // /chosen's linux,initrd-start and -end
+};
+
+static int fdt_prop_name(uint32_t off)
 {
-  struct mem_scan *scan = (struct mem_scan *)extra;
-  memset(scan, 0, sizeof(*scan));
+  struct fdt_header *header = (struct fdt_header *)index_fdt;
+  const char *strings = (const char *)(index_fdt + bswap(header->off_dt_strings));
+  int name;
+  for (name = 0; name < FDT_NAMES; name++)
+    if (off == index_name_offs[name] || (index_dup_names && !strcmp(strings + off, fdt_names[name])))
+      break;
+  return name;
 }
 
-static void mem_prop(const struct fdt_scan_prop *prop, void *extra)
+// A property of one or two cells, as /chosen's addresses may be either
+static uint64_t fdt_index_number(const uint32_t *value, uint32_t len)
 {
-  struct mem_scan *scan = (struct mem_scan *)extra;
-  if (!strcmp(prop->name, "device_type") && !strcmp((const char*)prop->value, "memory")) {
-    scan->memory = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    scan->reg_value = prop->value;
-    scan->reg_len = prop->len;
-  }
+  uint64_t result = 0;
+  for (uint32_t i = 0; i < len / 4 && i < 2; i++)
+    result = (result << 32) + bswap(value[i]);
+  return result;
 }
 
-static void mem_done(const struct fdt_scan_node *node, void *extra)
+static void fdt_index_count(uintptr_t fdt, struct fdt_index_plan *plan)
 {
-  struct mem_scan *scan = (struct mem_scan *)extra;
-  const uint32_t *value = scan->reg_value;
-  const uint32_t *end = value + scan->reg_len/4;
-  uintptr_t self = (uintptr_t)mem_done;
-
-  if (!scan->memory) return;
-  assert (scan->reg_value && scan->reg_len % 4 == 0);
-
-  while (end - value > 0) {
-    uint64_t base, size;
-    value = fdt_get_address(node->parent, value, &base);
-    value = fdt_get_size   (node->parent, value, &size);
-    if (base <= self && self <= base + size) { mem_size = size; }
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  const char *strings = (const char *)(fdt + bswap(header->off_dt_strings));
+  uint32_t *lex = (uint32_t *)(fdt + bswap(header->off_dt_struct));
+  uintptr_t self = (uintptr_t)fdt_index_count;
+  struct fdt_scan_node root = { NULL, NULL, 2, 1 };
+  const uint32_t *reg = NULL;
+  uint32_t reg_len = 0;
+  bool memory = false, chosen = false;
+  int depth = 0;
+
+  memset(plan, 0, sizeof(*plan));
+  while (1) {
+    uint32_t token = bswap(lex[0]);
+    if (token == FDT_NOP) {
+      lex += 1;
+    } else if (token == FDT_PROP) {
+      uint32_t len = bswap(lex[1]);
+      const char *name = strings + bswap(lex[2]);
+      const uint32_t *value = lex + 3;
+      if (depth > 0 && fdt_prop_name(bswap(lex[2])) < FDT_NAMES) plan->nprops++;
+      // the memory nodes and /chosen are children of the root
+      if (depth == 1 && !strcmp(name, "#address-cells")) root.address_cells = bswap(value[0]);
+      if (depth == 1 && !strcmp(name, "#size-cells"))    root.size_cells    = bswap(value[0]);
+      if (depth == 2 && !strcmp(name, "device_type")) memory = !strcmp((const char *)value, "memory");
+      if (depth == 2 && !strcmp(name, "reg")) { reg = value; reg_len = len; }
+      if (depth == 2 && chosen) {
+        if (!strcmp(name, "riscv,kernel-start"))  plan->kernel[0] = fdt_index_number(value, len);
+        if (!strcmp(name, "riscv,kernel-end"))    plan->kernel[1] = fdt_index_number(value, len);
+        if (!strcmp(name, "linux,initrd-start"))  plan->initrd[0] = fdt_index_number(value, len);
+        if (!strcmp(name, "linux,initrd-end"))    plan->initrd[1] = fdt_index_number(value, len);
+      }
+      lex += 3 + (len+3)/4;
+    } else if (token == FDT_BEGIN_NODE) {
+      const char *name = (const char *)(lex + 1);
+      plan->nnodes++;
+      if (++depth == 2) {
+        memory = false;
+        reg = NULL;
+        chosen = !strcmp(name, "chosen");
+      }
+      lex += 2 + strlen(name)/4;
+    } else if (token == FDT_END_NODE && depth > 0) {
+      int entry = root.address_cells + root.size_cells;
+      if (depth == 2 && memory && reg && entry > 0) {
+        for (const uint32_t *p = reg; p + entry <= reg + reg_len/4; p += entry) {
+          uint64_t base, size;
+          fdt_get_size(&root, fdt_get_address(&root, p, &base), &size);
+          if (base <= self && self < base + size) plan->mem_end = base + size;
+        }
+      }
+      depth--;
+      lex += 1;
+    } else { // FDT_END
+      return;
+    }
   }
-  assert (end == value);
 }
 
-void query_mem(uintptr_t fdt)
+static inline uint64_t fdt_index_avoid(uint64_t clash, uint64_t base, uint64_t top, uint64_t start, uint64_t end)
 {
-  struct fdt_cb cb;
-  struct mem_scan scan;
+  return start < top && base < end ? MIN(clash, start) : clash;
+}
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = mem_open;
-  cb.prop = mem_prop;
-  cb.done = mem_done;
-  cb.extra = &scan;
+// The lowest start of anything in use that overlaps [base, top), or
+// top if nothing does: the FDT itself, its memory reservations and the
+// kernel and initrd it points to
+static uint64_t fdt_index_clash(uintptr_t fdt, const struct fdt_index_plan *plan, uint64_t base, uint64_t top)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  const uint32_t *rsv = (const uint32_t *)(fdt + bswap(header->off_mem_rsvmap));
+  uint64_t clash = top;
+
+  clash = fdt_index_avoid(clash, base, top, fdt, fdt + bswap(header->totalsize));
+  clash = fdt_index_avoid(clash, base, top, plan->kernel[0], plan->kernel[1]);
+  clash = fdt_index_avoid(clash, base, top, plan->initrd[0], plan->initrd[1]);
+  for (; rsv[0] | rsv[1] | rsv[2] | rsv[3]; rsv += 4) {
+    uint64_t start = (uint64_t)bswap(rsv[0]) << 32 | bswap(rsv[1]);
+    uint64_t size  = (uint64_t)bswap(rsv[2]) << 32 | bswap(rsv[3]);
+    clash = fdt_index_avoid(clash, base, top, start, start + size);
+  }
+  return clash;
+}
 
-  mem_size = 0;
-  fdt_scan(fdt, &cb);
-  assert (mem_size > 0);
+static void fdt_index_place(uintptr_t fdt, const struct fdt_index_plan *plan, uintptr_t size)
+{
+  extern char _end;
+  uint64_t floor = ROUNDUP((uintptr_t)&_end, RISCV_PGSIZE);
+
+  // a spare page lets bbl re-index its copy after adding /chosen
+  size = ROUNDUP(size, RISCV_PGSIZE) + RISCV_PGSIZE;
+  for (uint64_t top = plan->mem_end & -(uint64_t)RISCV_PGSIZE; top >= floor + size; ) {
+    uint64_t clash = fdt_index_clash(fdt, plan, top - size, top);
+    if (clash == top) {
+      index_arena = top - size;
+      index_arena_size = size;
+      return;
+    }
+    top = clash & -(uint64_t)RISCV_PGSIZE;
+  }
+  die("fdt: no free memory for an index of %d nodes", plan->nnodes);
 }
 
-///////////////////////////////////////////// HART SCAN //////////////////////////////////////////
+void fdt_index(uintptr_t fdt)
+{
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  struct fdt_index_plan plan;
+  int node = -1, nprops = 0;
 
-static uint32_t hart_phandles[MAX_HARTS];
-uint64_t hart_mask;
+  index_fdt = 0;
+  index_nnodes = 0;
 
-struct hart_scan {
-  const struct fdt_scan_node *cpu;
-  int hart;
-  const struct fdt_scan_node *controller;
-  int cells;
-  uint32_t phandle;
-};
+  // Only process FDT that we understand
+  if (bswap(header->magic) != FDT_MAGIC ||
+      bswap(header->last_comp_version) > FDT_VERSION) return;
 
-static void hart_open(const struct fdt_scan_node *node, void *extra)
-{
-  struct hart_scan *scan = (struct hart_scan *)extra;
-  if (!scan->cpu) {
-    scan->hart = -1;
+  const char *strings = (const char *)(fdt + bswap(header->off_dt_strings));
+  uint32_t size_strings = bswap(header->size_dt_strings);
+  uint32_t *lex = (uint32_t *)(fdt + bswap(header->off_dt_struct));
+
+  index_dup_names = false;
+  for (int i = 0; i < FDT_NAMES; i++)
+    index_name_offs[i] = UINT32_MAX;
+  for (uint32_t off = 0; off < size_strings; off += strlen(strings + off) + 1) {
+    for (int i = 0; i < FDT_NAMES; i++) {
+      if (!strcmp(strings + off, fdt_names[i])) {
+        if (index_name_offs[i] != UINT32_MAX) index_dup_names = true; // not deduplicated; compare strings
+        else index_name_offs[i] = off;
+        break;
+      }
+    }
   }
-  if (!scan->controller) {
-    scan->cells = 0;
-    scan->phandle = 0;
+  index_fdt = fdt;
+
+  fdt_index_count(fdt, &plan);
+  uintptr_t size = (plan.nnodes + 1) * sizeof(struct fdt_index_node) +
+                   plan.nprops * sizeof(struct fdt_index_prop);
+  if (!index_arena)
+    fdt_index_place(fdt, &plan, size);
+  if (size > index_arena_size)
+    die("fdt: an index of %d nodes outgrows its %ld bytes", plan.nnodes, (long)index_arena_size);
+  index_nodes = (struct fdt_index_node *)index_arena;
+  index_props = (struct fdt_index_prop *)(index_nodes + plan.nnodes + 1);
+  index_nodes[0].first_prop = 0;
+
+  while (1) {
+    uint32_t token = bswap(lex[0]);
+    if (token == FDT_NOP) {
+      lex += 1;
+    } else if (token == FDT_PROP) {
+      uint32_t len = bswap(lex[1]);
+      int name = fdt_prop_name(bswap(lex[2]));
+      if (node >= 0 && name < FDT_NAMES) {
+        index_props[nprops].value = (uintptr_t)(lex + 3) - fdt;
+        index_props[nprops].len = len;
+        index_props[nprops].name = name;
+        nprops++;
+        if (name == FDT_NAME_ADDRESS_CELLS) index_nodes[node].address_cells = bswap(lex[3]);
+        if (name == FDT_NAME_SIZE_CELLS)    index_nodes[node].size_cells    = bswap(lex[3]);
+      }
+      lex += 3 + (len+3)/4;
+    } else if (token == FDT_BEGIN_NODE) {
+      struct fdt_index_node *n = &index_nodes[index_nnodes];
+      n->name = (uintptr_t)(lex + 1) - fdt;
+      n->parent = node;
+      n->first_prop = nprops;
+      // these are the default cell counts, as per the FDT spec
+      n->address_cells = 2;
+      n->size_cells = 1;
+      n->deleted = 0;
+      node = index_nnodes++;
+      lex += 2 + strlen((const char *)(lex + 1))/4;
+    } else if (token == FDT_END_NODE && node >= 0) {
+      index_nodes[node].end = (uintptr_t)(lex + 1) - fdt;
+      node = index_nodes[node].parent;
+      lex += 1;
+    } else { // FDT_END
+      index_nodes[index_nnodes].first_prop = nprops;
+      return;
+    }
   }
 }
 
-static void hart_prop(const struct fdt_scan_prop *prop, void *extra)
-{
-  struct hart_scan *scan = (struct hart_scan *)extra;
-  if (!strcmp(prop->name, "device_type") && !strcmp((const char*)prop->value, "cpu")) {
-    assert (!scan->cpu);
-    scan->cpu = prop->node;
-  } else if (!strcmp(prop->name, "interrupt-controller")) {
-    assert (!scan->controller);
-    scan->controller = prop->node;
-  } else if (!strcmp(prop->name, "#interrupt-cells")) {
-    scan->cells = bswap(prop->value[0]);
-  } else if (!strcmp(prop->name, "phandle")) {
-    scan->phandle = bswap(prop->value[0]);
-  } else if (!strcmp(prop->name, "reg")) {
-    uint64_t reg;
-    fdt_get_address(prop->node->parent, prop->value, &reg);
-    scan->hart = reg;
-  }
+void fdt_index_copy(uintptr_t dest, uintptr_t src)
+{
+  if (src == index_fdt)
+    index_fdt = dest;
+  else
+    fdt_index(dest);
 }
 
-static void hart_done(const struct fdt_scan_node *node, void *extra)
+uintptr_t fdt_index_base()
 {
-  struct hart_scan *scan = (struct hart_scan *)extra;
+  return index_arena;
+}
 
-  if (scan->cpu == node) {
-    assert (scan->hart >= 0);
-  }
+static inline void fdt_indexed(uintptr_t fdt)
+{
+  if (fdt != index_fdt)
+    fdt_index(fdt);
+}
 
-  if (scan->controller == node && scan->cpu) {
-    assert (scan->phandle > 0);
-    assert (scan->cells == 1);
+//////////////////////////////////////////// LOOKUP /////////////////////////////////////////////
 
-    if (scan->hart < MAX_HARTS) {
-      hart_phandles[scan->hart] = scan->phandle;
-      hart_mask |= 1 << scan->hart;
-      hls_init(scan->hart);
-    }
-  }
+static struct fdt_index_prop *fdt_index_prop(int node, int name)
+{
+  if (node < 0 || node >= index_nnodes) return NULL;
+  for (int i = index_nodes[node].first_prop; i < index_nodes[node+1].first_prop; i++)
+    if (index_props[i].name == name)
+      return &index_props[i];
+  return NULL;
 }
 
-static int hart_close(const struct fdt_scan_node *node, void *extra)
+int fdt_get_prop(uintptr_t fdt, int node, int name, struct fdt_scan_prop *prop)
 {
-  struct hart_scan *scan = (struct hart_scan *)extra;
-  if (scan->cpu == node) scan->cpu = 0;
-  if (scan->controller == node) scan->controller = 0;
+  fdt_indexed(fdt);
+  struct fdt_index_prop *p = fdt_index_prop(node, name);
+  if (!p) return -1;
+
+  prop->node = NULL;
+  prop->name = fdt_names[name];
+  prop->value = (uint32_t *)(fdt + p->value);
+  prop->len = p->len;
   return 0;
 }
 
-void query_harts(uintptr_t fdt)
+int fdt_match(uintptr_t fdt, int node, int name, const char *str)
 {
-  struct fdt_cb cb;
-  struct hart_scan scan;
+  struct fdt_scan_prop prop;
+  if (fdt_get_prop(fdt, node, name, &prop)) return 0;
+  return !str || fdt_string_list_index(&prop, str) >= 0;
+}
 
-  memset(&cb, 0, sizeof(cb));
-  memset(&scan, 0, sizeof(scan));
-  cb.open = hart_open;
-  cb.prop = hart_prop;
-  cb.done = hart_done;
-  cb.close= hart_close;
-  cb.extra = &scan;
+int fdt_next_node(uintptr_t fdt, int node, int name, const char *str)
+{
+  fdt_indexed(fdt);
+  for (node = node < 0 ? 0 : node + 1; node < index_nnodes; node++)
+    if (!index_nodes[node].deleted && fdt_match(fdt, node, name, str))
+      return node;
+  return -1;
+}
 
-  fdt_scan(fdt, &cb);
+int fdt_parent(uintptr_t fdt, int node)
+{
+  fdt_indexed(fdt);
+  if (node < 0 || node >= index_nnodes) return -1;
+  return index_nodes[node].parent;
+}
 
-  // The current hart should have been detected
-  assert ((hart_mask >> read_csr(mhartid)) != 0);
+int fdt_find_child(uintptr_t fdt, int parent, const char *name)
+{
+  fdt_indexed(fdt);
+  for (int node = parent + 1; node < index_nnodes; node++)
+    if (index_nodes[node].parent == parent && !index_nodes[node].deleted &&
+        !strcmp((const char *)(fdt + index_nodes[node].name), name))
+      return node;
+  return -1;
 }
 
-///////////////////////////////////////////// CLINT SCAN /////////////////////////////////////////
+// The cell counts a node's own reg is decoded with
+static struct fdt_scan_node fdt_index_cells(int node)
+{
+  struct fdt_scan_node cells = { NULL, NULL, 2, 1 };
+  int parent = index_nodes[node].parent;
+  if (parent >= 0) {
+    cells.address_cells = index_nodes[parent].address_cells;
+    cells.size_cells = index_nodes[parent].size_cells;
+  }
+  return cells;
+}
 
-struct clint_scan
+int fdt_get_reg(uintptr_t fdt, int node, int index, uint64_t *base, uint64_t *size)
 {
-  int compat;
-  uint64_t reg;
-  const uint32_t *int_value;
-  int int_len;
-  int done;
-};
+  struct fdt_scan_prop prop;
+  if (fdt_get_prop(fdt, node, FDT_NAME_REG, &prop)) return -1;
+
+  struct fdt_scan_node cells = fdt_index_cells(node);
+  int entry = cells.address_cells + cells.size_cells;
+  if (entry == 0 || (index + 1) * entry * 4 > prop.len) return -1;
+
+  const uint32_t *value = fdt_get_address(&cells, prop.value + index * entry, base);
+  if (size) fdt_get_size(&cells, value, size);
+  return 0;
+}
 
-static void clint_open(const struct fdt_scan_node *node, void *extra)
+int fdt_get_prop_address(uintptr_t fdt, int node, int name, uint64_t *value)
 {
-  struct clint_scan *scan = (struct clint_scan *)extra;
-  scan->compat = 0;
-  scan->reg = 0;
-  scan->int_value = 0;
+  struct fdt_scan_prop prop;
+  if (fdt_get_prop(fdt, node, name, &prop)) return -1;
+
+  struct fdt_scan_node cells = fdt_index_cells(node);
+  if (cells.address_cells * 4 > prop.len) return -1;
+  fdt_get_address(&cells, prop.value, value);
+  return 0;
 }
 
-static void clint_prop(const struct fdt_scan_prop *prop, void *extra)
+void fdt_delete_node(uintptr_t fdt, int node)
 {
-  struct clint_scan *scan = (struct clint_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "riscv,clint0") >= 0) {
-    scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    fdt_get_address(prop->node->parent, prop->value, &scan->reg);
-  } else if (!strcmp(prop->name, "interrupts-extended")) {
-    scan->int_value = prop->value;
-    scan->int_len = prop->len;
+  fdt_indexed(fdt);
+  if (node < 0 || node >= index_nnodes) return;
+
+  uint32_t *lex = (uint32_t *)(fdt + index_nodes[node].name) - 1;
+  uint32_t *end = (uint32_t *)(fdt + index_nodes[node].end);
+  while (lex != end) *lex++ = bswap(FDT_NOP);
+
+  // the children follow in tree order
+  for (int i = node; i < index_nnodes && index_nodes[i].name < index_nodes[node].end; i++)
+    index_nodes[i].deleted = 1;
+}
+
+//////////////////////////////////////////// MEMORY SCAN /////////////////////////////////////////
+
+void query_mem(uintptr_t fdt)
+{
+  uintptr_t self = (uintptr_t)query_mem;
+
+  mem_size = 0;
+  for (int node = -1; (node = fdt_next_node(fdt, node, FDT_NAME_DEVICE_TYPE, "memory")) >= 0; ) {
+    uint64_t base, size;
+    assert (fdt_get_reg(fdt, node, 0, &base, &size) == 0);
+    for (int index = 0; fdt_get_reg(fdt, node, index, &base, &size) == 0; ++index)
+      if (base <= self && self <= base + size) { mem_size = size; }
   }
+  assert (mem_size > 0);
 }
 
-static void clint_done(const struct fdt_scan_node *node, void *extra)
+///////////////////////////////////////////// HART SCAN //////////////////////////////////////////
+
+static uint32_t hart_phandles[MAX_HARTS];
+hart_mask_t hart_mask;
+
+// The hart whose interrupt controller has this phandle, or -1
+static long hart_by_phandle(uint32_t phandle)
 {
-  struct clint_scan *scan = (struct clint_scan *)extra;
-  const uint32_t *value = scan->int_value;
-  const uint32_t *end = value + scan->int_len/4;
+  for_each_hart(hart, &hart_mask)
+    if (hart_phandles[hart] == phandle)
+      return hart;
+  return -1;
+}
 
-  if (!scan->compat) return;
-  assert (scan->reg != 0);
-  assert (scan->int_value && scan->int_len % 16 == 0);
-  assert (!scan->done); // only one clint
+void query_harts(uintptr_t fdt)
+{
+  struct fdt_scan_prop prop;
+  long min_cboz_block_size = -1;
 
-  scan->done = 1;
-  mtime = (void*)((uintptr_t)scan->reg + 0xbff8);
+  for (int cpu = -1; (cpu = fdt_next_node(fdt, cpu, FDT_NAME_DEVICE_TYPE, "cpu")) >= 0; ) {
+    uint64_t reg;
+    uint32_t cboz_block_size = 0;
+    assert (fdt_get_reg(fdt, cpu, 0, &reg, NULL) == 0);
+    if (fdt_get_prop(fdt, cpu, FDT_NAME_CBOZ_BLOCK_SIZE, &prop) == 0)
+      cboz_block_size = fdt_get_value(&prop, 0);
+    if (min_cboz_block_size < 0 || cboz_block_size < min_cboz_block_size)
+      min_cboz_block_size = cboz_block_size;
+  }
 
-  for (int index = 0; end - value > 0; ++index) {
-    uint32_t phandle = bswap(value[0]);
-    int hart;
-    for (hart = 0; hart < MAX_HARTS; ++hart)
-      if (hart_phandles[hart] == phandle)
-        break;
+  // A hart is usable once its local interrupt controller is found
+  for (int intc = -1; (intc = fdt_next_node(fdt, intc, FDT_NAME_INTERRUPT_CONTROLLER, NULL)) >= 0; ) {
+    int cpu = fdt_parent(fdt, intc);
+    uint64_t hart;
+    uint32_t phandle = 0, cells = 0;
+
+    if (!fdt_match(fdt, cpu, FDT_NAME_DEVICE_TYPE, "cpu")) continue;
+    if (fdt_get_prop(fdt, intc, FDT_NAME_PHANDLE, &prop) == 0)
+      phandle = fdt_get_value(&prop, 0);
+    if (fdt_get_prop(fdt, intc, FDT_NAME_INTERRUPT_CELLS, &prop) == 0)
+      cells = fdt_get_value(&prop, 0);
+    assert (phandle > 0);
+    assert (cells == 1);
+
+    fdt_get_reg(fdt, cpu, 0, &hart, NULL);
     if (hart < MAX_HARTS) {
-      hls_t *hls = OTHER_HLS(hart);
-      hls->ipi = (void*)((uintptr_t)scan->reg + index * 4);
-      hls->timecmp = (void*)((uintptr_t)scan->reg + 0x4000 + (index * 8));
+      hart_phandles[hart] = phandle;
+      hart_mask_set(&hart_mask, hart);
+      hls_init(hart);
     }
-    value += 4;
   }
+
+  // The current hart should have been detected
+  assert (hart_mask_test(&hart_mask, read_csr(mhartid)));
+
+  // memset may use cbo.zero only if every hart implements it
+  long block = min_cboz_block_size;
+  if (block >= (long)sizeof(uintptr_t) && (block & (block - 1)) == 0)
+    cbo_zero_block_size = block;
 }
 
-void query_clint(uintptr_t fdt)
+///////////////////////////////////////////// CLINT SCAN /////////////////////////////////////////
+
+// The hart wired to the index'th interrupt of a device's
+// interrupts-extended, or -1; each interrupt takes cells cells
+static long hart_by_interrupt(const struct fdt_scan_prop *prop, int cells, int index)
 {
-  struct fdt_cb cb;
-  struct clint_scan scan;
+  const uint32_t *value = (const uint32_t *)prop->value + index * cells;
+  return hart_by_phandle(bswap(value[0]));
+}
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = clint_open;
-  cb.prop = clint_prop;
-  cb.done = clint_done;
-  cb.extra = &scan;
+// ACLINT splits the CLINT into a device per function, with one of each
+// per socket on larger machines.  The M-mode ones stand in for the CLINT.
+static void query_aclint(uintptr_t fdt)
+{
+  struct fdt_scan_prop prop;
+  uint64_t reg, size, mtime_reg, mtime_size;
+
+  for (int node = -1; (node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, "riscv,aclint-mswi")) >= 0; ) {
+    assert (fdt_get_reg(fdt, node, 0, &reg, NULL) == 0 && reg != 0);
+    assert (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS_EXTENDED, &prop) == 0 && prop.len % 8 == 0);
+    for (int index = 0; index < prop.len / 8; ++index) {
+      long hart = hart_by_interrupt(&prop, 2, index);
+      if (hart >= 0)
+        OTHER_HLS(hart)->ipi = (void*)((uintptr_t)reg + index * 4);
+    }
+  }
 
-  scan.done = 0;
-  fdt_scan(fdt, &cb);
-  assert (scan.done);
-}
+  // reg is mtime, then the mtimecmp array.  Some trees list them the
+  // other way round; mtime is never the larger region.
+  for (int node = -1; (node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, "riscv,aclint-mtimer")) >= 0; ) {
+    assert (fdt_get_reg(fdt, node, 0, &mtime_reg, &mtime_size) == 0 && mtime_reg != 0);
+    assert (fdt_get_reg(fdt, node, 1, &reg, &size) == 0 && reg != 0);
+    if (mtime_size > size) {
+      uint64_t tmp = reg;
+      reg = mtime_reg;
+      mtime_reg = tmp;
+    }
+    assert (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS_EXTENDED, &prop) == 0 && prop.len % 8 == 0);
+    mtime = (void*)(uintptr_t)mtime_reg;
+    for (int index = 0; index < prop.len / 8; ++index) {
+      long hart = hart_by_interrupt(&prop, 2, index);
+      if (hart >= 0)
+        OTHER_HLS(hart)->timecmp = (void*)((uintptr_t)reg + index * 8);
+    }
+  }
 
-///////////////////////////////////////////// PLIC SCAN /////////////////////////////////////////
+  assert (mtime);
+}
 
-struct plic_scan
+void query_clint(uintptr_t fdt)
 {
-  int compat;
+  struct fdt_scan_prop prop;
   uint64_t reg;
-  uint32_t *int_value;
-  int int_len;
-  int done;
-  int ndev;
-};
+  int node = fdt_next_node(fdt, -1, FDT_NAME_COMPATIBLE, "riscv,clint0");
 
-static void plic_open(const struct fdt_scan_node *node, void *extra)
-{
-  struct plic_scan *scan = (struct plic_scan *)extra;
-  scan->compat = 0;
-  scan->reg = 0;
-  scan->int_value = 0;
+  if (node < 0) {
+    query_aclint(fdt);
+    return;
+  }
+  assert (fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, "riscv,clint0") < 0); // only one clint
+  assert (fdt_get_reg(fdt, node, 0, &reg, NULL) == 0 && reg != 0);
+  assert (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS_EXTENDED, &prop) == 0 && prop.len % 16 == 0);
+
+  mtime = (void*)((uintptr_t)reg + 0xbff8);
+
+  for (int index = 0; index < prop.len / 16; ++index) {
+    long hart = hart_by_interrupt(&prop, 4, index);
+    if (hart >= 0) {
+      hls_t *hls = OTHER_HLS(hart);
+      hls->ipi = (void*)((uintptr_t)reg + index * 4);
+      hls->timecmp = (void*)((uintptr_t)reg + 0x4000 + (index * 8));
+    }
+  }
 }
 
-static void plic_prop(const struct fdt_scan_prop *prop, void *extra)
+// An ACLINT SSWI raises a hart's supervisor software interrupt directly.
+// The payload gets the device, and SBI IPIs use it too.
+void query_sswi(uintptr_t fdt)
 {
-  struct plic_scan *scan = (struct plic_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "riscv,plic0") >= 0) {
-    scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    fdt_get_address(prop->node->parent, prop->value, &scan->reg);
-  } else if (!strcmp(prop->name, "interrupts-extended")) {
-    scan->int_value = prop->value;
-    scan->int_len = prop->len;
-  } else if (!strcmp(prop->name, "riscv,ndev")) {
-    scan->ndev = bswap(prop->value[0]);
+  struct fdt_scan_prop prop;
+  uint64_t reg;
+
+  for (int node = -1; (node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, "riscv,aclint-sswi")) >= 0; ) {
+    assert (fdt_get_reg(fdt, node, 0, &reg, NULL) == 0 && reg != 0);
+    assert (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS_EXTENDED, &prop) == 0 && prop.len % 8 == 0);
+    for (int index = 0; index < prop.len / 8; ++index) {
+      long hart = hart_by_interrupt(&prop, 2, index);
+      uint32_t cpu_int = bswap(((const uint32_t *)prop.value)[2 * index + 1]);
+      if (hart >= 0 && cpu_int == IRQ_S_SOFT)
+        OTHER_HLS(hart)->sswi = (void*)((uintptr_t)reg + index * 4);
+    }
   }
 }
 
+///////////////////////////////////////////// PLIC SCAN /////////////////////////////////////////
+
 #define HART_BASE	0x200000
 #define HART_SIZE	0x1000
 #define ENABLE_BASE	0x2000
 #define ENABLE_SIZE	0x80
 
-static void plic_done(const struct fdt_scan_node *node, void *extra)
+void query_plic(uintptr_t fdt)
 {
-  struct plic_scan *scan = (struct plic_scan *)extra;
-  const uint32_t *value = scan->int_value;
-  const uint32_t *end = value + scan->int_len/4;
+  struct fdt_scan_prop prop;
+  uint64_t reg;
+  uint32_t ndev = 0;
+  int node = fdt_next_node(fdt, -1, FDT_NAME_COMPATIBLE, "riscv,plic0");
+
+  if (node < 0) return;
+  assert (fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, "riscv,plic0") < 0); // only one plic
+  assert (fdt_get_reg(fdt, node, 0, &reg, NULL) == 0 && reg != 0);
+  if (fdt_get_prop(fdt, node, FDT_NAME_NDEV, &prop) == 0)
+    ndev = fdt_get_value(&prop, 0);
+  assert (ndev < 1024);
+  assert (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS_EXTENDED, &prop) == 0 && prop.len % 8 == 0);
 
-  if (!scan->compat) return;
-  assert (scan->reg != 0);
-  assert (scan->int_value && scan->int_len % 8 == 0);
-  assert (scan->ndev >= 0 && scan->ndev < 1024);
-  assert (!scan->done); // only one plic
+  const uint32_t *value = prop.value;
+  const uint32_t *end = value + prop.len/4;
 
-  scan->done = 1;
-  plic_priorities = (uint32_t*)(uintptr_t)scan->reg;
-  plic_ndevs = scan->ndev;
+  plic_priorities = (uint32_t*)(uintptr_t)reg;
+  plic_ndevs = ndev;
 
   for (int index = 0; end - value > 0; ++index) {
     uint32_t phandle = bswap(value[0]);
     uint32_t cpu_int = bswap(value[1]);
-    int hart;
-    for (hart = 0; hart < MAX_HARTS; ++hart)
-      if (hart_phandles[hart] == phandle)
-        break;
-    if (hart < MAX_HARTS) {
+    long hart = hart_by_phandle(phandle);
+    if (hart >= 0) {
       hls_t *hls = OTHER_HLS(hart);
       if (cpu_int == IRQ_M_EXT) {
-        hls->plic_m_ie     = (uint32_t*)((uintptr_t)scan->reg + ENABLE_BASE + ENABLE_SIZE * index);
-        hls->plic_m_thresh = (uint32_t*) ((uintptr_t)scan->reg + HART_BASE   + HART_SIZE   * index);
+        hls->plic_m_ie     = (uint32_t*)((uintptr_t)reg + ENABLE_BASE + ENABLE_SIZE * index);
+        hls->plic_m_thresh = (uint32_t*) ((uintptr_t)reg + HART_BASE   + HART_SIZE   * index);
       } else if (cpu_int == IRQ_S_EXT) {
-        hls->plic_s_ie     = (uint32_t*)((uintptr_t)scan->reg + ENABLE_BASE + ENABLE_SIZE * index);
-        hls->plic_s_thresh = (uint32_t*) ((uintptr_t)scan->reg + HART_BASE   + HART_SIZE   * index);
+        hls->plic_s_ie     = (uint32_t*)((uintptr_t)reg + ENABLE_BASE + ENABLE_SIZE * index);
+        hls->plic_s_thresh = (uint32_t*) ((uintptr_t)reg + HART_BASE   + HART_SIZE   * index);
       } else {
         printm("PLIC wired hart %d to wrong interrupt %d", hart, cpu_int);
       }
@@ -464,194 +777,218 @@ static void plic_done(const struct fdt_scan_node *node, void *extra)
 #endif
 }
 
-void query_plic(uintptr_t fdt)
+void filter_plic(uintptr_t fdt)
 {
-  struct fdt_cb cb;
-  struct plic_scan scan;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = plic_open;
-  cb.prop = plic_prop;
-  cb.done = plic_done;
-  cb.extra = &scan;
-
-  scan.done = 0;
-  fdt_scan(fdt, &cb);
-}
+  struct fdt_scan_prop prop;
 
-static void plic_redact(const struct fdt_scan_node *node, void *extra)
-{
-  struct plic_scan *scan = (struct plic_scan *)extra;
-  uint32_t *value = scan->int_value;
-  uint32_t *end = value + scan->int_len/4;
+  for (int node = -1; (node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, "riscv,plic0")) >= 0; ) {
+    if (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS_EXTENDED, &prop)) continue;
 
-  if (!scan->compat) return;
-  scan->done = 1;
+    uint32_t *value = prop.value;
+    uint32_t *end = value + prop.len/4;
 
-  while (end - value > 0) {
-    if (bswap(value[1]) == IRQ_M_EXT) value[1] = bswap(-1);
-    value += 2;
+    while (end - value > 0) {
+      if (bswap(value[1]) == IRQ_M_EXT) value[1] = bswap(-1);
+      value += 2;
+    }
   }
 }
 
-void filter_plic(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct plic_scan scan;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = plic_open;
-  cb.prop = plic_prop;
-  cb.done = plic_redact;
-  cb.extra = &scan;
-
-  scan.done = 0;
-  fdt_scan(fdt, &cb);
-}
-
 //////////////////////////////////////////// COMPAT SCAN ////////////////////////////////////////
 
-struct compat_scan
-{
-  const char *compat;
-  int depth;
-  int kill;
-};
-
-static void compat_open(const struct fdt_scan_node *node, void *extra)
+void filter_compat(uintptr_t fdt, const char *compat)
 {
-  struct compat_scan *scan = (struct compat_scan *)extra;
-  ++scan->depth;
+  // deleted subtrees are skipped, so only the outermost match goes
+  for (int node = -1; (node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, compat)) >= 0; )
+    fdt_delete_node(fdt, node);
 }
 
-static void compat_prop(const struct fdt_scan_prop *prop, void *extra)
-{
-  struct compat_scan *scan = (struct compat_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, scan->compat) >= 0)
-    if (scan->depth < scan->kill)
-      scan->kill = scan->depth;
-}
+//////////////////////////////////////////// CHOSEN SCAN ////////////////////////////////////////
 
-static int compat_close(const struct fdt_scan_node *node, void *extra)
+void query_chosen(uintptr_t fdt)
 {
-  struct compat_scan *scan = (struct compat_scan *)extra;
-  if (scan->kill == scan->depth--) {
-    scan->kill = 999;
-    return -1;
-  } else {
-    return 0;
-  }
+  uint64_t val;
+  int chosen = fdt_find_child(fdt, fdt_find_child(fdt, -1, ""), "chosen");
+
+  kernel_start = NULL;
+  kernel_end = NULL;
+  if (chosen < 0) return;
+  if (fdt_get_prop_address(fdt, chosen, FDT_NAME_KERNEL_START, &val) == 0)
+    kernel_start = (void*)(uintptr_t)val;
+  if (fdt_get_prop_address(fdt, chosen, FDT_NAME_KERNEL_END, &val) == 0)
+    kernel_end = (void*)(uintptr_t)val;
 }
 
-void filter_compat(uintptr_t fdt, const char *compat)
+// Insert a property at the start of /chosen, creating that node at the
+// end of the root if there is none.  The FDT grows in place, up to
+// max_size bytes; the strings block must follow the struct block.
+// Returns -1, leaving the FDT as it was, if the property does not fit.
+int fdt_add_chosen_prop(uintptr_t fdt, uint32_t max_size, const char *name, const void *value, uint32_t len)
 {
-  struct fdt_cb cb;
-  struct compat_scan scan;
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  if (bswap(header->magic) != FDT_MAGIC ||
+      bswap(header->last_comp_version) > FDT_VERSION) return -1;
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = compat_open;
-  cb.prop = compat_prop;
-  cb.close = compat_close;
-  cb.extra = &scan;
-
-  scan.compat = compat;
-  scan.depth = 0;
-  scan.kill = 999;
-  fdt_scan(fdt, &cb);
-}
+  uint32_t *lex = (uint32_t *)(fdt + bswap(header->off_dt_struct));
+  uint32_t *insert = NULL;
+  int depth = 0, new_node = 0;
 
-//////////////////////////////////////////// CHOSEN SCAN ////////////////////////////////////////
+  while (!insert) {
+    switch (bswap(lex[0])) {
+      case FDT_BEGIN_NODE: {
+        const char *node_name = (const char *)(lex+1);
+        lex += 2 + strlen(node_name)/4;
+        if (++depth == 2 && !strcmp(node_name, "chosen"))
+          insert = lex;
+        break;
+      }
+      case FDT_END_NODE:
+        if (--depth == 0) {
+          insert = lex;
+          new_node = 1;
+        }
+        lex += 1;
+        break;
+      case FDT_PROP:
+        lex += 3 + (bswap(lex[1])+3)/4;
+        break;
+      case FDT_NOP:
+        lex += 1;
+        break;
+      default:
+        return -1;
+    }
+  }
 
-struct chosen_scan {
-  const struct fdt_scan_node *chosen;
-  void* kernel_start;
-  void* kernel_end;
-};
+  uint32_t prop_words = 3 + (len+3)/4;
+  uint32_t words = prop_words + (new_node ? 4 : 0); // BEGIN_NODE "chosen" END_NODE
+  uint32_t grow = words * 4;
+  uint32_t name_len = strlen(name) + 1;
+  uint32_t total = bswap(header->totalsize);
+  uint32_t off_strings = bswap(header->off_dt_strings) + grow;
+  uint32_t size_strings = bswap(header->size_dt_strings);
+  assert ((uintptr_t)insert - fdt <= off_strings - grow);
+  if (total + grow + name_len > max_size)
+    return -1;
 
-static void chosen_open(const struct fdt_scan_node *node, void *extra)
-{
-  struct chosen_scan *scan = (struct chosen_scan *)extra;
-  if (!strcmp(node->name, "chosen")) {
-    scan->chosen = node;
+  // open a gap at the insertion point
+  for (char *p = (char *)fdt + total; p-- != (char *)insert; )
+    p[grow] = *p;
+
+  uint32_t *out = insert;
+  if (new_node) {
+    *out++ = bswap(FDT_BEGIN_NODE);
+    memcpy(out, "chosen\0\0", 8);
+    out += 2;
   }
+  *out++ = bswap(FDT_PROP);
+  *out++ = bswap(len);
+  *out++ = bswap(size_strings);
+  if (len)
+    out[(len+3)/4 - 1] = 0; // zero the padding
+  memcpy(out, value, len);
+  out += prop_words - 3;
+  if (new_node)
+    *out++ = bswap(FDT_END_NODE);
+
+  memcpy((char *)fdt + off_strings + size_strings, name, name_len);
+  size_strings += name_len;
+
+  header->off_dt_strings = bswap(off_strings);
+  header->size_dt_strings = bswap(size_strings);
+  header->size_dt_struct = bswap(bswap(header->size_dt_struct) + grow);
+  total += grow;
+  if (total < off_strings + size_strings)
+    total = off_strings + size_strings;
+  header->totalsize = bswap(total);
+
+  // the index offsets no longer hold
+  if (fdt == index_fdt)
+    index_fdt = 0;
+  return 0;
 }
 
-static int chosen_close(const struct fdt_scan_node *node, void *extra)
+// Lengthen the property whose value starts at value by len bytes of
+// tail, which replace its last byte if replace_last.  Like
+// fdt_add_chosen_prop, returns -1 if the FDT would outgrow max_size.
+static int fdt_extend_prop(uintptr_t fdt, uint32_t max_size, uint32_t *value,
+                           const char *tail, uint32_t len, bool replace_last)
 {
-  struct chosen_scan *scan = (struct chosen_scan *)extra;
-  if (scan->chosen && scan->chosen == node) {
-    scan->chosen = NULL;
-  }
+  struct fdt_header *header = (struct fdt_header *)fdt;
+  uint32_t old_len = bswap(value[-2]);
+  uint32_t new_len = old_len - (replace_last && old_len) + len;
+  uint32_t grow = ((new_len+3)/4 - (old_len+3)/4) * 4;
+  uint32_t total = bswap(header->totalsize);
+  uint32_t off_strings = bswap(header->off_dt_strings);
+  char *end = (char *)(value + (old_len+3)/4);
+  assert ((uintptr_t)end - fdt <= off_strings);
+  if (total + grow > max_size)
+    return -1;
+
+  for (char *p = (char *)fdt + total; p-- != end; )
+    p[grow] = *p;
+  memset((char *)value + old_len, 0, end + grow - ((char *)value + old_len));
+  memcpy((char *)value + new_len - len, tail, len);
+  value[-2] = bswap(new_len);
+
+  header->off_dt_strings = bswap(off_strings + grow);
+  header->size_dt_struct = bswap(bswap(header->size_dt_struct) + grow);
+  header->totalsize = bswap(total + grow);
+
+  if (fdt == index_fdt)
+    index_fdt = 0;
   return 0;
 }
 
-static void chosen_prop(const struct fdt_scan_prop *prop, void *extra)
+// Whether a riscv,isa string names a multi-letter extension
+static bool isa_has_extension(const char *isa, const char *ext)
 {
-  struct chosen_scan *scan = (struct chosen_scan *)extra;
-  uint64_t val;
-  if (!scan->chosen) return;
-  if (!strcmp(prop->name, "riscv,kernel-start")) {
-    fdt_get_address(prop->node->parent, prop->value, &val);
-    scan->kernel_start = (void*)(uintptr_t)val;
-  } else if (!strcmp(prop->name, "riscv,kernel-end")) {
-    fdt_get_address(prop->node->parent, prop->value, &val);
-    scan->kernel_end = (void*)(uintptr_t)val;
-  }
+  size_t len = strlen(ext);
+  for (; *isa; isa++)
+    if (*isa == '_' && !strncmp(isa + 1, ext, len) && (isa[len+1] == '_' || !isa[len+1]))
+      return true;
+  return false;
 }
 
-void query_chosen(uintptr_t fdt)
+// Add a multi-letter extension to each enabled cpu, in its
+// riscv,isa-extensions list and its riscv,isa string.  Returns -1 if
+// any of them did not fit.
+int fdt_add_isa_extension(uintptr_t fdt, uint32_t max_size, const char *ext)
 {
-  struct fdt_cb cb;
-  struct chosen_scan chosen;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = chosen_open;
-  cb.close = chosen_close;
-  cb.prop = chosen_prop;
-
-  memset(&chosen, 0, sizeof(chosen));
-  cb.extra = &chosen;
+  char tail[16]; // "_" ext
+  uint32_t len = strlen(ext) + 1;
+  int ret = 0;
+
+  assert (len < sizeof(tail));
+  tail[0] = '_';
+  strcpy(tail + 1, ext);
+
+  for (int cpu = -1; (cpu = fdt_next_node(fdt, cpu, FDT_NAME_DEVICE_TYPE, "cpu")) >= 0; ) {
+    struct fdt_scan_prop prop;
+    if (!fdt_match(fdt, cpu, FDT_NAME_STATUS, "okay")) continue;
+
+    if (fdt_get_prop(fdt, cpu, FDT_NAME_ISA_EXTENSIONS, &prop) == 0 &&
+        fdt_string_list_index(&prop, ext) < 0 &&
+        fdt_extend_prop(fdt, max_size, prop.value, ext, len, false))
+      ret = -1;
+
+    if (fdt_get_prop(fdt, cpu, FDT_NAME_ISA, &prop) == 0 && prop.len > 0 &&
+        !isa_has_extension((const char *)prop.value, ext) &&
+        fdt_extend_prop(fdt, max_size, prop.value, tail, len + 1, true))
+      ret = -1;
+  }
 
-  fdt_scan(fdt, &cb);
-  kernel_start = chosen.kernel_start;
-  kernel_end = chosen.kernel_end;
+  return ret;
 }
 
 //////////////////////////////////////////// HART FILTER ////////////////////////////////////////
 
 struct hart_filter {
-  int compat;
   int hart;
   char *status;
   char *mmu_type;
-  long *disabled_hart_mask;
 };
 
-static void hart_filter_open(const struct fdt_scan_node *node, void *extra)
-{
-  struct hart_filter *filter = (struct hart_filter *)extra;
-  filter->status = NULL;
-  filter->mmu_type = NULL;
-  filter->compat = 0;
-  filter->hart = -1;
-}
-
-static void hart_filter_prop(const struct fdt_scan_prop *prop, void *extra)
-{
-  struct hart_filter *filter = (struct hart_filter *)extra;
-  if (!strcmp(prop->name, "device_type") && !strcmp((const char*)prop->value, "cpu")) {
-    filter->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    uint64_t reg;
-    fdt_get_address(prop->node->parent, prop->value, &reg);
-    filter->hart = reg;
-  } else if (!strcmp(prop->name, "status")) {
-    filter->status = (char*)prop->value;
-  } else if (!strcmp(prop->name, "mmu-type")) {
-    filter->mmu_type = (char*)prop->value;
-  }
-}
-
 static bool hart_filter_mask(const struct hart_filter *filter)
 {
   if (filter->mmu_type == NULL) return true;
@@ -667,38 +1004,33 @@ static bool hart_filter_mask(const struct hart_filter *filter)
   return true;
 }
 
-static void hart_filter_done(const struct fdt_scan_node *node, void *extra)
+void filter_harts(uintptr_t fdt, hart_mask_t *disabled_hart_mask)
 {
-  struct hart_filter *filter = (struct hart_filter *)extra;
+  memset(disabled_hart_mask, 0, sizeof(*disabled_hart_mask));
 
-  if (!filter->compat) return;
-  assert (filter->status);
-  assert (filter->hart >= 0);
+  for (int cpu = -1; (cpu = fdt_next_node(fdt, cpu, FDT_NAME_DEVICE_TYPE, "cpu")) >= 0; ) {
+    struct fdt_index_prop *status = fdt_index_prop(cpu, FDT_NAME_STATUS);
+    struct fdt_index_prop *mmu_type = fdt_index_prop(cpu, FDT_NAME_MMU_TYPE);
+    struct hart_filter filter;
+    uint64_t reg;
 
-  if (hart_filter_mask(filter)) {
-    strcpy(filter->status, "masked");
-    uint32_t *len = (uint32_t*)filter->status;
-    len[-2] = bswap(strlen("masked")+1);
-    *filter->disabled_hart_mask |= (1 << filter->hart);
+    assert (status);
+    assert (fdt_get_reg(fdt, cpu, 0, &reg, NULL) == 0);
+    filter.hart = reg;
+    filter.status = (char*)(fdt + status->value);
+    filter.mmu_type = mmu_type ? (char*)(fdt + mmu_type->value) : NULL;
+
+    if (hart_filter_mask(&filter)) {
+      strcpy(filter.status, "masked");
+      status->len = strlen("masked")+1;
+      uint32_t *len = (uint32_t*)filter.status;
+      len[-2] = bswap(status->len);
+      if (filter.hart < MAX_HARTS)
+        hart_mask_set(disabled_hart_mask, filter.hart);
+    }
   }
 }
 
-void filter_harts(uintptr_t fdt, long *disabled_hart_mask)
-{
-  struct fdt_cb cb;
-  struct hart_filter filter;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = hart_filter_open;
-  cb.prop = hart_filter_prop;
-  cb.done = hart_filter_done;
-  cb.extra = &filter;
-
-  filter.disabled_hart_mask = disabled_hart_mask;
-  *disabled_hart_mask = 0;
-  fdt_scan(fdt, &cb);
-}
-
 //////////////////////////////////////////// PRINT //////////////////////////////////////////////
 
 #ifdef PK_PRINT_DEVICE_TREE
@@ -3,6 +3,8 @@
 #ifndef FDT_H
 #define FDT_H
 
+#include "hart_mask.h"
+
 #define FDT_MAGIC	0xd00dfeed
 #define FDT_VERSION	17
 
@@ -57,20 +59,72 @@ const uint32_t *fdt_get_size(const struct fdt_scan_node *node, const uint32_t *b
 uint32_t fdt_get_value(const struct fdt_scan_prop *prop, uint32_t index);
 int fdt_string_list_index(const struct fdt_scan_prop *prop, const char *str); // -1 if not found
 
+// Property names the index resolves
+enum {
+  FDT_NAME_ADDRESS_CELLS,
+  FDT_NAME_SIZE_CELLS,
+  FDT_NAME_COMPATIBLE,
+  FDT_NAME_DEVICE_TYPE,
+  FDT_NAME_REG,
+  FDT_NAME_STATUS,
+  FDT_NAME_PHANDLE,
+  FDT_NAME_MMU_TYPE,
+  FDT_NAME_INTERRUPT_CONTROLLER,
+  FDT_NAME_INTERRUPT_CELLS,
+  FDT_NAME_INTERRUPTS_EXTENDED,
+  FDT_NAME_INTERRUPTS,
+  FDT_NAME_NDEV,
+  FDT_NAME_CBOZ_BLOCK_SIZE,
+  FDT_NAME_KERNEL_START,
+  FDT_NAME_KERNEL_END,
+  FDT_NAME_REG_SHIFT,
+  FDT_NAME_REG_OFFSET,
+  FDT_NAME_CURRENT_SPEED,
+  FDT_NAME_CLOCK_FREQUENCY,
+  FDT_NAME_ISA,
+  FDT_NAME_ISA_EXTENSIONS,
+  FDT_NAMES
+};
+
+// Index the FDT; a lookup on another FDT re-indexes.  The index is
+// carved from the top of memory, and the payload must stay below it.
+void fdt_index(uintptr_t fdt);
+void fdt_index_copy(uintptr_t dest, uintptr_t src); // dest is a byte copy of src
+uintptr_t fdt_index_base(); // the lowest address the index takes, or 0
+
+// Look up the index.  Nodes are numbered in tree order; the root is the
+// child of -1 named "", and fdt_next_node searches from it when node is -1.
+int fdt_next_node(uintptr_t fdt, int node, int name, const char *str); // -1 if none
+int fdt_match(uintptr_t fdt, int node, int name, const char *str); // str NULL => any value
+int fdt_parent(uintptr_t fdt, int node);
+int fdt_find_child(uintptr_t fdt, int parent, const char *name); // -1 if not found
+int fdt_get_prop(uintptr_t fdt, int node, int name, struct fdt_scan_prop *prop); // -1 if absent; prop->node is NULL
+int fdt_get_reg(uintptr_t fdt, int node, int index, uint64_t *base, uint64_t *size); // size may be NULL
+int fdt_get_prop_address(uintptr_t fdt, int node, int name, uint64_t *value);
+void fdt_delete_node(uintptr_t fdt, int node);
+
 // Setup memory+clint+plic
 void query_mem(uintptr_t fdt);
 void query_harts(uintptr_t fdt);
 void query_plic(uintptr_t fdt);
 void query_clint(uintptr_t fdt);
+void query_sswi(uintptr_t fdt);
 void query_chosen(uintptr_t fdt);
 
 // Remove information from FDT
-void filter_harts(uintptr_t fdt, long *disabled_hart_mask);
+void filter_harts(uintptr_t fdt, hart_mask_t *disabled_hart_mask);
 void filter_plic(uintptr_t fdt);
 void filter_compat(uintptr_t fdt, const char *compat);
 
+// Add information to FDT
+int fdt_add_chosen_prop(uintptr_t fdt, uint32_t max_size, const char *name, const void *value, uint32_t len);
+int fdt_add_isa_extension(uintptr_t fdt, uint32_t max_size, const char *ext);
+
 // The hartids of available harts
-extern uint64_t hart_mask;
+extern hart_mask_t hart_mask;
+
+// Zicboz block size used by memset, or 0 (defined in util/string.c)
+extern size_t cbo_zero_block_size;
 
 // Optional FDT preloaded external payload
 extern void* kernel_start;
@@ -16,45 +16,11 @@ void finisher_exit(uint16_t code)
   }
 }
 
-struct finisher_scan
-{
-  int compat;
-  uint64_t reg;
-};
-
-static void finisher_open(const struct fdt_scan_node *node, void *extra)
-{
-  struct finisher_scan *scan = (struct finisher_scan *)extra;
-  memset(scan, 0, sizeof(*scan));
-}
-
-static void finisher_prop(const struct fdt_scan_prop *prop, void *extra)
-{
-  struct finisher_scan *scan = (struct finisher_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "sifive,test0") >= 0) {
-    scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    fdt_get_address(prop->node->parent, prop->value, &scan->reg);
-  }
-}
-
-static void finisher_done(const struct fdt_scan_node *node, void *extra)
-{
-  struct finisher_scan *scan = (struct finisher_scan *)extra;
-  if (!scan->compat || !scan->reg || finisher) return;
-  finisher = (uint32_t*)(uintptr_t)scan->reg;
-}
-
 void query_finisher(uintptr_t fdt)
 {
-  struct fdt_cb cb;
-  struct finisher_scan scan;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = finisher_open;
-  cb.prop = finisher_prop;
-  cb.done = finisher_done;
-  cb.extra = &scan;
+  uint64_t reg;
+  int node = fdt_next_node(fdt, -1, FDT_NAME_COMPATIBLE, "sifive,test0");
 
-  fdt_scan(fdt, &cb);
+  if (node < 0 || fdt_get_reg(fdt, node, 0, &reg, NULL) || !reg || finisher) return;
+  finisher = (uint32_t*)(uintptr_t)reg;
 }
@@ -18,12 +18,12 @@ DECLARE_EMULATION_FUNC(emulate_float_load)
   switch (insn & MASK_FUNCT3)
   {
     case MATCH_FLW & MASK_FUNCT3:
-      punt_to_misaligned_handler(4, misaligned_load_trap);
+      punt_to_misaligned_handler(4, misaligned_load);
       SET_F32_RD(insn, regs, load_int32_t((void *)addr, mepc));
       break;
 
     case MATCH_FLD & MASK_FUNCT3:
-      punt_to_misaligned_handler(sizeof(uintptr_t), misaligned_load_trap);
+      punt_to_misaligned_handler(sizeof(uintptr_t), misaligned_load);
       SET_F64_RD(insn, regs, load_uint64_t((void *)addr, mepc));
       break;
 
@@ -43,12 +43,12 @@ DECLARE_EMULATION_FUNC(emulate_float_store)
   switch (insn & MASK_FUNCT3)
   {
     case MATCH_FSW & MASK_FUNCT3:
-      punt_to_misaligned_handler(4, misaligned_store_trap);
+      punt_to_misaligned_handler(4, misaligned_store);
       store_uint32_t((void *)addr, GET_F32_RS2(insn, regs), mepc);
       break;
 
     case MATCH_FSD & MASK_FUNCT3:
-      punt_to_misaligned_handler(sizeof(uintptr_t), misaligned_store_trap);
+      punt_to_misaligned_handler(sizeof(uintptr_t), misaligned_store);
       store_uint64_t((void *)addr, GET_F64_RS2(insn, regs), mepc);
       break;
 
@@ -0,0 +1,55 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_HART_MASK_H
+#define _RISCV_HART_MASK_H
+
+#ifdef __riscv_atomic
+# define MAX_HARTS 256 // each takes a page of M-mode stack
+#else
+# define MAX_HARTS 1
+#endif
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+// A set of hartids, one bit per hart
+#define HART_MASK_BITS (8 * sizeof(uintptr_t))
+#define HART_MASK_WORDS ((MAX_HARTS + HART_MASK_BITS - 1) / HART_MASK_BITS)
+
+typedef struct {
+  uintptr_t bits[HART_MASK_WORDS];
+} hart_mask_t;
+
+static inline int hart_mask_test(const hart_mask_t* m, uintptr_t hart)
+{
+  return hart < MAX_HARTS && ((m->bits[hart / HART_MASK_BITS] >> (hart % HART_MASK_BITS)) & 1);
+}
+
+static inline void hart_mask_set(hart_mask_t* m, uintptr_t hart)
+{
+  m->bits[hart / HART_MASK_BITS] |= (uintptr_t)1 << (hart % HART_MASK_BITS);
+}
+
+// The first hart in m from hart on, or MAX_HARTS if there is none
+static inline uintptr_t hart_mask_next(const hart_mask_t* m, uintptr_t hart)
+{
+  while (hart < MAX_HARTS) {
+    uintptr_t word = m->bits[hart / HART_MASK_BITS] >> (hart % HART_MASK_BITS);
+    if (!word) {
+      hart = (hart | (HART_MASK_BITS - 1)) + 1;
+      continue;
+    }
+    for (; !(word & 1); word >>= 1)
+      hart++;
+    return hart;
+  }
+  return MAX_HARTS;
+}
+
+#define for_each_hart(hart, m) \
+  for (uintptr_t hart = hart_mask_next(m, 0); hart < MAX_HARTS; hart = hart_mask_next(m, hart + 1))
+
+#endif // !__ASSEMBLER__
+
+#endif
@@ -0,0 +1,144 @@
+// See LICENSE for license details.
+
+#include "hsm.h"
+#include "mtrap.h"
+#include "mcall.h"
+#include "atomic.h"
+#include "fdt.h"
+#include "disabled_hart_mask.h"
+#include "config.h"
+
+void hsm_init(uintptr_t boot_hartid)
+{
+  for_each_hart(hart, &hart_mask)
+    if (hart != boot_hartid)
+      OTHER_HLS(hart)->hsm_state = SBI_HSM_STATE_STOPPED;
+}
+
+// M-mode interrupts stay disabled while a hart sleeps here, so take
+// IPIs by hand.  Fences still have to be done: their senders wait.
+void hsm_poll_ipis()
+{
+  *HLS()->ipi = 0;
+  mb();
+
+  int pending = atomic_swap(&HLS()->mipi_pending, 0);
+  ipi_complete();
+  if (pending & IPI_HALT)
+    while (1)
+      wfi();
+}
+
+// Enter S-mode as a hart coming out of reset would
+static void __attribute__((noreturn)) hsm_enter(uintptr_t addr, uintptr_t opaque)
+{
+  // the payload may have written the code this hart is about to run
+  asm volatile ("fence.i");
+  clear_csr(mstatus, MSTATUS_SIE);
+  if (supports_extension('S'))
+    write_csr(satp, 0);
+
+  HLS()->hsm_state = SBI_HSM_STATE_STARTED;
+  mb();
+
+#ifdef BBL_BOOT_MACHINE
+  enter_machine_mode((void (*)(uintptr_t, uintptr_t))addr, read_csr(mhartid), opaque);
+#else
+  enter_supervisor_mode((void (*)(uintptr_t))addr, read_csr(mhartid), opaque);
+#endif
+}
+
+void hsm_stopped(void (*idle)())
+{
+  hls_t* hls = HLS();
+
+  // only an IPI may wake this hart
+  clear_csr(mie, MIP_SSIP | MIP_STIP | MIP_SEIP | MIP_MTIP);
+  *hls->timecmp = -1ULL;
+
+  while (1) {
+    if (idle)
+      idle();
+    if (hls->hsm_state == SBI_HSM_STATE_START_PENDING)
+      break;
+    wfi();
+    hsm_poll_ipis();
+  }
+
+  mb();
+  hsm_enter(hls->hsm_start_addr, hls->hsm_opaque);
+}
+
+static int hsm_valid_hart(uintptr_t hartid)
+{
+  return hart_mask_test(&hart_mask, hartid) &&
+         !hart_mask_test(&disabled_hart_mask, hartid);
+}
+
+long hsm_hart_start(uintptr_t hartid, uintptr_t start_addr, uintptr_t opaque)
+{
+  if (!hsm_valid_hart(hartid))
+    return SBI_ERR_INVALID_PARAM;
+  if (start_addr >= smode_denied_start && start_addr < smode_denied_end)
+    return SBI_ERR_INVALID_ADDRESS;
+
+  hls_t* hls = OTHER_HLS(hartid);
+  int state = atomic_cas(&hls->hsm_state, SBI_HSM_STATE_STOPPED,
+                         SBI_HSM_STATE_START_PENDING);
+  if (state == SBI_HSM_STATE_STARTED)
+    return SBI_ERR_ALREADY_AVAILABLE;
+  if (state != SBI_HSM_STATE_STOPPED)
+    return SBI_ERR_ALREADY_STARTED;
+
+  // START_PENDING keeps everyone else off these until the hart is up
+  hls->hsm_start_addr = start_addr;
+  hls->hsm_opaque = opaque;
+  mb();
+  *hls->ipi = 1;
+
+  return SBI_SUCCESS;
+}
+
+long hsm_hart_stop()
+{
+  hls_t* hls = HLS();
+
+  if (atomic_cas(&hls->hsm_state, SBI_HSM_STATE_STARTED,
+                 SBI_HSM_STATE_STOP_PENDING) != SBI_HSM_STATE_STARTED)
+    return SBI_ERR_FAILED;
+
+  hls->hsm_state = SBI_HSM_STATE_STOPPED;
+  mb();
+  hsm_stopped(NULL);
+}
+
+long hsm_hart_get_status(uintptr_t hartid)
+{
+  if (!hsm_valid_hart(hartid))
+    return SBI_ERR_INVALID_PARAM;
+  return OTHER_HLS(hartid)->hsm_state;
+}
+
+long hsm_hart_suspend(uint32_t type, uintptr_t resume_addr, uintptr_t opaque)
+{
+  hls_t* hls = HLS();
+
+  if (type != SBI_HSM_SUSPEND_RETENTIVE && type != SBI_HSM_SUSPEND_NON_RETENTIVE)
+    return SBI_ERR_INVALID_PARAM;
+  if (type == SBI_HSM_SUSPEND_NON_RETENTIVE &&
+      resume_addr >= smode_denied_start && resume_addr < smode_denied_end)
+    return SBI_ERR_INVALID_ADDRESS;
+
+  // wfi wakes on any interrupt S-mode left enabled in sie, or on an IPI;
+  // whatever woke it is taken once back in S-mode
+  hls->hsm_state = SBI_HSM_STATE_SUSPENDED;
+  mb();
+  wfi();
+
+  if (type == SBI_HSM_SUSPEND_NON_RETENTIVE)
+    hsm_enter(resume_addr, opaque);
+
+  hls->hsm_state = SBI_HSM_STATE_STARTED;
+  mb();
+  return SBI_SUCCESS;
+}
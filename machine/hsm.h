@@ -0,0 +1,20 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_HSM_H
+#define _RISCV_HSM_H
+
+#include <stdint.h>
+
+// SBI hart state management.  Harts other than the boot hart start out
+// stopped, asleep in hsm_stopped() until the payload starts them.
+
+void hsm_init(uintptr_t boot_hartid);
+void hsm_stopped(void (*idle)()) __attribute__((noreturn));
+void hsm_poll_ipis();
+
+long hsm_hart_start(uintptr_t hartid, uintptr_t start_addr, uintptr_t opaque);
+long hsm_hart_stop();
+long hsm_hart_get_status(uintptr_t hartid);
+long hsm_hart_suspend(uint32_t type, uintptr_t resume_addr, uintptr_t opaque);
+
+#endif
@@ -11,9 +11,14 @@ extern uint64_t __htif_base;
 volatile uint64_t tohost __attribute__((section(".htif")));
 volatile uint64_t fromhost __attribute__((section(".htif")));
 volatile int htif_console_buf;
-static spinlock_t htif_lock = SPINLOCK_INIT;
+static ticketlock_t htif_lock = TICKETLOCK_INIT;
 uintptr_t htif;
 
+// The host services system calls one at a time, in the order they reach
+// tohost, so a request's tag is simply its position in that order.
+static unsigned long htif_syscalls_issued;
+static unsigned long htif_syscalls_done;
+
 #define TOHOST(base_int)	(uint64_t *)(base_int + TOHOST_OFFSET)
 #define FROMHOST(base_int)	(uint64_t *)(base_int + FROMHOST_OFFSET)
 
@@ -27,23 +32,42 @@ static void __check_fromhost()
     return;
   fromhost = 0;
 
-  // this should be from the console
-  assert(FROMHOST_DEV(fh) == 1);
-  switch (FROMHOST_CMD(fh)) {
+  switch (FROMHOST_DEV(fh)) {
     case 0:
-      htif_console_buf = 1 + (uint8_t)FROMHOST_DATA(fh);
+      // a system call has completed
+      assert(FROMHOST_CMD(fh) == 0);
+      htif_syscalls_done++;
       break;
     case 1:
+      // console
+      switch (FROMHOST_CMD(fh)) {
+        case 0:
+          htif_console_buf = 1 + (uint8_t)FROMHOST_DATA(fh);
+          break;
+        case 1:
+          break;
+        default:
+          assert(0);
+      }
       break;
     default:
       assert(0);
   }
 }
 
+// Let other harts at the link while this one waits on the host
+static void __htif_yield()
+{
+  __check_fromhost();
+  ticketlock_unlock(&htif_lock);
+  cpu_relax();
+  ticketlock_lock(&htif_lock);
+}
+
 static void __set_tohost(uintptr_t dev, uintptr_t cmd, uintptr_t data)
 {
   while (tohost)
-    __check_fromhost();
+    __htif_yield();
   tohost = TOHOST_CMD(dev, cmd, data);
 }
 
@@ -54,104 +78,69 @@ int htif_console_getchar()
   return -1;
 #endif
 
-  spinlock_lock(&htif_lock);
+  ticketlock_lock(&htif_lock);
     __check_fromhost();
     int ch = htif_console_buf;
     if (ch >= 0) {
       htif_console_buf = -1;
       __set_tohost(1, 0, 0);
     }
-  spinlock_unlock(&htif_lock);
+  ticketlock_unlock(&htif_lock);
 
   return ch - 1;
 }
 
-static void do_tohost_fromhost(uintptr_t dev, uintptr_t cmd, uintptr_t data)
+void htif_syscall(uintptr_t magic_mem)
 {
-  spinlock_lock(&htif_lock);
-    __set_tohost(dev, cmd, data);
-
-    while (1) {
-      uint64_t fh = fromhost;
-      if (fh) {
-        if (FROMHOST_DEV(fh) == dev && FROMHOST_CMD(fh) == cmd) {
-          fromhost = 0;
-          break;
-        }
-        __check_fromhost();
-      }
-    }
-  spinlock_unlock(&htif_lock);
+  ticketlock_lock(&htif_lock);
+    __set_tohost(0, 0, magic_mem);
+    unsigned long tag = htif_syscalls_issued++;
+
+    while ((long)(htif_syscalls_done - tag) <= 0)
+      __htif_yield();
+  ticketlock_unlock(&htif_lock);
 }
 
-void htif_syscall(uintptr_t arg)
+// A whole buffer goes to the host as one write system call, instead of
+// a tohost round trip per character
+void htif_console_write(const char* buf, size_t len)
 {
-  do_tohost_fromhost(0, 0, arg);
+  volatile uint64_t magic_mem[8];
+  magic_mem[0] = SYS_write;
+  magic_mem[1] = 1;
+  magic_mem[2] = (uintptr_t)buf;
+  magic_mem[3] = len;
+  htif_syscall((uintptr_t)magic_mem);
 }
 
 void htif_console_putchar(uint8_t ch)
 {
 #if __riscv_xlen == 32
   // HTIF devices are not supported on RV32, so proxy a write system call
-  volatile uint64_t magic_mem[8];
-  magic_mem[0] = SYS_write;
-  magic_mem[1] = 1;
-  magic_mem[2] = (uintptr_t)&ch;
-  magic_mem[3] = 1;
-  do_tohost_fromhost(0, 0, (uintptr_t)magic_mem);
+  htif_console_write((const char*)&ch, 1);
 #else
-  spinlock_lock(&htif_lock);
+  ticketlock_lock(&htif_lock);
     __set_tohost(1, 1, ch);
-  spinlock_unlock(&htif_lock);
+  ticketlock_unlock(&htif_lock);
 #endif
 }
 
-void htif_poweroff()
-{
-  while (1) {
-    spinlock_lock(&htif_lock);
-    __set_tohost(0, 0, 1);
-    spinlock_unlock(&htif_lock);
-  }
-}
-
-struct htif_scan
-{
-  int compat;
-};
-
-static void htif_open(const struct fdt_scan_node *node, void *extra)
+const lock_stat_t* htif_lock_stat()
 {
-  struct htif_scan *scan = (struct htif_scan *)extra;
-  memset(scan, 0, sizeof(*scan));
+  return &htif_lock.stat;
 }
 
-static void htif_prop(const struct fdt_scan_prop *prop, void *extra)
+void htif_poweroff()
 {
-  struct htif_scan *scan = (struct htif_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "ucb,htif0") >= 0) {
-    scan->compat = 1;
+  while (1) {
+    ticketlock_lock(&htif_lock);
+    __set_tohost(0, 0, 1);
+    ticketlock_unlock(&htif_lock);
   }
 }
 
-static void htif_done(const struct fdt_scan_node *node, void *extra)
-{
-  struct htif_scan *scan = (struct htif_scan *)extra;
-  if (!scan->compat) return;
-
-  htif = 1;
-}
-
 void query_htif(uintptr_t fdt)
 {
-  struct fdt_cb cb;
-  struct htif_scan scan;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = htif_open;
-  cb.prop = htif_prop;
-  cb.done = htif_done;
-  cb.extra = &scan;
-
-  fdt_scan(fdt, &cb);
+  if (fdt_next_node(fdt, -1, FDT_NAME_COMPATIBLE, "ucb,htif0") >= 0)
+    htif = 1;
 }
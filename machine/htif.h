@@ -3,7 +3,9 @@
 #ifndef _RISCV_HTIF_H
 #define _RISCV_HTIF_H
 
+#include "atomic.h"
 #include <stdint.h>
+#include <stddef.h>
 
 #if __riscv_xlen == 64
 # define TOHOST_CMD(dev, cmd, payload) \
@@ -20,8 +22,10 @@
 extern uintptr_t htif;
 void query_htif(uintptr_t dtb);
 void htif_console_putchar(uint8_t);
+void htif_console_write(const char* buf, size_t len);
 int htif_console_getchar();
 void htif_poweroff() __attribute__((noreturn));
 void htif_syscall(uintptr_t);
+const lock_stat_t* htif_lock_stat();
 
 #endif
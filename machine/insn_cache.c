@@ -0,0 +1,33 @@
+// See LICENSE for license details.
+
+#include "insn_cache.h"
+#include "hart_mask.h"
+#include <string.h>
+
+// Direct mapped by address, so a loop's instructions take a slot each
+static decoded_insn_t insn_cache[MAX_HARTS][INSN_CACHE_ENTRIES];
+
+static decoded_insn_t* insn_cache_slot(uintptr_t mepc)
+{
+  return &insn_cache[read_csr(mhartid)][(mepc >> 1) % INSN_CACHE_ENTRIES];
+}
+
+const decoded_insn_t* insn_cache_lookup(uintptr_t mepc, insn_t insn)
+{
+  decoded_insn_t* d = insn_cache_slot(mepc);
+  if (d->mepc == mepc && d->insn == insn && insn)
+    return d;
+  return NULL;
+}
+
+void insn_cache_fill(const decoded_insn_t* d)
+{
+  *insn_cache_slot(d->mepc) = *d;
+}
+
+// Drop this hart's entries once code may have changed under them; they
+// would not be used, but would take up slots
+void insn_cache_flush()
+{
+  memset(insn_cache[read_csr(mhartid)], 0, sizeof(insn_cache[0]));
+}
@@ -0,0 +1,30 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_INSN_CACHE_H
+#define _RISCV_INSN_CACHE_H
+
+#include "emulation.h"
+
+// Instructions already decoded for emulation, per hart, so that one
+// trapping over and over in a loop is decoded only once.  An entry is
+// found by the instruction's address and its bits together, so one left
+// over from code since replaced or remapped is never used, only evicted.
+
+#define INSN_CACHE_ENTRIES 16
+
+typedef struct {
+  uintptr_t mepc;
+  emulation_func f;   // an illegal instruction's emulator
+  uint32_t insn;      // as fetched; never 0 in a valid entry
+  uint32_t operands;  // its registers where a 32-bit instruction has them
+  uint8_t category;   // EMULATION_*
+  uint8_t len;        // of a misaligned access
+  uint8_t shift;      // to sign-extend a misaligned load
+  uint8_t fp;         // a misaligned access to an FP register
+} decoded_insn_t;
+
+const decoded_insn_t* insn_cache_lookup(uintptr_t mepc, insn_t insn);
+void insn_cache_fill(const decoded_insn_t* d);
+void insn_cache_flush();
+
+#endif
@@ -13,4 +13,108 @@
 #define SBI_REMOTE_SFENCE_VMA_ASID 7
 #define SBI_SHUTDOWN 8
 
+// SBI v0.2 extensions: a7 holds the extension ID, a6 the function ID,
+// and calls return an error in a0 and a value in a1.  The extensions
+// below follow v2.0, which payloads check before using some of them:
+// Linux wants v0.3 for PMU and HSM suspend and v2.0 for DBCN.
+#define SBI_SPEC_VERSION ((2 << 24) | 0) // v2.0: major in bits 30:24, minor in 23:0
+#define SBI_IMPL_ID_BBL 0
+#define SBI_IMPL_VERSION 1
+
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_BASE_GET_SPEC_VERSION 0
+#define SBI_EXT_BASE_GET_IMPL_ID 1
+#define SBI_EXT_BASE_GET_IMPL_VERSION 2
+#define SBI_EXT_BASE_PROBE_EXT 3
+#define SBI_EXT_BASE_GET_MVENDORID 4
+#define SBI_EXT_BASE_GET_MARCHID 5
+#define SBI_EXT_BASE_GET_MIMPID 6
+
+#define SBI_EXT_TIME 0x54494D45
+#define SBI_EXT_TIME_SET_TIMER 0
+
+#define SBI_EXT_IPI 0x735049
+#define SBI_EXT_IPI_SEND_IPI 0
+
+#define SBI_EXT_RFENCE 0x52464E43
+#define SBI_EXT_RFENCE_REMOTE_FENCE_I 0
+#define SBI_EXT_RFENCE_REMOTE_SFENCE_VMA 1
+#define SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID 2
+
+#define SBI_EXT_DBCN 0x4442434E
+#define SBI_EXT_DBCN_CONSOLE_WRITE 0
+#define SBI_EXT_DBCN_CONSOLE_READ 1
+#define SBI_EXT_DBCN_CONSOLE_WRITE_BYTE 2
+
+#define SBI_EXT_HSM 0x48534D
+#define SBI_EXT_HSM_HART_START 0
+#define SBI_EXT_HSM_HART_STOP 1
+#define SBI_EXT_HSM_HART_GET_STATUS 2
+#define SBI_EXT_HSM_HART_SUSPEND 3
+
+#define SBI_HSM_STATE_STARTED 0
+#define SBI_HSM_STATE_STOPPED 1
+#define SBI_HSM_STATE_START_PENDING 2
+#define SBI_HSM_STATE_STOP_PENDING 3
+#define SBI_HSM_STATE_SUSPENDED 4
+#define SBI_HSM_STATE_SUSPEND_PENDING 5
+#define SBI_HSM_STATE_RESUME_PENDING 6
+
+#define SBI_HSM_SUSPEND_RETENTIVE 0x00000000
+#define SBI_HSM_SUSPEND_NON_RETENTIVE 0x80000000
+
+#define SBI_EXT_PMU 0x504D55
+#define SBI_EXT_PMU_NUM_COUNTERS 0
+#define SBI_EXT_PMU_COUNTER_GET_INFO 1
+#define SBI_EXT_PMU_COUNTER_CFG_MATCH 2
+#define SBI_EXT_PMU_COUNTER_START 3
+#define SBI_EXT_PMU_COUNTER_STOP 4
+#define SBI_EXT_PMU_COUNTER_FW_READ 5
+#define SBI_EXT_PMU_COUNTER_FW_READ_HI 6
+
+#define SBI_PMU_CFG_FLAG_SKIP_MATCH 0x1
+#define SBI_PMU_CFG_FLAG_CLEAR_VALUE 0x2
+#define SBI_PMU_CFG_FLAG_AUTO_START 0x4
+#define SBI_PMU_START_FLAG_SET_INIT_VALUE 0x1
+#define SBI_PMU_STOP_FLAG_RESET 0x1
+
+// event_idx is a type in bits 19:16 and a code in bits 15:0
+#define SBI_PMU_EVENT_TYPE_HW 0
+#define SBI_PMU_EVENT_TYPE_HW_CACHE 1
+#define SBI_PMU_EVENT_TYPE_HW_RAW 2
+#define SBI_PMU_EVENT_TYPE_FW 15
+
+#define SBI_PMU_HW_CPU_CYCLES 1
+#define SBI_PMU_HW_INSTRUCTIONS 2
+
+#define SBI_PMU_FW_MISALIGNED_LOAD 0
+#define SBI_PMU_FW_MISALIGNED_STORE 1
+#define SBI_PMU_FW_ACCESS_LOAD 2
+#define SBI_PMU_FW_ACCESS_STORE 3
+#define SBI_PMU_FW_ILLEGAL_INSN 4
+#define SBI_PMU_FW_SET_TIMER 5
+#define SBI_PMU_FW_IPI_SENT 6
+#define SBI_PMU_FW_IPI_RECEIVED 7
+#define SBI_PMU_FW_FENCE_I_SENT 8
+#define SBI_PMU_FW_FENCE_I_RECEIVED 9
+#define SBI_PMU_FW_SFENCE_VMA_SENT 10
+#define SBI_PMU_FW_SFENCE_VMA_RECEIVED 11
+#define SBI_PMU_FW_SFENCE_VMA_ASID_SENT 12
+#define SBI_PMU_FW_SFENCE_VMA_ASID_RECEIVED 13
+
+// bbl's own calls, in the space the SBI sets aside for each implementation
+#define SBI_EXT_BBL (0x0A000000 + SBI_IMPL_ID_BBL)
+#define SBI_EXT_BBL_EMULATION_STAT 0
+#define SBI_EXT_BBL_EMULATION_STAT_RESET 1
+
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_DENIED -4
+#define SBI_ERR_INVALID_ADDRESS -5
+#define SBI_ERR_ALREADY_AVAILABLE -6
+#define SBI_ERR_ALREADY_STARTED -7
+#define SBI_ERR_ALREADY_STOPPED -8
+
 #endif
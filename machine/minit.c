@@ -8,13 +8,18 @@
 #include "uart.h"
 #include "uart16550.h"
 #include "uart_litex.h"
+#include "console.h"
+#include "hsm.h"
+#include "pmu.h"
 #include "finisher.h"
 #include "disabled_hart_mask.h"
 #include "htif.h"
+#include "boot_trace.h"
 #include <string.h>
 #include <limits.h>
 
 uintptr_t mem_size;
+uintptr_t satp_mode_max;
 volatile uint64_t* mtime;
 volatile uint32_t* plic_priorities;
 uint64_t misa_image;
@@ -117,6 +122,7 @@ static void fp_init()
 
 hls_t* hls_init(uintptr_t id)
 {
+  _Static_assert(sizeof(hls_t) <= HLS_SIZE, "HLS_SIZE too small");
   hls_t* hls = OTHER_HLS(id);
   memset(hls, 0, sizeof(*hls));
   return hls;
@@ -124,7 +130,25 @@ hls_t* hls_init(uintptr_t id)
 
 static void memory_init()
 {
-  mem_size = mem_size / MEGAPAGE_SIZE * MEGAPAGE_SIZE;
+  mem_size = mem_size / RISCV_PGSIZE * RISCV_PGSIZE;
+}
+
+static void satp_probe()
+{
+  if (!supports_extension('S'))
+    return;
+
+  // satp ignores writes of unsupported modes, and M-mode accesses are
+  // untranslated, so just try each mode from the widest down.
+  for (uintptr_t mode = SATP_MODE_MAX; mode >= SATP_MODE_MIN; mode--) {
+    write_csr(satp, INSERT_FIELD(0, SATP_MODE, mode));
+    if (EXTRACT_FIELD(read_csr(satp), SATP_MODE) == mode) {
+      satp_mode_max = mode;
+      break;
+    }
+  }
+
+  write_csr(satp, 0);
 }
 
 static void hart_init()
@@ -138,6 +162,27 @@ static void hart_init()
   setup_pmp();
 }
 
+// menvcfg.STCE is WARL, so it only sticks where Sstc is implemented
+static void sstc_init()
+{
+  if (!supports_extension('S'))
+    return;
+
+#if __riscv_xlen == 32
+  set_csr(menvcfgh, MENVCFGH_STCE);
+  HLS()->sstc = !!(read_csr(menvcfgh) & MENVCFGH_STCE);
+  if (HLS()->sstc) {
+    write_csr(stimecmph, -1);
+    write_csr(stimecmp, -1);
+  }
+#else
+  set_csr(menvcfg, MENVCFG_STCE);
+  HLS()->sstc = !!(read_csr(menvcfg) & MENVCFG_STCE);
+  if (HLS()->sstc)
+    write_csr(stimecmp, -1);
+#endif
+}
+
 static void plic_init()
 {
   for (size_t i = 1; i <= plic_ndevs; i++)
@@ -184,19 +229,23 @@ static void hart_plic_init()
 
 static void wake_harts()
 {
-  for (int hart = 0; hart < MAX_HARTS; ++hart)
-    if ((((~disabled_hart_mask & hart_mask) >> hart) & 1))
+  for_each_hart(hart, &hart_mask)
+    if (!hart_mask_test(&disabled_hart_mask, hart))
       *OTHER_HLS(hart)->ipi = 1; // wakeup the hart
 }
 
 void init_first_hart(uintptr_t hartid, uintptr_t dtb)
 {
+  boot_trace("reset");
   mstatus_init();
+  fdt_index(dtb);
+  boot_trace("fdt index");
   // Confirm console as early as possible
   query_uart(dtb);
   query_uart16550(dtb);
   query_uart_litex(dtb);
   query_htif(dtb);
+  boot_trace("console");
 
   hart_init();
   hls_init(0); // this might get called again from parse_config_string
@@ -206,16 +255,24 @@ void init_first_hart(uintptr_t hartid, uintptr_t dtb)
 
   query_mem(dtb);
   query_harts(dtb);
+  hsm_init(hartid);
   query_clint(dtb);
+  query_sswi(dtb);
   query_plic(dtb);
   query_chosen(dtb);
+  boot_trace("fdt scan");
 
   wake_harts();
 
   plic_init();
   hart_plic_init();
+  console_irq_init(1);
+  sstc_init();
+  pmu_init();
   //prci_test();
+  satp_probe();
   memory_init();
+  boot_trace("hart init");
   boot_loader(dtb);
 }
 
@@ -223,6 +280,9 @@ void init_other_hart(uintptr_t hartid, uintptr_t dtb)
 {
   hart_init();
   hart_plic_init();
+  console_irq_init(0);
+  sstc_init();
+  pmu_init();
   boot_other_hart(dtb);
 }
 
@@ -247,7 +307,12 @@ void enter_supervisor_mode(void (*fn)(uintptr_t), uintptr_t arg0, uintptr_t arg1
   mstatus = INSERT_FIELD(mstatus, MSTATUS_MPIE, 0);
   write_csr(mstatus, mstatus);
   write_csr(mscratch, MACHINE_STACK_TOP() - MENTRY_FRAME_SIZE);
-  write_csr(menvcfg, MENVCFG_SSE | MENVCFG_CBCFE | INSERT_FIELD(0, MENVCFG_CBIE, 1));
+  uintptr_t menvcfg = MENVCFG_SSE | MENVCFG_CBCFE | MENVCFG_CBZE | INSERT_FIELD(0, MENVCFG_CBIE, 1);
+#if __riscv_xlen == 64
+  if (HLS()->sstc)
+    menvcfg |= MENVCFG_STCE; // menvcfgh keeps it on RV32
+#endif
+  write_csr(menvcfg, menvcfg);
 #ifndef __riscv_flen
   uintptr_t *p_fcsr = (uintptr_t*)(MACHINE_STACK_TOP() - MENTRY_FRAME_SIZE); // the x0's save slot
   *p_fcsr = 0;
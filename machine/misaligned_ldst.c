@@ -4,6 +4,10 @@
 #include "fp_emulation.h"
 #include "unprivileged_memory.h"
 #include "mtrap.h"
+#include "pmu.h"
+#include "emulation_stat.h"
+#include "insn_cache.h"
+#include "mcall.h"
 #include "config.h"
 #include "pk.h"
 
@@ -15,16 +19,20 @@ union byte_array {
   uint64_t int64;
 };
 
-void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+DECLARE_EMULATION_FUNC(emulate_misaligned_load)
 {
+  pmu_fw_event(SBI_PMU_FW_MISALIGNED_LOAD);
+
   union byte_array val;
-  uintptr_t mstatus;
-  insn_t insn = get_insn(mepc, &mstatus);
+  insn_t fetched = insn;
   uintptr_t npc = mepc + insn_len(insn);
   uintptr_t addr = read_csr(mtval);
 
   int shift = 0, fp = 0, len;
-  if ((insn & MASK_LW) == MATCH_LW)
+  const decoded_insn_t* d = insn_cache_lookup(mepc, insn);
+  if (d && d->category == EMULATION_MISALIGNED_LOAD)
+    len = d->len, shift = d->shift, fp = d->fp, insn = d->operands;
+  else if ((insn & MASK_LW) == MATCH_LW)
     len = 4, shift = 8*(sizeof(uintptr_t) - len);
 #if __riscv_xlen == 64
   else if ((insn & MASK_LD) == MATCH_LD)
@@ -81,6 +89,11 @@ void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
   }
 
+  if (!d || d->category != EMULATION_MISALIGNED_LOAD)
+    insn_cache_fill(&(decoded_insn_t){
+      .mepc = mepc, .insn = fetched, .operands = insn,
+      .category = EMULATION_MISALIGNED_LOAD, .len = len, .shift = shift, .fp = fp });
+
   val.int64 = 0;
   for (intptr_t i = 0; i < len; i++)
     val.bytes[i] = load_uint8_t((void *)(addr + i), mepc);
@@ -101,16 +114,26 @@ void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
   write_csr(mepc, npc);
 }
 
-void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+void misaligned_load(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
-  union byte_array val;
   uintptr_t mstatus;
   insn_t insn = get_insn(mepc, &mstatus);
+  emulate_misaligned_load(regs, mcause, mepc, mstatus, insn);
+}
+
+DECLARE_EMULATION_FUNC(emulate_misaligned_store)
+{
+  pmu_fw_event(SBI_PMU_FW_MISALIGNED_STORE);
+
+  union byte_array val;
+  insn_t fetched = insn;
   uintptr_t npc = mepc + insn_len(insn);
-  int len;
+  int fp = 0, len;
 
-  val.intx = GET_RS2(insn, regs);
-  if ((insn & MASK_SW) == MATCH_SW)
+  const decoded_insn_t* d = insn_cache_lookup(mepc, insn);
+  if (d && d->category == EMULATION_MISALIGNED_STORE)
+    len = d->len, fp = d->fp, insn = d->operands;
+  else if ((insn & MASK_SW) == MATCH_SW)
     len = 4;
 #if __riscv_xlen == 64
   else if ((insn & MASK_SD) == MATCH_SD)
@@ -118,11 +141,11 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 #endif
 #ifdef PK_ENABLE_FP_EMULATION
   else if ((insn & MASK_FSD) == MATCH_FSD)
-    len = 8, val.int64 = GET_F64_RS2(insn, regs);
+    fp = 1, len = 8;
   else if ((insn & MASK_FSW) == MATCH_FSW)
-    len = 4, val.intx = GET_F32_RS2(insn, regs);
+    fp = 1, len = 4;
   else if ((insn & MASK_FSH) == MATCH_FSH)
-    len = 2, val.intx = GET_F32_RS2(insn, regs);
+    fp = 1, len = 2;
 #endif
   else if ((insn & MASK_SH) == MATCH_SH)
     len = 2;
@@ -136,24 +159,24 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 #ifdef __riscv_compressed
 # if __riscv_xlen >= 64
   else if ((insn & MASK_C_SD) == MATCH_C_SD)
-    len = 8, val.intx = GET_RS2S(insn, regs);
+    len = 8, insn = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_SDSP) == MATCH_C_SDSP)
-    len = 8, val.intx = GET_RS2C(insn, regs);
+    len = 8, insn = RVC_RS2(insn) << SH_RS2;
 # endif
   else if ((insn & MASK_C_SW) == MATCH_C_SW)
-    len = 4, val.intx = GET_RS2S(insn, regs);
+    len = 4, insn = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_SWSP) == MATCH_C_SWSP)
-    len = 4, val.intx = GET_RS2C(insn, regs);
+    len = 4, insn = RVC_RS2(insn) << SH_RS2;
 # ifdef PK_ENABLE_FP_EMULATION
   else if ((insn & MASK_C_FSD) == MATCH_C_FSD)
-    len = 8, val.int64 = GET_F64_RS2S(insn, regs);
+    fp = 1, len = 8, insn = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_FSDSP) == MATCH_C_FSDSP)
-    len = 8, val.int64 = GET_F64_RS2C(insn, regs);
+    fp = 1, len = 8, insn = RVC_RS2(insn) << SH_RS2;
 #  if __riscv_xlen == 32
   else if ((insn & MASK_C_FSW) == MATCH_C_FSW)
-    len = 4, val.intx = GET_F32_RS2S(insn, regs);
+    fp = 1, len = 4, insn = RVC_RS2S(insn) << SH_RS2;
   else if ((insn & MASK_C_FSWSP) == MATCH_C_FSWSP)
-    len = 4, val.intx = GET_F32_RS2C(insn, regs);
+    fp = 1, len = 4, insn = RVC_RS2(insn) << SH_RS2;
 #  endif
 # endif
 #endif
@@ -163,6 +186,20 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
     return truly_illegal_insn(regs, mcause, mepc, mstatus, insn);
   }
 
+  if (!d || d->category != EMULATION_MISALIGNED_STORE)
+    insn_cache_fill(&(decoded_insn_t){
+      .mepc = mepc, .insn = fetched, .operands = insn,
+      .category = EMULATION_MISALIGNED_STORE, .len = len, .fp = fp });
+
+  if (!fp)
+    val.intx = GET_RS2(insn, regs);
+#ifdef PK_ENABLE_FP_EMULATION
+  else if (len == 8)
+    val.int64 = GET_F64_RS2(insn, regs);
+  else
+    val.intx = GET_F32_RS2(insn, regs);
+#endif
+
   uintptr_t addr = read_csr(mtval);
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
   intptr_t offs = (len == 8? 0 : sizeof(val.intx) - len);
@@ -174,3 +211,26 @@ void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 
   write_csr(mepc, npc);
 }
+
+void misaligned_store(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  uintptr_t mstatus;
+  insn_t insn = get_insn(mepc, &mstatus);
+  emulate_misaligned_store(regs, mcause, mepc, mstatus, insn);
+}
+
+void misaligned_load_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  uintptr_t cycle0 = emulation_begin(EMULATION_MISALIGNED_LOAD);
+  misaligned_load(regs, mcause, mepc);
+  emulation_end(mepc, cycle0);
+  emulate_run_ahead(regs, mepc, EMULATION_MISALIGNED_LOAD);
+}
+
+void misaligned_store_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  uintptr_t cycle0 = emulation_begin(EMULATION_MISALIGNED_STORE);
+  misaligned_store(regs, mcause, mepc);
+  emulation_end(mepc, cycle0);
+  emulate_run_ahead(regs, mepc, EMULATION_MISALIGNED_STORE);
+}
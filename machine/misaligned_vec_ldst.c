@@ -4,6 +4,7 @@
 #include "fp_emulation.h"
 #include "unprivileged_memory.h"
 #include "mtrap.h"
+#include "emulation_stat.h"
 #include "config.h"
 #include "pk.h"
 
@@ -52,6 +53,8 @@ static inline void vsetvl(uintptr_t vl, uintptr_t vtype)
 
 DECLARE_EMULATION_FUNC(misaligned_vec_ldst)
 {
+  emulation_category(EMULATION_MISALIGNED_VECTOR);
+
   uintptr_t vl = read_csr(vl);
   uintptr_t vtype = read_csr(vtype);
   uintptr_t vlenb = read_csr(vlenb);
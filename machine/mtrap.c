@@ -6,14 +6,18 @@
 #include "atomic.h"
 #include "bits.h"
 #include "vm.h"
-#include "uart.h"
-#include "uart16550.h"
-#include "uart_litex.h"
+#include "console.h"
+#include "hsm.h"
+#include "pmu.h"
+#include "emulation_stat.h"
+#include "insn_cache.h"
 #include "finisher.h"
 #include "fdt.h"
 #include "unprivileged_memory.h"
 #include "disabled_hart_mask.h"
+#include "config.h"
 #include <errno.h>
+#include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -24,22 +28,13 @@ void __attribute__((noreturn)) bad_trap(uintptr_t* regs, uintptr_t dummy, uintpt
 
 static uintptr_t mcall_console_putchar(uint8_t ch)
 {
-  if (uart) {
-    uart_putchar(ch);
-  } else if (uart16550) {
-    uart16550_putchar(ch);
-  } else if (uart_litex) {
-    uart_litex_putchar(ch);
-  } else if (htif) {
-    htif_console_putchar(ch);
-  }
+  console_putchar(ch);
   return 0;
 }
 
 void putstring(const char* s)
 {
-  while (*s)
-    mcall_console_putchar(*s++);
+  console_write(s, strlen(s));
 }
 
 void vprintm(const char* s, va_list vl)
@@ -58,9 +53,23 @@ void printm(const char* s, ...)
   va_end(vl);
 }
 
+// An SSWI only wakes a hart whose payload runs, or is suspended, in
+// S-mode.  Harts asleep in M-mode, stopped or helping pk, enable just
+// MSIP, so they are rung through MSWI.
+static int sswi_wakes(hls_t* hls)
+{
+  return hls->sswi && (hls->hsm_state == SBI_HSM_STATE_STARTED ||
+                       hls->hsm_state == SBI_HSM_STATE_SUSPENDED);
+}
+
 static void send_ipi(uintptr_t recipient, int event)
 {
-  if (((disabled_hart_mask >> recipient) & 1)) return;
+  if (hart_mask_test(&disabled_hart_mask, recipient)) return;
+  if (event == IPI_SOFT && sswi_wakes(OTHER_HLS(recipient))) {
+    mb();
+    *OTHER_HLS(recipient)->sswi = 1;
+    return;
+  }
   atomic_or(&OTHER_HLS(recipient)->mipi_pending, event);
   mb();
   *OTHER_HLS(recipient)->ipi = 1;
@@ -68,17 +77,7 @@ static void send_ipi(uintptr_t recipient, int event)
 
 static uintptr_t mcall_console_getchar()
 {
-  if (uart) {
-    return uart_getchar();
-  } else if (uart16550) {
-    return uart16550_getchar();
-  } else if (uart_litex) {
-    return uart_litex_getchar();
-  } else if (htif) {
-    return htif_console_getchar();
-  } else {
-    return (uintptr_t)-1;
-  }
+  return console_getchar();
 }
 
 static uintptr_t mcall_clear_ipi()
@@ -93,47 +92,540 @@ static uintptr_t mcall_shutdown()
 
 static uintptr_t mcall_set_timer(uint64_t when)
 {
+  pmu_fw_event(SBI_PMU_FW_SET_TIMER);
+
+  // With Sstc the payload should write stimecmp itself, but the call
+  // still has to work.  mip.STIP follows stimecmp then, not M-mode.
+  if (HLS()->sstc) {
+#if __riscv_xlen == 32
+    write_csr(stimecmph, -1);
+    write_csr(stimecmp, (uint32_t)when);
+    write_csr(stimecmph, when >> 32);
+#else
+    write_csr(stimecmp, when);
+#endif
+    return 0;
+  }
+
   *HLS()->timecmp = when;
   clear_csr(mip, MIP_STIP);
   set_csr(mie, MIP_MTIP);
   return 0;
 }
 
-static void send_ipi_many(uintptr_t* pmask, int event)
+// Past this many pages a remote sfence.vma flushes the whole TLB, or the
+// whole ASID, instead of going page by page
+#define SFENCE_VMA_PAGE_LIMIT 64
+#define SFENCE_VMA_ALL_ASIDS ((uintptr_t)-1)
+
+static void sfence_vma_range(uintptr_t start, uintptr_t size, uintptr_t asid)
 {
-  _Static_assert(MAX_HARTS <= 8 * sizeof(*pmask), "# harts > uintptr_t bits");
-  uintptr_t mask = hart_mask;
-  if (pmask)
-    mask &= load_uintptr_t(pmask, read_csr(mepc));
+  if (size > SFENCE_VMA_PAGE_LIMIT * RISCV_PGSIZE) {
+    if (asid == SFENCE_VMA_ALL_ASIDS)
+      asm volatile ("sfence.vma" ::: "memory");
+    else
+      asm volatile ("sfence.vma x0, %0" :: "r"(asid) : "memory");
+    return;
+  }
 
-  // send IPIs to everyone
-  for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
-    if (m & 1)
-      send_ipi(i, event);
+  if (size == 0)
+    return;
 
-  if (event == IPI_SOFT)
+  uintptr_t va = ROUNDDOWN(start, RISCV_PGSIZE);
+  uintptr_t pages = (start + size - 1) / RISCV_PGSIZE - start / RISCV_PGSIZE + 1;
+  for (; pages--; va += RISCV_PGSIZE) {
+    if (asid == SFENCE_VMA_ALL_ASIDS)
+      asm volatile ("sfence.vma %0" :: "r"(va) : "memory");
+    else
+      asm volatile ("sfence.vma %0, %1" :: "r"(va), "r"(asid) : "memory");
+  }
+}
+
+// Queue a fence for a hart, merging it with one still pending there
+static void sfence_vma_request(uintptr_t hart, uintptr_t start, uintptr_t size, uintptr_t asid)
+{
+  hls_t* hls = OTHER_HLS(hart);
+
+  // a zero range, like an oversized one, means everything
+  if ((start == 0 && size == 0) || size > SFENCE_VMA_PAGE_LIMIT * RISCV_PGSIZE ||
+      start + size < start) {
+    start = 0;
+    size = -1;
+  }
+
+  spinlock_lock(&hls->sfence_lock);
+  if (hls->sfence_valid) {
+    if (hls->sfence_size == -1 || size == -1) {
+      hls->sfence_start = 0;
+      hls->sfence_size = -1;
+    } else {
+      uintptr_t lo = MIN(hls->sfence_start, start);
+      uintptr_t hi = MAX(hls->sfence_start + hls->sfence_size, start + size);
+      hls->sfence_start = lo;
+      hls->sfence_size = hi - lo;
+    }
+    if (hls->sfence_asid != asid)
+      hls->sfence_asid = SFENCE_VMA_ALL_ASIDS;
+  } else {
+    hls->sfence_start = start;
+    hls->sfence_size = size;
+    hls->sfence_asid = asid;
+    hls->sfence_valid = 1;
+  }
+  spinlock_unlock(&hls->sfence_lock);
+}
+
+static void ipi_sfence_vma()
+{
+  hls_t* hls = HLS();
+
+  spinlock_lock(&hls->sfence_lock);
+  int valid = hls->sfence_valid;
+  uintptr_t start = hls->sfence_start;
+  uintptr_t size = hls->sfence_size;
+  uintptr_t asid = hls->sfence_asid;
+  hls->sfence_valid = 0;
+  spinlock_unlock(&hls->sfence_lock);
+
+  if (valid) {
+    pmu_fw_event(asid == SFENCE_VMA_ALL_ASIDS ? SBI_PMU_FW_SFENCE_VMA_RECEIVED
+                                              : SBI_PMU_FW_SFENCE_VMA_ASID_RECEIVED);
+    sfence_vma_range(start, size, asid);
+  }
+}
+
+// Do the fences asked of this hart and acknowledge the harts that asked.
+// A sender posts its request before its ipi_from bit, so every sender
+// seen here is covered by the fences that follow.
+void ipi_complete()
+{
+  hls_t* hls = HLS();
+  uintptr_t self = read_csr(mhartid);
+  hart_mask_t from;
+  uintptr_t any = 0;
+
+  for (uintptr_t w = 0; w < HART_MASK_WORDS; w++) {
+    from.bits[w] = hls->ipi_from.bits[w] ? atomic_swap(&hls->ipi_from.bits[w], 0) : 0;
+    any |= from.bits[w];
+  }
+  if (!any)
     return;
 
-  // wait until all events have been handled.
-  // prevent deadlock by consuming incoming IPIs.
-  uint32_t incoming_ipi = 0;
-  for (uintptr_t i = 0, m = mask; m; i++, m >>= 1)
-    if (m & 1)
-      while (*OTHER_HLS(i)->ipi)
-        incoming_ipi |= atomic_swap(HLS()->ipi, 0);
-
-  // if we got an IPI, restore it; it will be taken after returning
-  if (incoming_ipi) {
-    *HLS()->ipi = incoming_ipi;
-    mb();
+  if (atomic_swap(&hls->fence_i_pending, 0)) {
+    pmu_fw_event(SBI_PMU_FW_FENCE_I_RECEIVED);
+    asm volatile ("fence.i");
+  }
+  ipi_sfence_vma();
+  // the payload changes code and mappings under a remote fence
+  insn_cache_flush();
+  mb();
+
+  uintptr_t bit = (uintptr_t)1 << (self % HART_MASK_BITS);
+  for_each_hart(hart, &from)
+    atomic_and(&OTHER_HLS(hart)->ipi_wait.bits[self / HART_MASK_BITS], ~bit);
+}
+
+void ipi_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
+{
+  // mentry took the other events; the fence bits only brought us here
+  atomic_and(&HLS()->mipi_pending, ~(IPI_FENCE_I | IPI_SFENCE_VMA));
+  ipi_complete();
+}
+
+// Only its own hart updates these, with M-mode interrupts off
+static ipi_stat_t ipi_stats[MAX_HARTS];
+
+const ipi_stat_t* ipi_stat(uintptr_t hartid)
+{
+  if (hartid >= MAX_HARTS)
+    return NULL;
+  return &ipi_stats[hartid];
+}
+
+static int ipi_wait_empty(const hls_t* hls)
+{
+  for (uintptr_t w = 0; w < HART_MASK_WORDS; w++)
+    if (atomic_read(&hls->ipi_wait.bits[w]))
+      return 0;
+  return 1;
+}
+
+// Wait for every hart this one has sent fences to.  Fences asked of this
+// hart meanwhile are done here too, or two harts fencing each other
+// would wait forever.
+static void ipi_wait_all(uintptr_t cycle0)
+{
+  hls_t* hls = HLS();
+
+  while (!ipi_wait_empty(hls))
+    ipi_complete();
+
+  uintptr_t cycles = read_csr(mcycle) - cycle0;
+  ipi_stat_t* stat = &ipi_stats[read_csr(mhartid)];
+  stat->waits++;
+  stat->wait_cycles += cycles;
+  if (cycles > stat->max_wait_cycles)
+    stat->max_wait_cycles = cycles;
+}
+
+// Send event to the harts in mask and, for the fences, wait for them to
+// acknowledge it.  IPI_SFENCE_VMA fences [start, start + size) in asid.
+// Every IPI goes out before the wait, so the harts fence in parallel and
+// the wait lasts as long as the slowest of them.
+static void send_ipi_many(const hart_mask_t* mask, int event, uintptr_t start, uintptr_t size, uintptr_t asid)
+{
+  hls_t* hls = HLS();
+  uintptr_t self = read_csr(mhartid);
+  uintptr_t self_bit = (uintptr_t)1 << (self % HART_MASK_BITS);
+  int fence = event & (IPI_FENCE_I | IPI_SFENCE_VMA);
+  uintptr_t cycle0 = read_csr(mcycle);
+  hart_mask_t targets;
+  int fw_event = event == IPI_SOFT ? SBI_PMU_FW_IPI_SENT :
+                 event == IPI_FENCE_I ? SBI_PMU_FW_FENCE_I_SENT :
+                 event != IPI_SFENCE_VMA ? -1 : // IPI_HALT counts as no event
+                 asid == SFENCE_VMA_ALL_ASIDS ? SBI_PMU_FW_SFENCE_VMA_SENT :
+                 SBI_PMU_FW_SFENCE_VMA_ASID_SENT;
+
+#ifdef PK_ASYNC_REMOTE_FENCE
+  // at most one fan-out in flight: the previous one completes first
+  if (fence && !ipi_wait_empty(hls))
+    ipi_wait_all(cycle0);
+  cycle0 = read_csr(mcycle);
+#endif
+
+  for (uintptr_t w = 0; w < HART_MASK_WORDS; w++) {
+    targets.bits[w] = mask->bits[w] & hart_mask.bits[w] & ~disabled_hart_mask.bits[w];
+    if (fence && targets.bits[w])
+      atomic_or(&hls->ipi_wait.bits[w], targets.bits[w]);
+  }
+
+  for_each_hart(hart, &targets) {
+    hls_t* other = OTHER_HLS(hart);
+    if (event == IPI_SFENCE_VMA)
+      sfence_vma_request(hart, start, size, asid);
+    if (event == IPI_FENCE_I)
+      other->fence_i_pending = 1;
+    if (fence)
+      atomic_or(&other->ipi_from.bits[self / HART_MASK_BITS], self_bit);
+    send_ipi(hart, event);
+    ipi_stats[self].sent++;
+    if (fw_event >= 0)
+      pmu_fw_event(fw_event);
+  }
+
+#ifndef PK_ASYNC_REMOTE_FENCE
+  if (fence)
+    ipi_wait_all(cycle0);
+#endif
+}
+
+// SBI v0.1 passes a pointer to a one-word hart mask, or NULL for all harts
+static void legacy_hart_mask(uintptr_t pmask, hart_mask_t* harts)
+{
+  if (!pmask) {
+    *harts = hart_mask;
+    return;
+  }
+  memset(harts, 0, sizeof(*harts));
+  harts->bits[0] = load_uintptr_t((uintptr_t*)pmask, read_csr(mepc));
+}
+
+// SBI v0.2 passes the mask by value, relative to hart_mask_base; a base
+// of -1 means all harts
+static long sbi_hart_mask(uintptr_t mask, uintptr_t base, hart_mask_t* harts)
+{
+  if (base == (uintptr_t)-1) {
+    *harts = hart_mask;
+    return SBI_SUCCESS;
+  }
+
+  memset(harts, 0, sizeof(*harts));
+  for (uintptr_t i = 0; mask; i++, mask >>= 1) {
+    if (!(mask & 1))
+      continue;
+    if (base + i < base || !hart_mask_test(&hart_mask, base + i))
+      return SBI_ERR_INVALID_PARAM;
+    hart_mask_set(harts, base + i);
+  }
+  return SBI_SUCCESS;
+}
+
+// Memory S-mode may not touch, so neither may SBI calls made for it
+uintptr_t smode_denied_start, smode_denied_end;
+
+// DBCN buffers are given by physical address
+static long sbi_buffer(uintptr_t len, uintptr_t lo, uintptr_t hi, char** buf)
+{
+  if (hi || lo + len < lo)
+    return SBI_ERR_INVALID_PARAM;
+  if (lo < smode_denied_end && lo + len > smode_denied_start)
+    return SBI_ERR_INVALID_PARAM;
+  *buf = (char*)lo;
+  return SBI_SUCCESS;
+}
+
+static long mcall_dbcn(uintptr_t fid, uintptr_t* regs, uintptr_t* value)
+{
+  uintptr_t len = regs[10];
+  char* buf;
+  long error;
+
+  switch (fid)
+  {
+    case SBI_EXT_DBCN_CONSOLE_WRITE:
+      if ((error = sbi_buffer(len, regs[11], regs[12], &buf)))
+        return error;
+      console_write(buf, len);
+      *value = len;
+      return SBI_SUCCESS;
+    case SBI_EXT_DBCN_CONSOLE_READ:
+      if ((error = sbi_buffer(len, regs[11], regs[12], &buf)))
+        return error;
+      // whatever has already arrived; reads never block
+      for (*value = 0; *value < len; (*value)++) {
+        int ch = mcall_console_getchar();
+        if (ch < 0)
+          break;
+        buf[*value] = ch;
+      }
+      return SBI_SUCCESS;
+    case SBI_EXT_DBCN_CONSOLE_WRITE_BYTE:
+      mcall_console_putchar(regs[10]);
+      return SBI_SUCCESS;
+    default:
+      return SBI_ERR_NOT_SUPPORTED;
+  }
+}
+
+static long mcall_hsm(uintptr_t fid, uintptr_t* regs, uintptr_t* value)
+{
+  long status;
+
+  switch (fid)
+  {
+    case SBI_EXT_HSM_HART_START:
+      return hsm_hart_start(regs[10], regs[11], regs[12]);
+    case SBI_EXT_HSM_HART_STOP:
+      return hsm_hart_stop();
+    case SBI_EXT_HSM_HART_GET_STATUS:
+      if ((status = hsm_hart_get_status(regs[10])) < 0)
+        return status;
+      *value = status;
+      return SBI_SUCCESS;
+    case SBI_EXT_HSM_HART_SUSPEND:
+      return hsm_hart_suspend(regs[10], regs[11], regs[12]);
+    default:
+      return SBI_ERR_NOT_SUPPORTED;
+  }
+}
+
+static long mcall_pmu(uintptr_t fid, uintptr_t* regs, uintptr_t* value)
+{
+  uint64_t count;
+  long ret;
+
+  // 64-bit arguments take two registers on RV32
+#if __riscv_xlen == 32
+  uint64_t event_data = regs[14] | (uint64_t)regs[15] << 32;
+  uint64_t initial_value = regs[13] | (uint64_t)regs[14] << 32;
+#else
+  uint64_t event_data = regs[14];
+  uint64_t initial_value = regs[13];
+#endif
+
+  switch (fid)
+  {
+    case SBI_EXT_PMU_NUM_COUNTERS:
+      *value = pmu_num_counters();
+      return SBI_SUCCESS;
+    case SBI_EXT_PMU_COUNTER_GET_INFO:
+      return pmu_counter_get_info(regs[10], value);
+    case SBI_EXT_PMU_COUNTER_CFG_MATCH:
+      ret = pmu_counter_config_matching(regs[10], regs[11], regs[12], regs[13], event_data);
+      if (ret < 0)
+        return ret;
+      *value = ret;
+      return SBI_SUCCESS;
+    case SBI_EXT_PMU_COUNTER_START:
+      return pmu_counter_start(regs[10], regs[11], regs[12], initial_value);
+    case SBI_EXT_PMU_COUNTER_STOP:
+      return pmu_counter_stop(regs[10], regs[11], regs[12]);
+    case SBI_EXT_PMU_COUNTER_FW_READ:
+    case SBI_EXT_PMU_COUNTER_FW_READ_HI:
+      if ((ret = pmu_counter_fw_read(regs[10], &count)))
+        return ret;
+#if __riscv_xlen == 32
+      *value = fid == SBI_EXT_PMU_COUNTER_FW_READ ? count : count >> 32;
+#else
+      *value = fid == SBI_EXT_PMU_COUNTER_FW_READ ? count : 0;
+#endif
+      return SBI_SUCCESS;
+    default:
+      return SBI_ERR_NOT_SUPPORTED;
+  }
+}
+
+// A hart's emulation_stat_t, copied to a buffer given like DBCN's
+static long mcall_bbl(uintptr_t fid, uintptr_t* regs, uintptr_t* value)
+{
+  const emulation_stat_t* stat = emulation_stat(regs[10]);
+  uintptr_t len = MIN(regs[11], sizeof(*stat));
+  char* buf;
+  long error;
+
+  if (!stat || !hart_mask_test(&hart_mask, regs[10]))
+    return SBI_ERR_INVALID_PARAM;
+
+  switch (fid)
+  {
+    case SBI_EXT_BBL_EMULATION_STAT:
+      if ((error = sbi_buffer(len, regs[12], regs[13], &buf)))
+        return error;
+      memcpy(buf, stat, len);
+      *value = len;
+      return SBI_SUCCESS;
+    case SBI_EXT_BBL_EMULATION_STAT_RESET:
+      emulation_stat_reset(regs[10]);
+      return SBI_SUCCESS;
+    default:
+      return SBI_ERR_NOT_SUPPORTED;
+  }
+}
+
+static long sbi_probe_extension(uintptr_t ext)
+{
+  switch (ext)
+  {
+    case SBI_SET_TIMER ... SBI_SHUTDOWN:
+    case SBI_EXT_BASE:
+    case SBI_EXT_TIME:
+    case SBI_EXT_IPI:
+    case SBI_EXT_RFENCE:
+    case SBI_EXT_DBCN:
+    case SBI_EXT_HSM:
+    case SBI_EXT_PMU:
+    case SBI_EXT_BBL:
+      return 1;
+    default:
+      return 0;
   }
 }
 
+static long mcall_base(uintptr_t fid, uintptr_t arg0, uintptr_t* value)
+{
+  switch (fid)
+  {
+    case SBI_EXT_BASE_GET_SPEC_VERSION:
+      *value = SBI_SPEC_VERSION;
+      return SBI_SUCCESS;
+    case SBI_EXT_BASE_GET_IMPL_ID:
+      *value = SBI_IMPL_ID_BBL;
+      return SBI_SUCCESS;
+    case SBI_EXT_BASE_GET_IMPL_VERSION:
+      *value = SBI_IMPL_VERSION;
+      return SBI_SUCCESS;
+    case SBI_EXT_BASE_PROBE_EXT:
+      *value = sbi_probe_extension(arg0);
+      return SBI_SUCCESS;
+    case SBI_EXT_BASE_GET_MVENDORID:
+      *value = read_csr(mvendorid);
+      return SBI_SUCCESS;
+    case SBI_EXT_BASE_GET_MARCHID:
+      *value = read_csr(marchid);
+      return SBI_SUCCESS;
+    case SBI_EXT_BASE_GET_MIMPID:
+      *value = read_csr(mimpid);
+      return SBI_SUCCESS;
+    default:
+      return SBI_ERR_NOT_SUPPORTED;
+  }
+}
+
+static long mcall_rfence(uintptr_t fid, uintptr_t* regs)
+{
+  hart_mask_t harts;
+  long error = sbi_hart_mask(regs[10], regs[11], &harts);
+  if (error)
+    return error;
+
+  switch (fid)
+  {
+    case SBI_EXT_RFENCE_REMOTE_FENCE_I:
+      send_ipi_many(&harts, IPI_FENCE_I, 0, 0, 0);
+      return SBI_SUCCESS;
+    case SBI_EXT_RFENCE_REMOTE_SFENCE_VMA:
+      send_ipi_many(&harts, IPI_SFENCE_VMA, regs[12], regs[13], SFENCE_VMA_ALL_ASIDS);
+      return SBI_SUCCESS;
+    case SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID:
+      send_ipi_many(&harts, IPI_SFENCE_VMA, regs[12], regs[13], regs[14]);
+      return SBI_SUCCESS;
+    default: // no hypervisor fences
+      return SBI_ERR_NOT_SUPPORTED;
+  }
+}
+
+// SBI v0.2 and later calls
+static void mcall_extension(uintptr_t* regs)
+{
+  uintptr_t ext = regs[17], fid = regs[16], value = 0;
+  hart_mask_t harts;
+  long error;
+
+  switch (ext)
+  {
+    case SBI_EXT_BASE:
+      error = mcall_base(fid, regs[10], &value);
+      break;
+    case SBI_EXT_TIME:
+      if (fid != SBI_EXT_TIME_SET_TIMER) {
+        error = SBI_ERR_NOT_SUPPORTED;
+        break;
+      }
+#if __riscv_xlen == 32
+      error = mcall_set_timer(regs[10] + ((uint64_t)regs[11] << 32));
+#else
+      error = mcall_set_timer(regs[10]);
+#endif
+      break;
+    case SBI_EXT_IPI:
+      if (fid != SBI_EXT_IPI_SEND_IPI) {
+        error = SBI_ERR_NOT_SUPPORTED;
+        break;
+      }
+      error = sbi_hart_mask(regs[10], regs[11], &harts);
+      if (!error)
+        send_ipi_many(&harts, IPI_SOFT, 0, 0, 0);
+      break;
+    case SBI_EXT_RFENCE:
+      error = mcall_rfence(fid, regs);
+      break;
+    case SBI_EXT_DBCN:
+      error = mcall_dbcn(fid, regs, &value);
+      break;
+    case SBI_EXT_HSM:
+      error = mcall_hsm(fid, regs, &value);
+      break;
+    case SBI_EXT_PMU:
+      error = mcall_pmu(fid, regs, &value);
+      break;
+    case SBI_EXT_BBL:
+      error = mcall_bbl(fid, regs, &value);
+      break;
+    default:
+      error = SBI_ERR_NOT_SUPPORTED;
+      break;
+  }
+
+  regs[10] = error;
+  regs[11] = value;
+}
+
 void mcall_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
 {
   write_csr(mepc, mepc + 4);
 
-  uintptr_t n = regs[17], arg0 = regs[10], arg1 = regs[11], retval, ipi_type;
+  uintptr_t n = regs[17], arg0 = regs[10], arg1 = regs[11], retval;
+  hart_mask_t harts;
 
   switch (n)
   {
@@ -144,16 +636,23 @@ void mcall_trap(uintptr_t* regs, uintptr_t mcause, uintptr_t mepc)
       retval = mcall_console_getchar();
       break;
     case SBI_SEND_IPI:
-      ipi_type = IPI_SOFT;
-      goto send_ipi;
+      legacy_hart_mask(arg0, &harts);
+      send_ipi_many(&harts, IPI_SOFT, 0, 0, 0);
+      retval = 0;
+      break;
     case SBI_REMOTE_SFENCE_VMA:
+      legacy_hart_mask(arg0, &harts);
+      send_ipi_many(&harts, IPI_SFENCE_VMA, arg1, regs[12], SFENCE_VMA_ALL_ASIDS);
+      retval = 0;
+      break;
     case SBI_REMOTE_SFENCE_VMA_ASID:
-      ipi_type = IPI_SFENCE_VMA;
-      goto send_ipi;
+      legacy_hart_mask(arg0, &harts);
+      send_ipi_many(&harts, IPI_SFENCE_VMA, arg1, regs[12], regs[13]);
+      retval = 0;
+      break;
     case SBI_REMOTE_FENCE_I:
-      ipi_type = IPI_FENCE_I;
-send_ipi:
-      send_ipi_many((uintptr_t*)arg0, ipi_type);
+      legacy_hart_mask(arg0, &harts);
+      send_ipi_many(&harts, IPI_FENCE_I, 0, 0, 0);
       retval = 0;
       break;
     case SBI_CLEAR_IPI:
@@ -170,6 +669,10 @@ send_ipi:
 #endif
       break;
     default:
+      if (n >= SBI_EXT_BASE) {
+        mcall_extension(regs);
+        return;
+      }
       retval = -ENOSYS;
       break;
   }
@@ -245,11 +748,12 @@ void trap_from_machine_mode(uintptr_t* regs, uintptr_t dummy, uintptr_t mepc)
 void poweroff(uint16_t code)
 {
   printm("Power off\r\n");
+  console_flush();
   finisher_exit(code);
   if (htif) {
     htif_poweroff();
   } else {
-    send_ipi_many(0, IPI_HALT);
+    send_ipi_many(&hart_mask, IPI_HALT, 0, 0, 0);
     while (1) { asm volatile ("wfi\n"); }
   }
 }
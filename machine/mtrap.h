@@ -4,18 +4,14 @@
 #define _RISCV_MTRAP_H
 
 #include "encoding.h"
-
-#ifdef __riscv_atomic
-# define MAX_HARTS 8 // arbitrary
-#else
-# define MAX_HARTS 1
-#endif
+#include "hart_mask.h"
 
 #ifndef __ASSEMBLER__
 
 #include <stdint.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include "atomic.h"
 
 #define read_const_csr(reg) ({ unsigned long __tmp; \
   asm ("csrr %0, " #reg : "=r"(__tmp)); \
@@ -36,10 +32,12 @@ extern volatile uint64_t* mtime;
 extern volatile uint32_t* plic_priorities;
 extern size_t plic_ndevs;
 extern uint64_t misa_image;
+extern uintptr_t smode_denied_start, smode_denied_end; // PMP-protected
 
 typedef struct {
   volatile uint32_t* ipi;
   volatile int mipi_pending;
+  volatile uint32_t* sswi; // ACLINT SSWI, if any: sets SSIP with no M-mode trap
 
   volatile uint64_t* timecmp;
 
@@ -47,6 +45,25 @@ typedef struct {
   volatile uint32_t* plic_m_ie;
   volatile uint32_t* plic_s_thresh;
   volatile uint32_t* plic_s_ie;
+
+  int sstc; // S-mode owns stimecmp; M-mode never sees the timer
+
+  // remote sfence.vma not yet performed; requests that pile up are merged
+  spinlock_t sfence_lock;
+  int sfence_valid;
+  uintptr_t sfence_start;
+  uintptr_t sfence_size;
+  uintptr_t sfence_asid;
+  volatile int fence_i_pending;
+
+  // harts that asked this one for a fence and await its acknowledgement,
+  // and the harts this one awaits in turn
+  hart_mask_t ipi_from;
+  hart_mask_t ipi_wait;
+
+  volatile int hsm_state; // SBI_HSM_STATE_*
+  uintptr_t hsm_start_addr;
+  uintptr_t hsm_opaque;
 } hls_t;
 
 #define MACHINE_STACK_TOP() ({ \
@@ -66,6 +83,15 @@ void putstring(const char* s);
 #define assert(x) ({ if (!(x)) die("assertion failed: %s", #x); })
 #define die(str, ...) ({ printm("%s:%d: " str "\n", __FILE__, __LINE__, ##__VA_ARGS__); poweroff(-1); })
 
+typedef struct {
+  unsigned long sent;        // IPIs
+  unsigned long waits;       // fan-outs waited on
+  unsigned long wait_cycles; // from the first IPI to the last acknowledgement
+  unsigned long max_wait_cycles;
+} ipi_stat_t;
+
+void ipi_complete();
+const ipi_stat_t* ipi_stat(uintptr_t hartid); // NULL if no such hart
 void setup_pmp();
 void enter_supervisor_mode(void (*fn)(uintptr_t), uintptr_t arg0, uintptr_t arg1)
   __attribute__((noreturn));
@@ -97,7 +123,7 @@ static inline void wfi()
 #else
 # define SOFT_FLOAT_CONTEXT_SIZE (8 * 32)
 #endif
-#define HLS_SIZE 64
+#define HLS_SIZE 256
 #define INTEGER_CONTEXT_SIZE (32 * REGBYTES)
 
 #endif
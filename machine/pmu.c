@@ -0,0 +1,373 @@
+// See LICENSE for license details.
+
+#include "pmu.h"
+#include "mtrap.h"
+#include "mcall.h"
+#include "hart_mask.h"
+#include <string.h>
+
+#define PMU_CYCLE 0
+#define PMU_INSTRET 2
+#define PMU_FIXED ((1 << PMU_CYCLE) | (1 << PMU_INSTRET))
+
+// the firmware events bbl raises
+#define PMU_FW_EVENTS ((1 << SBI_PMU_FW_MISALIGNED_LOAD) | \
+                       (1 << SBI_PMU_FW_MISALIGNED_STORE) | \
+                       (1 << SBI_PMU_FW_ILLEGAL_INSN) | \
+                       (1 << SBI_PMU_FW_SET_TIMER) | \
+                       (1 << SBI_PMU_FW_IPI_SENT) | \
+                       (1 << SBI_PMU_FW_FENCE_I_SENT) | \
+                       (1 << SBI_PMU_FW_FENCE_I_RECEIVED) | \
+                       (1 << SBI_PMU_FW_SFENCE_VMA_SENT) | \
+                       (1 << SBI_PMU_FW_SFENCE_VMA_RECEIVED) | \
+                       (1 << SBI_PMU_FW_SFENCE_VMA_ASID_SENT) | \
+                       (1 << SBI_PMU_FW_SFENCE_VMA_ASID_RECEIVED))
+
+// Only its own hart touches a pmu_t, from M-mode, so it needs no lock.
+// Counter sets are a bit per counter; the firmware counters follow the
+// last hardware one, as the SBI expects counter numbers to be dense.
+typedef struct {
+  uint32_t hw_present;
+  int fw_base;
+  int inhibit;            // mcountinhibit is implemented
+  uint64_t used;          // configured by the payload
+  uint64_t started;
+  uint32_t fw_active;     // events some started firmware counter counts
+  uint8_t fw_event[PMU_FW_COUNTERS];
+  uint64_t fw_value[PMU_FW_COUNTERS];
+} pmu_t;
+
+static pmu_t pmu_harts[MAX_HARTS];
+
+#define PMU() (&pmu_harts[read_csr(mhartid)])
+
+#define HPM_COUNTERS(X) \
+  X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+  X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) \
+  X(28) X(29) X(30) X(31)
+
+uintptr_t pmu_read_hpmcounter(int counter)
+{
+  switch (counter)
+  {
+#define X(n) case n: return read_csr(mhpmcounter##n);
+    HPM_COUNTERS(X)
+#undef X
+  }
+  return 0;
+}
+
+void pmu_write_hpmcounter(int counter, uintptr_t value)
+{
+  switch (counter)
+  {
+#define X(n) case n: write_csr(mhpmcounter##n, value); break;
+    HPM_COUNTERS(X)
+#undef X
+  }
+}
+
+#if __riscv_xlen == 32
+uintptr_t pmu_read_hpmcounterh(int counter)
+{
+  switch (counter)
+  {
+#define X(n) case n: return read_csr(mhpmcounter##n##h);
+    HPM_COUNTERS(X)
+#undef X
+  }
+  return 0;
+}
+
+void pmu_write_hpmcounterh(int counter, uintptr_t value)
+{
+  switch (counter)
+  {
+#define X(n) case n: write_csr(mhpmcounter##n##h, value); break;
+    HPM_COUNTERS(X)
+#undef X
+  }
+}
+#endif
+
+uintptr_t pmu_read_hpmevent(int counter)
+{
+  switch (counter)
+  {
+#define X(n) case n: return read_csr(mhpmevent##n);
+    HPM_COUNTERS(X)
+#undef X
+  }
+  return 0;
+}
+
+void pmu_write_hpmevent(int counter, uintptr_t value)
+{
+  switch (counter)
+  {
+#define X(n) case n: write_csr(mhpmevent##n, value); break;
+    HPM_COUNTERS(X)
+#undef X
+  }
+}
+
+static void pmu_write_counter(int counter, uint64_t value)
+{
+#if __riscv_xlen == 32
+  // low half cleared first, so it cannot carry into the new high half
+  switch (counter)
+  {
+    case PMU_CYCLE:
+      write_csr(mcycle, 0);
+      write_csr(mcycleh, (uintptr_t)(value >> 32));
+      write_csr(mcycle, (uintptr_t)value);
+      break;
+    case PMU_INSTRET:
+      write_csr(minstret, 0);
+      write_csr(minstreth, (uintptr_t)(value >> 32));
+      write_csr(minstret, (uintptr_t)value);
+      break;
+    default:
+      pmu_write_hpmcounter(counter, 0);
+      pmu_write_hpmcounterh(counter, value >> 32);
+      pmu_write_hpmcounter(counter, value);
+      break;
+  }
+#else
+  switch (counter)
+  {
+    case PMU_CYCLE: write_csr(mcycle, (uintptr_t)value); break;
+    case PMU_INSTRET: write_csr(minstret, (uintptr_t)value); break;
+    default: pmu_write_hpmcounter(counter, value); break;
+  }
+#endif
+}
+
+void pmu_init()
+{
+  pmu_t* pmu = PMU();
+  uintptr_t tmp, inhibit = 0;
+
+  memset(pmu, 0, sizeof(*pmu));
+
+  // An mhpmcounter that is not implemented is hardwired to zero.  The
+  // events are left alone, as pk programs may read the counters.
+  pmu->hw_present = PMU_FIXED;
+  for (int i = 3; i < PMU_HW_COUNTERS; i++) {
+    uintptr_t value = pmu_read_hpmcounter(i);
+    pmu_write_hpmcounter(i, 1);
+    if (pmu_read_hpmcounter(i)) {
+      pmu->hw_present |= 1 << i;
+      pmu_write_hpmcounter(i, value);
+    }
+  }
+  pmu->fw_base = 32 - __builtin_clz(pmu->hw_present);
+
+  // Let every counter run; one stops only once config_matching claims
+  // it.  Harts older than mcountinhibit trap on it, and their counters
+  // cannot be stopped.
+  asm volatile ("la %[tmp], 1f\n\t"
+                "csrrw %[tmp], mtvec, %[tmp]\n\t"
+                "csrw 0x320, zero\n\t"
+                "li %[inhibit], 1\n\t"
+                ".align 2\n\t"
+                "1: csrw mtvec, %[tmp]"
+                : [tmp] "=&r" (tmp), [inhibit] "+r" (inhibit));
+  pmu->inhibit = inhibit;
+  pmu->started = PMU_FIXED;
+}
+
+static int pmu_is_fw(pmu_t* pmu, int counter)
+{
+  return counter >= pmu->fw_base;
+}
+
+// The counters an SBI base and mask name
+static long pmu_counters(pmu_t* pmu, uintptr_t base, uintptr_t mask, uint64_t* set)
+{
+  *set = 0;
+  for (uintptr_t i = 0; mask; i++, mask >>= 1) {
+    if (!(mask & 1))
+      continue;
+    uintptr_t counter = base + i;
+    if (counter < base || counter >= pmu->fw_base + PMU_FW_COUNTERS ||
+        (counter < pmu->fw_base && !((pmu->hw_present >> counter) & 1)))
+      return SBI_ERR_INVALID_PARAM;
+    *set |= 1ULL << counter;
+  }
+  return SBI_SUCCESS;
+}
+
+static void pmu_fw_recount(pmu_t* pmu)
+{
+  uint32_t active = 0;
+  for (int i = 0; i < PMU_FW_COUNTERS; i++)
+    if ((pmu->started >> (pmu->fw_base + i)) & 1)
+      active |= 1 << pmu->fw_event[i];
+  pmu->fw_active = active;
+}
+
+static void pmu_set_started(pmu_t* pmu, int counter, int start)
+{
+  uint64_t bit = 1ULL << counter;
+  pmu->started = start ? pmu->started | bit : pmu->started & ~bit;
+
+  if (pmu_is_fw(pmu, counter))
+    pmu_fw_recount(pmu);
+  else if (pmu->inhibit && start)
+    clear_csr(0x320, 1 << counter); // mcountinhibit, unknown to older gas
+  else if (pmu->inhibit)
+    set_csr(0x320, 1 << counter);
+}
+
+void pmu_fw_event(int event)
+{
+  pmu_t* pmu = PMU();
+  if (!((pmu->fw_active >> event) & 1))
+    return;
+
+  for (int i = 0; i < PMU_FW_COUNTERS; i++)
+    if (((pmu->started >> (pmu->fw_base + i)) & 1) && pmu->fw_event[i] == event)
+      pmu->fw_value[i]++;
+}
+
+uintptr_t pmu_num_counters()
+{
+  return PMU()->fw_base + PMU_FW_COUNTERS;
+}
+
+long pmu_counter_get_info(uintptr_t counter, uintptr_t* info)
+{
+  pmu_t* pmu = PMU();
+  uint64_t set;
+
+  if (pmu_counters(pmu, counter, 1, &set))
+    return SBI_ERR_INVALID_PARAM;
+
+  if (pmu_is_fw(pmu, counter))
+    *info = (uintptr_t)1 << (__riscv_xlen - 1);
+  else
+    *info = (CSR_CYCLE + counter) | (63 << 12); // CSR, and width less one
+  return SBI_SUCCESS;
+}
+
+long pmu_counter_config_matching(uintptr_t base, uintptr_t mask, uintptr_t flags,
+                                 uintptr_t event_idx, uint64_t event_data)
+{
+  pmu_t* pmu = PMU();
+  uint64_t set, fit;
+  long error = pmu_counters(pmu, base, mask, &set);
+  if (error)
+    return error;
+
+  // Hardware events other than cycles and instructions are named by raw
+  // mhpmevent values; bbl knows no mapping for the generic ones
+  uintptr_t type = (event_idx >> 16) & 0xF, code = event_idx & 0xFFFF;
+  if (type == SBI_PMU_EVENT_TYPE_FW && code < 32 && ((PMU_FW_EVENTS >> code) & 1))
+    fit = ((1ULL << PMU_FW_COUNTERS) - 1) << pmu->fw_base;
+  else if (type == SBI_PMU_EVENT_TYPE_HW && code == SBI_PMU_HW_CPU_CYCLES)
+    fit = 1 << PMU_CYCLE;
+  else if (type == SBI_PMU_EVENT_TYPE_HW && code == SBI_PMU_HW_INSTRUCTIONS)
+    fit = 1 << PMU_INSTRET;
+  else if (type == SBI_PMU_EVENT_TYPE_HW_RAW)
+    fit = pmu->hw_present & ~PMU_FIXED;
+  else
+    return SBI_ERR_NOT_SUPPORTED;
+
+  // SKIP_MATCH reconfigures the counter base names, in use or not
+  if (flags & SBI_PMU_CFG_FLAG_SKIP_MATCH)
+    set &= (mask & 1) ? 1ULL << base : 0;
+  else
+    set &= ~pmu->used;
+  if (!(set &= fit))
+    return SBI_ERR_NOT_SUPPORTED;
+
+  int counter = 0;
+  while (!((set >> counter) & 1))
+    counter++;
+
+  // stopped, even a hardware counter left running since boot
+  pmu_set_started(pmu, counter, 0);
+  pmu->used |= 1ULL << counter;
+
+  if (pmu_is_fw(pmu, counter)) {
+    pmu->fw_event[counter - pmu->fw_base] = code;
+    if (flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE)
+      pmu->fw_value[counter - pmu->fw_base] = 0;
+  } else {
+    if (type == SBI_PMU_EVENT_TYPE_HW_RAW)
+      pmu_write_hpmevent(counter, event_data);
+    if (flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE)
+      pmu_write_counter(counter, 0);
+  }
+
+  if (flags & SBI_PMU_CFG_FLAG_AUTO_START)
+    pmu_set_started(pmu, counter, 1);
+
+  return counter;
+}
+
+long pmu_counter_start(uintptr_t base, uintptr_t mask, uintptr_t flags, uint64_t value)
+{
+  pmu_t* pmu = PMU();
+  uint64_t set;
+  long error = pmu_counters(pmu, base, mask, &set);
+  if (error)
+    return error;
+  if (set & ~pmu->used)
+    return SBI_ERR_INVALID_PARAM;
+
+  for (int counter = 0; set >> counter; counter++) {
+    if (!((set >> counter) & 1))
+      continue;
+    if ((pmu->started >> counter) & 1) {
+      error = SBI_ERR_ALREADY_STARTED;
+      continue;
+    }
+    if (flags & SBI_PMU_START_FLAG_SET_INIT_VALUE) {
+      if (pmu_is_fw(pmu, counter))
+        pmu->fw_value[counter - pmu->fw_base] = value;
+      else
+        pmu_write_counter(counter, value);
+    }
+    pmu_set_started(pmu, counter, 1);
+  }
+
+  return error;
+}
+
+long pmu_counter_stop(uintptr_t base, uintptr_t mask, uintptr_t flags)
+{
+  pmu_t* pmu = PMU();
+  uint64_t set;
+  long error = pmu_counters(pmu, base, mask, &set);
+  if (error)
+    return error;
+
+  for (int counter = 0; set >> counter; counter++) {
+    if (!((set >> counter) & 1))
+      continue;
+    if ((pmu->started >> counter) & 1)
+      pmu_set_started(pmu, counter, 0);
+    else
+      error = SBI_ERR_ALREADY_STOPPED;
+
+    if (flags & SBI_PMU_STOP_FLAG_RESET) {
+      pmu->used &= ~(1ULL << counter);
+      if (!pmu_is_fw(pmu, counter) && !((PMU_FIXED >> counter) & 1))
+        pmu_write_hpmevent(counter, 0);
+    }
+  }
+
+  return error;
+}
+
+long pmu_counter_fw_read(uintptr_t counter, uint64_t* value)
+{
+  pmu_t* pmu = PMU();
+
+  if (counter < pmu->fw_base || counter >= pmu->fw_base + PMU_FW_COUNTERS)
+    return SBI_ERR_INVALID_PARAM;
+  *value = pmu->fw_value[counter - pmu->fw_base];
+  return SBI_SUCCESS;
+}
@@ -0,0 +1,37 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PMU_H
+#define _RISCV_PMU_H
+
+#include <stdint.h>
+
+// SBI performance monitoring.  The hardware counters are numbered by
+// CSR, less cycle; after the last of them come PMU_FW_COUNTERS counters
+// of bbl's own events, raised with pmu_fw_event().  Counters belong to
+// the hart that programs them.
+
+#define PMU_HW_COUNTERS 32
+#define PMU_FW_COUNTERS 16
+
+void pmu_init();
+void pmu_fw_event(int event); // SBI_PMU_FW_*
+
+// mhpmcounter3-31 and mhpmevent3-31 by number
+uintptr_t pmu_read_hpmcounter(int counter);
+void pmu_write_hpmcounter(int counter, uintptr_t value);
+#if __riscv_xlen == 32
+uintptr_t pmu_read_hpmcounterh(int counter);
+void pmu_write_hpmcounterh(int counter, uintptr_t value);
+#endif
+uintptr_t pmu_read_hpmevent(int counter);
+void pmu_write_hpmevent(int counter, uintptr_t value);
+
+uintptr_t pmu_num_counters();
+long pmu_counter_get_info(uintptr_t counter, uintptr_t* info);
+long pmu_counter_config_matching(uintptr_t base, uintptr_t mask, uintptr_t flags,
+                                 uintptr_t event_idx, uint64_t event_data);
+long pmu_counter_start(uintptr_t base, uintptr_t mask, uintptr_t flags, uint64_t value);
+long pmu_counter_stop(uintptr_t base, uintptr_t mask, uintptr_t flags);
+long pmu_counter_fw_read(uintptr_t counter, uint64_t* value);
+
+#endif
@@ -30,49 +30,42 @@ int uart_getchar()
   return ch;
 }
 
-struct uart_scan
+// With txcnt 1 the TX watermark means an empty FIFO
+static size_t uart_tx_room()
 {
-  int compat;
-  uint64_t reg;
-};
-
-static void uart_open(const struct fdt_scan_node *node, void *extra)
-{
-  struct uart_scan *scan = (struct uart_scan *)extra;
-  memset(scan, 0, sizeof(*scan));
+  return uart[UART_REG_IP] & UART_IP_TXWM ? UART_FIFO_DEPTH : 0;
 }
 
-static void uart_prop(const struct fdt_scan_prop *prop, void *extra)
+static void uart_tx(uint8_t ch)
 {
-  struct uart_scan *scan = (struct uart_scan *)extra;
-  if (!strcmp(prop->name, "compatible") && fdt_string_list_index(prop, "sifive,uart0") >= 0) {
-    scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    fdt_get_address(prop->node->parent, prop->value, &scan->reg);
-  }
+  uart[UART_REG_TXFIFO] = ch;
 }
 
-static void uart_done(const struct fdt_scan_node *node, void *extra)
+static void uart_irq_enable(int tx)
 {
-  struct uart_scan *scan = (struct uart_scan *)extra;
-  if (!scan->compat || !scan->reg || uart) return;
-
-  // Enable Rx/Tx channels
-  uart = (void*)(uintptr_t)scan->reg;
-  uart[UART_REG_TXCTRL] = UART_TXEN;
-  uart[UART_REG_RXCTRL] = UART_RXEN;
+  uart[UART_REG_IE] = UART_IP_RXWM | (tx ? UART_IP_TXWM : 0);
 }
 
+console_uart_t uart_console = {
+  .tx_room = uart_tx_room,
+  .tx = uart_tx,
+  .rx = uart_getchar,
+  .irq_enable = uart_irq_enable,
+};
+
 void query_uart(uintptr_t fdt)
 {
-  struct fdt_cb cb;
-  struct uart_scan scan;
+  uint64_t reg;
+  int node = fdt_next_node(fdt, -1, FDT_NAME_COMPATIBLE, "sifive,uart0");
 
-  memset(&cb, 0, sizeof(cb));
-  cb.open = uart_open;
-  cb.prop = uart_prop;
-  cb.done = uart_done;
-  cb.extra = &scan;
+  if (node < 0 || fdt_get_reg(fdt, node, 0, &reg, NULL) || !reg || uart) return;
+
+  // Enable Rx/Tx channels
+  uart = (void*)(uintptr_t)reg;
+  uart[UART_REG_TXCTRL] = UART_TXEN | UART_TXCNT(1);
+  uart[UART_REG_RXCTRL] = UART_RXEN; // rxcnt 0: any byte raises RXWM
 
-  fdt_scan(fdt, &cb);
+  struct fdt_scan_prop prop;
+  if (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS, &prop) == 0)
+    uart_console.irq = fdt_get_value(&prop, 0);
 }
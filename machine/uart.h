@@ -4,6 +4,7 @@
 #define _RISCV_UART_H
 
 #include <stdint.h>
+#include "console.h"
 
 extern volatile uint32_t* uart;
 
@@ -17,6 +18,12 @@ extern volatile uint32_t* uart;
 
 #define UART_TXEN		 0x1
 #define UART_RXEN		 0x1
+#define UART_TXCNT(n)		 ((n) << 16)
+#define UART_IP_TXWM		 0x1
+#define UART_IP_RXWM		 0x2
+#define UART_FIFO_DEPTH		 8
+
+extern console_uart_t uart_console;
 
 void uart_putchar(uint8_t ch);
 int uart_getchar();
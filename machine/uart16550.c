@@ -24,6 +24,10 @@ static uint32_t uart16550_clock = 1843200;   // a "common" base clock
 #define UART_REG_SCR       7    // scratch register
 #define UART_REG_STATUS_RX 0x01
 #define UART_REG_STATUS_TX 0x20
+#define UART_IER_RX        0x01
+#define UART_IER_TX        0x02
+#define UART_MCR_OUT2      0x08 // gates the interrupt line on PC-style parts
+#define UART_FIFO_SIZE     16   // a 16750 has more, but this much is safe
 
 // We cannot use the word DEFAULT for a parameter that cannot be overridden due to -Werror
 #ifndef UART_DEFAULT_BAUD
@@ -43,61 +47,72 @@ int uart16550_getchar()
   return -1;
 }
 
-struct uart16550_scan
+// THRE means the whole transmit FIFO is empty
+static size_t uart16550_tx_room()
 {
-  int compat;
-  uint64_t reg;
-  uint32_t reg_offset;
-  uint32_t reg_shift;
-  uint32_t clock_freq;
-  uint32_t baud;
+  if (uart16550[UART_REG_LSR << uart16550_reg_shift] & UART_REG_STATUS_TX)
+    return UART_FIFO_SIZE;
+  return 0;
+}
+
+static void uart16550_tx(uint8_t ch)
+{
+  uart16550[UART_REG_QUEUE << uart16550_reg_shift] = ch;
+}
+
+static void uart16550_irq_enable(int tx)
+{
+  uart16550[UART_REG_MCR << uart16550_reg_shift] |= UART_MCR_OUT2;
+  uart16550[UART_REG_IER << uart16550_reg_shift] = UART_IER_RX | (tx ? UART_IER_TX : 0);
+}
+
+console_uart_t uart16550_console = {
+  .tx_room = uart16550_tx_room,
+  .tx = uart16550_tx,
+  .rx = uart16550_getchar,
+  .irq_enable = uart16550_irq_enable,
 };
 
-static void uart16550_open(const struct fdt_scan_node *node, void *extra)
+static uint32_t uart16550_value(uintptr_t fdt, int node, int name, uint32_t otherwise)
 {
-  struct uart16550_scan *scan = (struct uart16550_scan *)extra;
-  memset(scan, 0, sizeof(*scan));
-  scan->baud = UART_DEFAULT_BAUD;
+  struct fdt_scan_prop prop;
+  if (fdt_get_prop(fdt, node, name, &prop))
+    return otherwise;
+  return fdt_get_value(&prop, 0);
 }
 
-static void uart16550_prop(const struct fdt_scan_prop *prop, void *extra)
+void query_uart16550(uintptr_t fdt)
 {
-  struct uart16550_scan *scan = (struct uart16550_scan *)extra;
+  uint64_t reg;
+  int node = -1;
+
   // For the purposes of the boot loader, the 16750 is a superset of what 16550a provides
-  if (!strcmp(prop->name, "compatible") && ((fdt_string_list_index(prop, "ns16550a") != -1) || (fdt_string_list_index(prop, "ns16750") != -1))) {
-    scan->compat = 1;
-  } else if (!strcmp(prop->name, "reg")) {
-    fdt_get_address(prop->node->parent, prop->value, &scan->reg);
-  } else if (!strcmp(prop->name, "reg-shift")) {
-    scan->reg_shift = fdt_get_value(prop, 0);
-  } else if (!strcmp(prop->name, "reg-offset")) {
-    scan->reg_offset = fdt_get_value(prop, 0);
-  } else if (!strcmp(prop->name, "current-speed")) {
-    // This is the property that Linux uses
-    scan->baud = fdt_get_value(prop, 0);
-  } else if (!strcmp(prop->name, "clock-frequency")) {
-    scan->clock_freq = fdt_get_value(prop, 0);
+  while ((node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, NULL)) >= 0) {
+    if ((fdt_match(fdt, node, FDT_NAME_COMPATIBLE, "ns16550a") || fdt_match(fdt, node, FDT_NAME_COMPATIBLE, "ns16750")) &&
+        fdt_get_reg(fdt, node, 0, &reg, NULL) == 0 && reg)
+      break;
   }
-}
+  if (node < 0 || uart16550) return;
 
-static void uart16550_done(const struct fdt_scan_node *node, void *extra)
-{
-  uint32_t clock_freq;
-  struct uart16550_scan *scan = (struct uart16550_scan *)extra;
-  if (!scan->compat || !scan->reg || uart16550) return;
+  uint32_t clock_freq = uart16550_value(fdt, node, FDT_NAME_CLOCK_FREQUENCY, 0);
+  // This is the property that Linux uses
+  uint32_t baud = uart16550_value(fdt, node, FDT_NAME_CURRENT_SPEED, UART_DEFAULT_BAUD);
+  uint32_t reg_offset = uart16550_value(fdt, node, FDT_NAME_REG_OFFSET, 0);
+  uint32_t reg_shift = uart16550_value(fdt, node, FDT_NAME_REG_SHIFT, 0);
+  uart16550_console.irq = uart16550_value(fdt, node, FDT_NAME_INTERRUPTS, 0);
 
-  if (scan->clock_freq != 0)
-    uart16550_clock = scan->clock_freq;
+  if (clock_freq != 0)
+    uart16550_clock = clock_freq;
   // if device tree doesn't supply a clock, fallback to default clock of 1843200
 
   // Check for divide by zero
-  uint32_t divisor = uart16550_clock / (16 * (scan->baud ? scan->baud : UART_DEFAULT_BAUD));
+  uint32_t divisor = uart16550_clock / (16 * (baud ? baud : UART_DEFAULT_BAUD));
   // If the divisor is out of range, don't assert, set the rate back to the default
   if (divisor >= 0x10000u)
     divisor = uart16550_clock / (16 * UART_DEFAULT_BAUD);
 
-  uart16550 = (void*)((uintptr_t)scan->reg + scan->reg_offset);
-  uart16550_reg_shift = scan->reg_shift;
+  uart16550 = (void*)((uintptr_t)reg + reg_offset);
+  uart16550_reg_shift = reg_shift;
   // http://wiki.osdev.org/Serial_Ports
   uart16550[UART_REG_IER << uart16550_reg_shift] = 0x00;                // Disable all interrupts
   uart16550[UART_REG_LCR << uart16550_reg_shift] = 0x80;                // Enable DLAB (set baud rate divisor)
@@ -106,17 +121,3 @@ static void uart16550_done(const struct fdt_scan_node *node, void *extra)
   uart16550[UART_REG_LCR << uart16550_reg_shift] = 0x03;                // 8 bits, no parity, one stop bit
   uart16550[UART_REG_FCR << uart16550_reg_shift] = 0xC7;                // Enable FIFO, clear them, with 14-byte threshold
 }
-
-void query_uart16550(uintptr_t fdt)
-{
-  struct fdt_cb cb;
-  struct uart16550_scan scan;
-
-  memset(&cb, 0, sizeof(cb));
-  cb.open = uart16550_open;
-  cb.prop = uart16550_prop;
-  cb.done = uart16550_done;
-  cb.extra = &scan;
-
-  fdt_scan(fdt, &cb);
-}
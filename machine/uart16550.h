@@ -4,9 +4,12 @@
 #define _RISCV_16550_H
 
 #include <stdint.h>
+#include "console.h"
 
 extern volatile uint8_t* uart16550;
 
+extern console_uart_t uart16550_console;
+
 void uart16550_putchar(uint8_t ch);
 int uart16550_getchar();
 void query_uart16550(uintptr_t dtb);
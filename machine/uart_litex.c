@@ -29,50 +29,56 @@ int uart_litex_getchar()
     return c;
 }
 
-struct uart_litex_scan
+// Only "not full" is known, so a burst is a byte
+static size_t uart_litex_tx_room()
 {
-    int compat;
-    uint64_t reg;
-};
+    return !(uart_litex[UART_REG_TXFULL] & 0x01);
+}
 
-static void uart_litex_open(const struct fdt_scan_node *node, void *extra)
+static void uart_litex_tx(uint8_t c)
 {
-    struct uart_litex_scan *scan = (struct uart_litex_scan *)extra;
-    memset(scan, 0, sizeof(*scan));
+    uart_litex[UART_REG_RXTX] = c;
 }
 
-static void uart_litex_prop(const struct fdt_scan_prop *prop, void *extra)
+static void uart_litex_irq_enable(int tx)
 {
-    struct uart_litex_scan *scan = (struct uart_litex_scan *)extra;
-    if (!strcmp(prop->name, "compatible") &&
-        (!strcmp((const char *)prop->value, "litex,uart0") ||
-         !strcmp((const char *)prop->value, "litex,liteuart"))) {
-        scan->compat = 1;
-    } else if (!strcmp(prop->name, "reg")) {
-        fdt_get_address(prop->node->parent, prop->value, &scan->reg);
-    }
+    uart_litex[UART_REG_EV_PENDING] = 0x01; // ack (UART_EV_TX)
+    uart_litex[UART_REG_EV_ENABLE] = 0x02 | (tx ? 0x01 : 0);
 }
 
-static void uart_litex_done(const struct fdt_scan_node *node, void *extra)
-{
-    struct uart_litex_scan *scan = (struct uart_litex_scan *)extra;
-    if (!scan->compat || !scan->reg || uart_litex)
-        return;
+console_uart_t uart_litex_console = {
+    .tx_room = uart_litex_tx_room,
+    .tx = uart_litex_tx,
+    .rx = uart_litex_getchar,
+    .irq_enable = uart_litex_irq_enable,
+};
 
-    // Initialize LiteX UART
-    uart_litex = (void *)(uintptr_t)scan->reg;
+static int uart_litex_compat(uintptr_t fdt, int node)
+{
+    struct fdt_scan_prop prop;
+    if (fdt_get_prop(fdt, node, FDT_NAME_COMPATIBLE, &prop))
+        return 0;
+    // only the most specific compatible string is checked
+    return fdt_string_list_index(&prop, "litex,uart0") == 0 ||
+           fdt_string_list_index(&prop, "litex,liteuart") == 0;
 }
 
 void query_uart_litex(uintptr_t fdt)
 {
-    struct fdt_cb cb;
-    struct uart_litex_scan scan;
+    uint64_t reg;
+
+    int node = -1;
 
-    memset(&cb, 0, sizeof(cb));
-    cb.open = uart_litex_open;
-    cb.prop = uart_litex_prop;
-    cb.done = uart_litex_done;
-    cb.extra = &scan;
+    while ((node = fdt_next_node(fdt, node, FDT_NAME_COMPATIBLE, NULL)) >= 0)
+        if (uart_litex_compat(fdt, node) && fdt_get_reg(fdt, node, 0, &reg, NULL) == 0 && reg)
+            break;
+    if (node < 0 || uart_litex)
+        return;
+
+    // Initialize LiteX UART
+    uart_litex = (void *)(uintptr_t)reg;
 
-    fdt_scan(fdt, &cb);
+    struct fdt_scan_prop prop;
+    if (fdt_get_prop(fdt, node, FDT_NAME_INTERRUPTS, &prop) == 0)
+        uart_litex_console.irq = fdt_get_value(&prop, 0);
 }
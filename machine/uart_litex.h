@@ -4,9 +4,12 @@
 #define _RISCV_UARTLR_H
 
 #include <stdint.h>
+#include "console.h"
 
 extern volatile unsigned int *uart_litex;
 
+extern console_uart_t uart_litex_console;
+
 void uart_litex_putchar(uint8_t ch);
 int uart_litex_getchar();
 void query_uart_litex(uintptr_t dtb);
@@ -8,16 +8,31 @@
 
 #define MEGAPAGE_SIZE ((uintptr_t)(RISCV_PGSIZE << RISCV_PGLEVEL_BITS))
 #if __riscv_xlen == 64
-# define SATP_MODE_CHOICE INSERT_FIELD(0, SATP64_MODE, SATP_MODE_SV39)
-# define VA_BITS 39
+# define SATP_MODE_MIN SATP_MODE_SV39
+# define SATP_MODE_MAX SATP_MODE_SV57
+# define VA_BITS 39 // narrowest mode; see satp_mode_va_bits
 # define GIGAPAGE_SIZE (MEGAPAGE_SIZE << RISCV_PGLEVEL_BITS)
 #else
-# define SATP_MODE_CHOICE INSERT_FIELD(0, SATP32_MODE, SATP_MODE_SV32)
+# define SATP_MODE_MIN SATP_MODE_SV32
+# define SATP_MODE_MAX SATP_MODE_SV32
 # define VA_BITS 32
 #endif
 
 typedef uintptr_t pte_t;
 
+// widest satp mode the hardware accepts, probed at boot
+extern uintptr_t satp_mode_max;
+
+// Sv39, Sv48 and Sv57 each add one more level of page table
+static inline int satp_mode_va_bits(uintptr_t mode)
+{
+#if __riscv_xlen == 64
+  return VA_BITS + (mode - SATP_MODE_SV39) * RISCV_PGLEVEL_BITS;
+#else
+  return VA_BITS;
+#endif
+}
+
 static inline void flush_tlb()
 {
   asm volatile ("sfence.vma");
@@ -8,6 +8,7 @@
 #include "pk.h"
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #define MAX_FDS 128
 static file_t* fds[MAX_FDS];
@@ -151,6 +152,18 @@ ssize_t file_pwrite(file_t* f, const void* buf, size_t size, off_t offset)
   return frontend_syscall(SYS_pwrite, f->kfd, kva2pa(buf), size, offset, 0, 0, 0);
 }
 
+ssize_t file_size(file_t* f)
+{
+  struct frontend_stat buf;
+  long ret = frontend_syscall(SYS_fstat, f->kfd, kva2pa(&buf), 0, 0, 0, 0, 0);
+  return ret < 0 ? ret : (ssize_t)buf.size;
+}
+
+int file_flags(file_t* f)
+{
+  return frontend_syscall(SYS_fcntl, f->kfd, F_GETFL, 0, 0, 0, 0, 0);
+}
+
 int file_truncate(file_t* f, off_t len)
 {
   return frontend_syscall(SYS_ftruncate, f->kfd, len, 0, 0, 0, 0, 0);
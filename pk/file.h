@@ -28,6 +28,8 @@ ssize_t file_pread(file_t* f, void* buf, size_t n, off_t off);
 ssize_t file_write(file_t* f, const void* buf, size_t n);
 ssize_t file_read(file_t* f, void* buf, size_t n);
 ssize_t file_lseek(file_t* f, size_t ptr, int dir);
+ssize_t file_size(file_t* f);
+int file_flags(file_t* f); // F_GETFL
 int file_truncate(file_t* f, off_t len);
 int fd_close(int fd);
 
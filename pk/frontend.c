@@ -10,10 +10,9 @@
 
 long frontend_syscall(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, uint64_t a6)
 {
-  static volatile uint64_t magic_mem[8];
-
-  static spinlock_t lock = SPINLOCK_INIT;
-  spinlock_lock(&lock);
+  // each caller's request lives on its own stack, and htif_syscall matches
+  // completions to requests, so concurrent calls need no lock here
+  volatile uint64_t magic_mem[8];
 
   magic_mem[0] = n;
   magic_mem[1] = a0;
@@ -26,10 +25,7 @@ long frontend_syscall(long n, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3
 
   htif_syscall(kva2pa_maybe(magic_mem));
 
-  long ret = magic_mem[0];
-
-  spinlock_unlock(&lock);
-  return ret;
+  return magic_mem[0];
 }
 
 void shutdown(int code)
@@ -6,9 +6,11 @@
 #include "boot.h"
 #include "bits.h"
 #include "mtrap.h"
+#include "mcall.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 
 uintptr_t kva2pa_offset;
 
@@ -20,15 +22,21 @@ typedef struct vmr_t {
   size_t offset;
   unsigned refcnt;
   int prot;
+  int shared;
 } vmr_t;
 
 static vmr_t* vmr_freelist_head;
+static vmr_t* shared_vmrs_head; // live MAP_SHARED file mappings, newest first
 
 static pte_t* root_page_table;
+static uintptr_t satp_mode = SATP_MODE_MIN;
+static int pt_levels;
+int va_bits = VA_BITS;
 
-#define RISCV_PGLEVELS ((VA_BITS - RISCV_PGSHIFT) / RISCV_PGLEVEL_BITS)
+// RSW bit marking a resident page of a MAP_SHARED file mapping
+#define PTE_SHARED 0x100
 
-static spinlock_t vm_lock = SPINLOCK_INIT;
+static mcs_lock_t vm_lock = MCS_LOCK_INIT;
 
 static uintptr_t first_free_page;
 static size_t next_free_page;
@@ -36,7 +44,9 @@ static size_t free_pages;
 static size_t pages_promised;
 
 int demand_paging = 1; // unless -p flag is given
+int overcommit_mode = OVERCOMMIT_NEVER; // set by --overcommit
 uint64_t randomize_mapping; // set by --randomize-mapping
+size_t stack_rlimit = 8 << 20; // set by --stack-size
 
 typedef struct freelist_node_t {
   uintptr_t addr;
@@ -117,21 +127,145 @@ static bool __page_freelist_empty()
   return page_freelist_depth == 0;
 }
 
+// Idle harts keep a pool of pre-zeroed pages topped up for hart 0.
+// Only hart 0, holding vm_lock, moves slots out of ZP_EMPTY and ZP_ZEROED;
+// helpers claim ZP_DIRTY slots with a CAS, so the handoff takes no lock.
+#define ZERO_POOL_SIZE 64
+enum { ZP_EMPTY, ZP_DIRTY, ZP_BUSY, ZP_ZEROED };
+
+static struct {
+  uintptr_t paddr;
+  int state;
+} zero_pool[ZERO_POOL_SIZE];
+
+static size_t zero_pool_pages; // slots not ZP_EMPTY; still counted as free
+static hart_mask_t zero_helper_mask;
+static int zero_helpers;
+static bool zero_pool_started;
+
+size_t pages_allocated, pages_prezeroed;
+
 static size_t __num_free_pages()
 {
-  return page_freelist_depth + (free_pages - next_free_page);
+  return page_freelist_depth + zero_pool_pages + (free_pages - next_free_page);
 }
 
-static uintptr_t __page_alloc()
+// With wait set, also reclaim pages not yet zeroed, waiting out helpers
+// that are busy with one, so that no free page is missed.
+static uintptr_t __zero_pool_take(bool wait)
 {
-  if (__page_freelist_empty() && !__augment_page_freelist())
+  if (!zero_pool_pages)
     return 0;
 
-  freelist_node_t node = __page_freelist_remove();
+  do {
+    for (size_t i = 0; i < ZERO_POOL_SIZE; i++) {
+      int state = atomic_read(&zero_pool[i].state);
+      if (state == ZP_ZEROED ||
+          (wait && state == ZP_DIRTY &&
+           atomic_cas(&zero_pool[i].state, ZP_DIRTY, ZP_EMPTY) == ZP_DIRTY)) {
+        mb();
+        atomic_set(&zero_pool[i].state, ZP_EMPTY);
+        zero_pool_pages--;
+        return zero_pool[i].paddr;
+      }
+    }
+  } while (wait);
+
+  return 0;
+}
+
+static void __zero_pool_refill()
+{
+  // refill in batches, so helpers are only woken once half the pool is used
+  if (!zero_pool_started || !atomic_read(&zero_helpers) ||
+      zero_pool_pages > ZERO_POOL_SIZE / 2)
+    return;
+
+  size_t added = 0;
+  for (size_t i = 0; i < ZERO_POOL_SIZE; i++) {
+    if (zero_pool[i].state != ZP_EMPTY)
+      continue;
+    if (__page_freelist_empty() && !__augment_page_freelist())
+      break;
+
+    zero_pool[i].paddr = __page_freelist_remove().addr;
+    mb();
+    atomic_set(&zero_pool[i].state, ZP_DIRTY);
+    added++;
+  }
+
+  if (!added)
+    return;
+  zero_pool_pages += added;
+
+  for (uintptr_t w = 0; w < HART_MASK_WORDS; w++) {
+    uintptr_t bits = atomic_read(&zero_helper_mask.bits[w]);
+    if (!bits)
+      continue;
+
+    register uintptr_t a0 asm ("a0") = bits;
+    register uintptr_t a1 asm ("a1") = w * HART_MASK_BITS;
+    register uintptr_t a6 asm ("a6") = SBI_EXT_IPI_SEND_IPI;
+    register uintptr_t a7 asm ("a7") = SBI_EXT_IPI;
+    asm volatile ("ecall" : "+r" (a0), "+r" (a1) : "r" (a6), "r" (a7) : "memory");
+  }
+}
+
+static uintptr_t __page_alloc()
+{
+  uintptr_t paddr = __zero_pool_take(false);
 
-  memset((void*)pa2kva(node.addr), 0, RISCV_PGSIZE);
+  if (paddr) {
+    pages_prezeroed++;
+  } else {
+    if (!__page_freelist_empty() || __augment_page_freelist())
+      paddr = __page_freelist_remove().addr;
+    else if (!(paddr = __zero_pool_take(true))) // the last free pages may be pooled
+      return 0;
+
+    memset((void*)pa2kva(paddr), 0, RISCV_PGSIZE);
+  }
+
+  pages_allocated++;
+  __zero_pool_refill();
+
+  return paddr;
+}
+
+const lock_stat_t* vm_lock_stat()
+{
+  return &vm_lock.stat;
+}
+
+void zero_pool_start()
+{
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
+    zero_pool_started = true;
+    __zero_pool_refill();
+  mcs_unlock(&vm_lock, &node);
+}
+
+void zero_pool_add_helper(uintptr_t hartid)
+{
+  if (hartid < MAX_HARTS) {
+    atomic_or(&zero_helper_mask.bits[hartid / HART_MASK_BITS],
+              (uintptr_t)1 << (hartid % HART_MASK_BITS));
+    atomic_set(&zero_helpers, 1);
+  }
+}
 
-  return node.addr;
+// Runs in M-mode on a helper hart, so pages are zeroed by physical address
+void zero_pool_fill()
+{
+  for (size_t i = 0; i < ZERO_POOL_SIZE; i++) {
+    if (atomic_read(&zero_pool[i].state) == ZP_DIRTY &&
+        atomic_cas(&zero_pool[i].state, ZP_DIRTY, ZP_BUSY) == ZP_DIRTY) {
+      memset((void*)zero_pool[i].paddr, 0, RISCV_PGSIZE);
+      mb();
+      atomic_set(&zero_pool[i].state, ZP_ZEROED);
+    }
+  }
 }
 
 static uintptr_t __page_alloc_assert()
@@ -144,6 +278,26 @@ static uintptr_t __page_alloc_assert()
   return res;
 }
 
+static void __oom(uintptr_t vaddr)
+{
+  panic("Out of memory servicing page fault @ %p: %ld pages reserved but untouched (overcommit mode %d)",
+        vaddr, (long)pages_promised, overcommit_mode);
+}
+
+// Can npage more pages be promised to new mappings?
+static bool __can_promise(size_t npage)
+{
+  switch (overcommit_mode) {
+    case OVERCOMMIT_ALWAYS:
+      return true;
+    case OVERCOMMIT_GUESS:
+      // like Linux, only refuse requests that could never be satisfied
+      return npage < free_pages;
+    default:
+      return npage * 17 / 16 + 16 + pages_promised < __num_free_pages();
+  }
+}
+
 static void __page_free(uintptr_t addr)
 {
   freelist_node_t node = { .addr = addr };
@@ -151,7 +305,7 @@ static void __page_free(uintptr_t addr)
 }
 
 static vmr_t* __vmr_alloc(uintptr_t addr, size_t length, file_t* file,
-                          size_t offset, unsigned refcnt, int prot)
+                          size_t offset, unsigned refcnt, int prot, int shared)
 {
   if (vmr_freelist_head == NULL) {
     vmr_t* new_vmrs = (vmr_t*)pa2kva(__page_alloc());
@@ -178,14 +332,25 @@ static vmr_t* __vmr_alloc(uintptr_t addr, size_t length, file_t* file,
   v->offset = offset;
   v->refcnt = refcnt;
   v->prot = prot;
+  v->shared = shared;
+
+  if (shared) {
+    v->next = shared_vmrs_head;
+    shared_vmrs_head = v;
+  }
   return v;
 }
 
 static void __vmr_decref(vmr_t* v, unsigned dec)
 {
-  pages_promised -= dec;
-
   if ((v->refcnt -= dec) == 0) {
+    if (v->shared) {
+      vmr_t** p = &shared_vmrs_head;
+      while (*p != v)
+        p = &(*p)->next;
+      *p = v->next;
+    }
+
     if (v->file)
       file_decref(v->file);
 
@@ -204,39 +369,67 @@ static uintptr_t ppn(uintptr_t addr)
   return addr >> RISCV_PGSHIFT;
 }
 
+// bytes mapped by one PTE at the given level
+static size_t pt_span(int level)
+{
+  return (size_t)RISCV_PGSIZE << (RISCV_PGLEVEL_BITS * level);
+}
+
 static size_t pt_idx(uintptr_t addr, int level)
 {
   size_t idx = addr >> (RISCV_PGLEVEL_BITS*level + RISCV_PGSHIFT);
   return idx & ((1 << RISCV_PGLEVEL_BITS) - 1);
 }
 
-static inline pte_t* __walk_internal(pte_t* t, uintptr_t addr, int create, int level)
+// Invalid, nonzero PTEs hold the vmr_t* of a reserved but untouched page.
+// Large aligned reservations are recorded once at a higher level and are
+// pushed down a level at a time as pieces of them are faulted in or unmapped.
+static inline pte_t* __walk_internal(pte_t* t, uintptr_t addr, int create, int level, size_t* span)
 {
-  for (int i = RISCV_PGLEVELS - 1; i > level; i--) {
+  for (int i = pt_levels - 1; i > level; i--) {
     size_t idx = pt_idx(addr, i);
     if (unlikely(!(t[idx] & PTE_V))) {
       if (create) {
         uintptr_t new_ptd = __page_alloc();
         if (!new_ptd)
           return 0;
+        pte_t* new_t = (pte_t*)pa2kva(new_ptd);
+        if (t[idx])
+          for (size_t j = 0; j < (1 << RISCV_PGLEVEL_BITS); j++)
+            new_t[j] = t[idx];
         t[idx] = ptd_create(ppn(new_ptd));
       } else {
-        return 0;
+        if (span)
+          *span = pt_span(i);
+        return t[idx] ? &t[idx] : 0;
       }
     }
     t = (pte_t*)pa2kva(pte_ppn(t[idx]) << RISCV_PGSHIFT);
   }
+  if (span)
+    *span = pt_span(level);
   return &t[pt_idx(addr, level)];
 }
 
 static pte_t* __walk(uintptr_t addr)
 {
-  return __walk_internal(root_page_table, addr, 0, 0);
+  return __walk_internal(root_page_table, addr, 0, 0, NULL);
+}
+
+// Like __walk, but may stop early at a reservation covering *span bytes
+static pte_t* __walk_span(uintptr_t addr, size_t* span)
+{
+  return __walk_internal(root_page_table, addr, 0, 0, span);
 }
 
 static pte_t* __walk_create(uintptr_t addr)
 {
-  return __walk_internal(root_page_table, addr, 1, 0);
+  return __walk_internal(root_page_table, addr, 1, 0, NULL);
+}
+
+static uintptr_t __span_end(uintptr_t addr, size_t span)
+{
+  return ROUNDDOWN(addr, span) + span;
 }
 
 static int __va_avail(uintptr_t vaddr)
@@ -262,7 +455,11 @@ static uintptr_t __vm_alloc_at(uintptr_t start, uintptr_t end, size_t npage)
 
 static uintptr_t __vm_alloc(size_t npage)
 {
-  uintptr_t end = current.mmap_max - npage * RISCV_PGSIZE;
+  // keep clear of the stack region and its guard gap
+  uintptr_t limit = current.stack_min ? current.stack_min - STACK_GUARD_GAP : current.mmap_max;
+  if (npage * RISCV_PGSIZE > limit)
+    return 0;
+  uintptr_t end = limit - npage * RISCV_PGSIZE;
   if (current.vm_alloc_guess) {
     uintptr_t ret = __vm_alloc_at(current.vm_alloc_guess, end, npage);
     if (ret)
@@ -296,18 +493,49 @@ static void flush_tlb_entry(uintptr_t vaddr)
   asm volatile ("sfence.vma %0" : : "r" (vaddr) : "memory");
 }
 
+static bool __grow_stack(uintptr_t vaddr)
+{
+  if (vaddr < current.stack_min || vaddr >= current.stack_top)
+    return false;
+
+  // stack pages are only charged once they are touched
+  if (!__can_promise(1))
+    return false;
+
+  pte_t* pte = __walk_create(vaddr);
+  uintptr_t paddr = pte ? __page_alloc() : 0;
+  if (!paddr)
+    __oom(vaddr);
+
+  uintptr_t ppn = paddr / RISCV_PGSIZE;
+  *pte = pte_create(ppn, prot_to_type(PROT_READ|PROT_WRITE|PROT_EXEC, 1));
+  flush_tlb_entry(vaddr);
+  return true;
+}
+
 static int __handle_page_fault(uintptr_t vaddr, int prot)
 {
   uintptr_t vpn = vaddr >> RISCV_PGSHIFT;
   vaddr = vpn << RISCV_PGSHIFT;
 
-  pte_t* pte = __walk(vaddr);
+  size_t span;
+  pte_t* pte = __walk_span(vaddr, &span);
+
+  if ((pte == 0 || *pte == 0) && __grow_stack(vaddr))
+    pte = __walk(vaddr);
 
   if (pte == 0 || *pte == 0 || !__valid_user_range(vaddr, 1))
     return -1;
   else if (!(*pte & PTE_V))
   {
-    uintptr_t ppn = __page_alloc_assert() / RISCV_PGSIZE;
+    if (span > RISCV_PGSIZE && (pte = __walk_create(vaddr)) == 0)
+      __oom(vaddr);
+
+    uintptr_t paddr = __page_alloc();
+    if (!paddr)
+      __oom(vaddr);
+
+    uintptr_t ppn = paddr / RISCV_PGSIZE;
     uintptr_t kva = pa2kva(ppn * RISCV_PGSIZE);
 
     vmr_t* v = (vmr_t*)*pte;
@@ -319,10 +547,21 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
       ssize_t ret = file_pread(v->file, (void*)kva, flen, vaddr - v->addr + v->offset);
       kassert(ret > 0);
       if (ret < RISCV_PGSIZE)
-        memset((void*)vaddr + ret, 0, RISCV_PGSIZE - ret);
+        memset((void*)kva + ret, 0, RISCV_PGSIZE - ret);
+    }
+    pages_promised--;
+    if (v->shared) {
+      // start out clean; the first store sets PTE_D below
+      *pte = (pte_create(ppn, prot_to_type(v->prot, 1)) & ~PTE_D) | PTE_SHARED;
+    } else {
+      __vmr_decref(v, 1);
+      *pte = pte_create(ppn, prot_to_type(v->prot, 1));
     }
-    __vmr_decref(v, 1);
-    *pte = pte_create(ppn, prot_to_type(v->prot, 1));
+    flush_tlb_entry(vaddr);
+  }
+
+  if ((prot & PROT_WRITE) && (*pte & PTE_W) && !(*pte & PTE_D)) {
+    *pte |= PTE_D;
     flush_tlb_entry(vaddr);
   }
 
@@ -336,63 +575,233 @@ static int __handle_page_fault(uintptr_t vaddr, int prot)
 
 int handle_page_fault(uintptr_t vaddr, int prot)
 {
-  spinlock_lock(&vm_lock);
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
     int ret = __handle_page_fault(vaddr, prot);
-  spinlock_unlock(&vm_lock);
+  mcs_unlock(&vm_lock, &node);
+  return ret;
+}
+
+int prefault_user_range(uintptr_t vaddr, size_t len, int prot)
+{
+  if (len == 0)
+    return 0;
+  if (!__valid_user_range(vaddr, len))
+    return -EFAULT;
+
+  int ret = 0;
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
+    for (uintptr_t a = ROUNDDOWN(vaddr, RISCV_PGSIZE); a < vaddr + len; a += RISCV_PGSIZE) {
+      if (__handle_page_fault(a, prot) != 0) {
+        ret = -EFAULT;
+        break;
+      }
+    }
+  mcs_unlock(&vm_lock, &node);
+
   return ret;
 }
 
+static vmr_t* __shared_vmr_lookup(uintptr_t vaddr)
+{
+  // newer mappings shadow older ones, so the first hit owns the page
+  for (vmr_t* v = shared_vmrs_head; v; v = v->next)
+    if (vaddr >= v->addr && vaddr - v->addr < v->length)
+      return v;
+  return NULL;
+}
+
+typedef struct {
+  file_t* file;
+  uintptr_t paddr;
+  size_t len;
+  off_t offset;
+  bool free;   // the pages are unmapped, to be freed once written back
+  int error;   // the first failed write
+} writeback_t;
+
+static void __writeback_flush(writeback_t* wb)
+{
+  if (wb->len) {
+    // the mapping may run past the end of the file, which must not grow
+    ssize_t size = file_size(wb->file), ret = 0;
+    size_t len = wb->len;
+    if (size < 0)
+      ret = size;
+    else if (wb->offset < size) {
+      len = MIN(len, size - wb->offset);
+      ret = file_pwrite(wb->file, (void*)pa2kva(wb->paddr), len, wb->offset);
+    }
+    if (!wb->error && ret >= 0 && ret != len)
+      wb->error = -EIO;
+    else if (!wb->error && ret < 0)
+      wb->error = ret;
+    file_decref(wb->file);
+
+    if (wb->free)
+      for (uintptr_t a = 0; a < wb->len; a += RISCV_PGSIZE)
+        __page_free(wb->paddr + a);
+  }
+  wb->len = 0;
+}
+
+// Queue the page at vaddr for writeback if it is dirty, coalescing
+// physically and file-contiguous pages into a single file_pwrite.
+// Returns whether the page was queued.
+static bool __writeback_page(writeback_t* wb, vmr_t* v, uintptr_t vaddr, pte_t* pte)
+{
+  if (!(*pte & PTE_D))
+    return false;
+
+  uintptr_t paddr = pte_ppn(*pte) << RISCV_PGSHIFT;
+  off_t offset = vaddr - v->addr + v->offset;
+  size_t len = MIN(RISCV_PGSIZE, v->length - (vaddr - v->addr));
+
+  if (wb->len && (wb->file != v->file || wb->paddr + wb->len != paddr ||
+                  wb->offset + wb->len != offset || wb->len % RISCV_PGSIZE))
+    __writeback_flush(wb);
+
+  if (wb->len == 0) {
+    file_incref(v->file);
+    wb->file = v->file;
+    wb->paddr = paddr;
+    wb->offset = offset;
+  }
+  wb->len += len;
+
+  *pte &= ~PTE_D;
+  flush_tlb_entry(vaddr);
+  return true;
+}
+
 static void __do_munmap(uintptr_t addr, size_t len)
 {
-  for (uintptr_t a = addr; a < addr + len; a += RISCV_PGSIZE)
+  writeback_t wb = { .len = 0, .free = true };
+
+  for (uintptr_t a = addr, next; a < addr + len; a = next)
   {
-    pte_t* pte = __walk(a);
+    size_t span;
+    pte_t* pte = __walk_span(a, &span);
+    next = __span_end(a, span);
     if (pte == 0 || *pte == 0)
       continue;
 
-    if (*pte & PTE_V)
-      __page_free(pte_ppn(*pte) << RISCV_PGSHIFT);
-    else
+    if (span > RISCV_PGSIZE) {
+      if (a % span || next > addr + len) {
+        // unmapping part of a large reservation: split it and retry
+        if (!__walk_create(a))
+          panic("Out of memory!");
+        next = a;
+        continue;
+      }
+
+      pages_promised -= span / RISCV_PGSIZE;
+      __vmr_decref((vmr_t*)*pte, span / RISCV_PGSIZE);
+    } else if (*pte & PTE_V) {
+      bool queued = false;
+      if (*pte & PTE_SHARED) {
+        vmr_t* v = __shared_vmr_lookup(a);
+        kassert(v);
+        queued = __writeback_page(&wb, v, a, pte);
+        __vmr_decref(v, 1);
+      }
+      // a page queued for writeback is freed once it has been written
+      if (!queued)
+        __page_free(pte_ppn(*pte) << RISCV_PGSHIFT);
+    } else {
+      pages_promised--;
       __vmr_decref((vmr_t*)*pte, 1);
+    }
 
     *pte = 0;
     flush_tlb_entry(a);
   }
+
+  __writeback_flush(&wb);
+}
+
+static int __do_msync(uintptr_t addr, size_t len, file_t* f)
+{
+  writeback_t wb = { .len = 0 };
+
+  for (uintptr_t a = addr, next; a < addr + len; a = next)
+  {
+    size_t span;
+    pte_t* pte = __walk_span(a, &span);
+    next = __span_end(a, span);
+    if (pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_SHARED))
+      continue;
+
+    vmr_t* v = __shared_vmr_lookup(a);
+    kassert(v);
+    if (f == NULL || v->file == f)
+      __writeback_page(&wb, v, a, pte);
+  }
+
+  __writeback_flush(&wb);
+  return wb.error;
+}
+
+// Point the PTEs covering [addr, addr + npage pages) at v, using the
+// largest aligned entries that fit.
+static void __map_reservation(uintptr_t addr, size_t npage, vmr_t* v)
+{
+  uintptr_t end = addr + npage * RISCV_PGSIZE;
+
+  for (uintptr_t a = addr; a < end; ) {
+    for (int level = pt_levels - 1; level >= 0; level--) {
+      size_t span = pt_span(level);
+      if (a % span || a + span > end)
+        continue;
+
+      pte_t* pte = __walk_internal(root_page_table, a, 1, level, NULL);
+      kassert(pte);
+
+      if (level > 0 && (*pte & PTE_V))
+        continue; // something is mapped underneath; go finer-grained
+
+      if (*pte)
+        __do_munmap(a, span);
+
+      *pte = (pte_t)v;
+      a += span;
+      break;
+    }
+  }
 }
 
 uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t* f, off_t offset)
 {
   size_t npage = (length-1)/RISCV_PGSIZE+1;
 
-  if (npage * 17 / 16 + 16 + pages_promised >= __num_free_pages())
-    return (uintptr_t)-1;
-
   if (flags & MAP_FIXED)
   {
     if ((addr & (RISCV_PGSIZE-1)) || !__valid_user_range(addr, length))
       return (uintptr_t)-1;
+
+    // Drop what is mapped there first, as Linux does.  Its pages then
+    // count as free below, and a shared page being replaced is still
+    // found in the mapping it belongs to rather than in the new one.
+    __do_munmap(addr, npage * RISCV_PGSIZE);
   }
-  else if ((addr = __vm_alloc(npage)) == 0)
-    return (uintptr_t)-1;
 
-  vmr_t* v = __vmr_alloc(addr, length, f, offset, npage, prot);
-  if (!v)
+  if (!__can_promise(npage))
     return (uintptr_t)-1;
 
-  for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
-  {
-    pte_t* pte = __walk_create(a);
-    kassert(pte);
+  if (!(flags & MAP_FIXED) && (addr = __vm_alloc(npage)) == 0)
+    return (uintptr_t)-1;
 
-    if (*pte)
-      __do_munmap(a, RISCV_PGSIZE);
+  int shared = f && (flags & MAP_SHARED);
+  vmr_t* v = __vmr_alloc(addr, length, f, offset, npage, prot, shared);
+  if (!v)
+    return (uintptr_t)-1;
 
-    *pte = (pte_t)v;
-  }
+  __map_reservation(addr, npage, v);
 
   if (!demand_paging || (flags & MAP_POPULATE))
     for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
-      kassert(__handle_page_fault(a, prot) == 0);
+      kassert(__handle_page_fault(a, shared ? prot & ~PROT_WRITE : prot) == 0);
 
   current.vm_alloc_guess = addr + npage * RISCV_PGSIZE;
 
@@ -404,28 +813,69 @@ int do_munmap(uintptr_t addr, size_t length)
   if ((addr & (RISCV_PGSIZE-1)) || !__valid_user_range(addr, length))
     return -EINVAL;
 
-  spinlock_lock(&vm_lock);
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
     __do_munmap(addr, length);
-  spinlock_unlock(&vm_lock);
+  mcs_unlock(&vm_lock, &node);
 
   return 0;
 }
 
+int do_msync(uintptr_t addr, size_t length, int flags)
+{
+  if ((addr & (RISCV_PGSIZE-1)) || !__valid_user_range(addr, length) ||
+      (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+      (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC))
+    return -EINVAL;
+
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
+    int ret = __do_msync(addr, length, NULL);
+  mcs_unlock(&vm_lock, &node);
+
+  return ret;
+}
+
+int sync_shared_mappings(file_t* f)
+{
+  int ret = 0;
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
+    for (vmr_t* v = shared_vmrs_head; v; v = v->next)
+      if (f == NULL || v->file == f) {
+        int err = __do_msync(v->addr, v->length, v->file);
+        if (!ret)
+          ret = err;
+      }
+  mcs_unlock(&vm_lock, &node);
+  return ret;
+}
+
 uintptr_t do_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-  if (!(flags & MAP_PRIVATE) || length == 0 || (offset & (RISCV_PGSIZE-1)))
+  int type = flags & (MAP_SHARED | MAP_PRIVATE);
+  if ((type != MAP_SHARED && type != MAP_PRIVATE) || length == 0 || (offset & (RISCV_PGSIZE-1)))
     return -EINVAL;
 
   file_t* f = NULL;
   if (!(flags & MAP_ANONYMOUS) && (f = file_get(fd)) == NULL)
     return -EBADF;
 
-  spinlock_lock(&vm_lock);
+  // shared writes go back to the file, so it must be open for writing
+  int fl;
+  if (f && type == MAP_SHARED && (prot & PROT_WRITE)
+      && (fl = file_flags(f)) >= 0 && (fl & O_ACCMODE) == O_RDONLY) {
+    file_decref(f);
+    return -EACCES;
+  }
+
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
     addr = __do_mmap(addr, length, prot, flags, f, offset);
 
     if (addr < current.brk_max)
       current.brk_max = addr;
-  spinlock_unlock(&vm_lock);
+  mcs_unlock(&vm_lock, &node);
 
   if (f) file_decref(f);
   return addr;
@@ -451,9 +901,10 @@ uintptr_t __do_brk(size_t addr)
 
 uintptr_t do_brk(size_t addr)
 {
-  spinlock_lock(&vm_lock);
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
     addr = __do_brk(addr);
-  spinlock_unlock(&vm_lock);
+  mcs_unlock(&vm_lock, &node);
   
   return addr;
 }
@@ -469,10 +920,13 @@ uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot)
   if ((addr) & (RISCV_PGSIZE-1))
     return -EINVAL;
 
-  spinlock_lock(&vm_lock);
-    for (uintptr_t a = addr; a < addr + length; a += RISCV_PGSIZE)
+  mcs_node_t node;
+  mcs_lock(&vm_lock, &node);
+    for (uintptr_t a = addr, next; a < addr + length; a = next)
     {
-      pte_t* pte = __walk(a);
+      size_t span;
+      pte_t* pte = __walk_span(a, &span);
+      next = __span_end(a, span);
       if (pte == 0 || *pte == 0) {
         res = -ENOMEM;
         break;
@@ -495,37 +949,43 @@ uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot)
           res = -EACCES;
           break;
         }
-        *pte = pte_create(pte_ppn(*pte), prot_to_type(prot, 1));
+        pte_t new_pte = pte_create(pte_ppn(*pte), prot_to_type(prot, 1));
+        if (*pte & PTE_SHARED)
+          new_pte = (new_pte & ~PTE_D) | (*pte & (PTE_D | PTE_SHARED));
+        *pte = new_pte;
       }
 
       flush_tlb_entry(a);
     }
-  spinlock_unlock(&vm_lock);
+  mcs_unlock(&vm_lock, &node);
 
   return res;
 }
 
 static inline void __map_kernel_page(uintptr_t vaddr, uintptr_t paddr, int level, int prot)
 {
-  pte_t* pte = __walk_internal(root_page_table, vaddr, 1, level);
+  pte_t* pte = __walk_internal(root_page_table, vaddr, 1, level, NULL);
   kassert(pte);
   *pte = pte_create(paddr >> RISCV_PGSHIFT, prot_to_type(prot, 0));
 }
 
 static void __map_kernel_range(uintptr_t vaddr, uintptr_t paddr, size_t len, int prot)
 {
-  size_t megapage_size = RISCV_PGSIZE << RISCV_PGLEVEL_BITS;
-  bool megapage_coaligned = (vaddr ^ paddr) % megapage_size == 0;
-
-  // could support misaligned mappings, but no need today
-  kassert((vaddr | paddr | len) % megapage_size == 0);
+  kassert((vaddr | paddr | len) % RISCV_PGSIZE == 0);
 
   while (len > 0) {
-    __map_kernel_page(vaddr, paddr, 1, prot);
-
-    len -= megapage_size;
-    vaddr += megapage_size;
-    paddr += megapage_size;
+    // use the largest leaf that fits and both addresses are aligned to,
+    // so only the edges of the range need smaller pages
+    int level = 0;
+    while (level + 1 < pt_levels && len >= pt_span(level + 1) &&
+           (vaddr | paddr) % pt_span(level + 1) == 0)
+      level++;
+
+    __map_kernel_page(vaddr, paddr, level, prot);
+
+    len -= pt_span(level);
+    vaddr += pt_span(level);
+    paddr += pt_span(level);
   }
 }
 
@@ -543,6 +1003,12 @@ void populate_mapping(const void* start, size_t size, int prot)
 
 static void init_early_alloc()
 {
+  // use the widest translation mode the hardware offers
+  if (satp_mode_max > satp_mode)
+    satp_mode = satp_mode_max;
+  va_bits = satp_mode_va_bits(satp_mode);
+  pt_levels = (va_bits - RISCV_PGSHIFT) / RISCV_PGLEVEL_BITS;
+
   // PA space must fit within half of VA space
   uintptr_t user_size = -KVA_START;
   mem_size = MIN(mem_size, user_size);
@@ -566,7 +1032,7 @@ uintptr_t pk_vm_init()
   __map_kernel_range(KVA_START, MEM_START, mem_size, PROT_READ|PROT_WRITE|PROT_EXEC);
 
   flush_tlb();
-  write_csr(satp, ((uintptr_t)root_page_table >> RISCV_PGSHIFT) | SATP_MODE_CHOICE);
+  write_csr(satp, ((uintptr_t)root_page_table >> RISCV_PGSHIFT) | INSERT_FIELD(0, SATP_MODE, satp_mode));
 
   uintptr_t kernel_stack_top = __page_alloc_assert() + RISCV_PGSIZE;
 
@@ -8,6 +8,7 @@
 #include "encoding.h"
 #include "file.h"
 #include "mtrap.h"
+#include "atomic.h"
 #include <stddef.h>
 
 #define PROT_NONE 0
@@ -15,27 +16,49 @@
 #define PROT_WRITE 2
 #define PROT_EXEC 4
 
+#define MAP_SHARED 0x1
 #define MAP_PRIVATE 0x2
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
 #define MAP_POPULATE 0x8000
 #define MREMAP_FIXED 0x2
 
+#define MS_ASYNC 1
+#define MS_INVALIDATE 2
+#define MS_SYNC 4
+
+#define STACK_GUARD_GAP (256 * RISCV_PGSIZE)
+
+#define OVERCOMMIT_GUESS 0
+#define OVERCOMMIT_ALWAYS 1
+#define OVERCOMMIT_NEVER 2
+
 extern int demand_paging;
+extern int overcommit_mode;
 extern uint64_t randomize_mapping;
+extern size_t stack_rlimit;
+extern size_t pages_allocated, pages_prezeroed;
 
 uintptr_t pk_vm_init();
 int handle_page_fault(uintptr_t vaddr, int prot);
+int prefault_user_range(uintptr_t vaddr, size_t len, int prot);
+const lock_stat_t* vm_lock_stat();
+void zero_pool_start();
+void zero_pool_add_helper(uintptr_t hartid);
+void zero_pool_fill();
 void populate_mapping(const void* start, size_t size, int prot);
 int __valid_user_range(uintptr_t vaddr, size_t len);
 uintptr_t __do_mmap(uintptr_t addr, size_t length, int prot, int flags, file_t* file, off_t offset);
 uintptr_t do_mmap(uintptr_t addr, size_t length, int prot, int flags, int fd, off_t offset);
 int do_munmap(uintptr_t addr, size_t length);
+int do_msync(uintptr_t addr, size_t length, int flags);
+int sync_shared_mappings(file_t* f);
 uintptr_t do_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags);
 uintptr_t do_mprotect(uintptr_t addr, size_t length, int prot);
 uintptr_t do_brk(uintptr_t addr);
 
-#define KVA_START ((uintptr_t)-1 << (VA_BITS-1))
+extern int va_bits;
+#define KVA_START ((uintptr_t)-1 << (va_bits-1))
 
 extern uintptr_t kva2pa_offset;
 #define kva2pa(va) ((uintptr_t)(va) - kva2pa_offset)
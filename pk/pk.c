@@ -5,16 +5,21 @@
 #include "boot.h"
 #include "elf.h"
 #include "mtrap.h"
+#include "hsm.h"
+#include "mcall.h"
+#include "atomic.h"
 #include "frontend.h"
 #include "bits.h"
 #include "usermem.h"
 #include "flush_icache.h"
+#include "boot_trace.h"
 #include <stdbool.h>
 
 elf_info current;
-long disabled_hart_mask;
+hart_mask_t disabled_hart_mask;
 static bool zicfilp_enabled;
 static bool zicfiss_enabled;
+static bool boot_trace_enabled;
 
 static void help()
 {
@@ -24,6 +29,11 @@ static void help()
   printk("  -h, --help            Print this help message\n");
   printk("  -p                    Disable on-demand program paging\n");
   printk("  -s                    Print cycles upon termination\n");
+  printk("  --boot-trace          Print the cycles spent in each boot phase\n");
+  printk("  --overcommit=<mode>   Accounting for mmap reservations: never (default),\n");
+  printk("                        guess or always; overcommitted faults report OOM\n");
+  printk("  --stack-size=<size>   Limit stack growth to <size> bytes (K/M/G suffixes\n");
+  printk("                        allowed; default 8M)\n");
   printk("  --zicfilp             Enable Zicfilp CFI mechanism for user program\n");
   printk("  --zicfiss             Enable Zicfiss CFI mechanism for user program\n");
 
@@ -36,6 +46,25 @@ static void suggest_help()
   shutdown(1);
 }
 
+static size_t parse_size(const char* str)
+{
+  size_t res = 0;
+  for ( ; *str >= '0' && *str <= '9'; str++)
+    res = res * 10 + (*str - '0');
+
+  switch (*str) {
+    case 'G': case 'g': res <<= 10;
+      // fall through
+    case 'M': case 'm': res <<= 10;
+      // fall through
+    case 'K': case 'k': res <<= 10; str++;
+  }
+
+  if (*str != '\0')
+    panic("invalid size: `%s'", str);
+  return res;
+}
+
 static void handle_option(const char* arg)
 {
   if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
@@ -48,11 +77,36 @@ static void handle_option(const char* arg)
     return;
   }
 
+  if (strcmp(arg, "--boot-trace") == 0) {
+    boot_trace_enabled = true;
+    return;
+  }
+
   if (strcmp(arg, "-p") == 0) { // disable demand paging
     demand_paging = 0;
     return;
   }
 
+  if (strcmp(arg, "--overcommit=never") == 0) {
+    overcommit_mode = OVERCOMMIT_NEVER;
+    return;
+  }
+
+  if (strcmp(arg, "--overcommit=guess") == 0) {
+    overcommit_mode = OVERCOMMIT_GUESS;
+    return;
+  }
+
+  if (strcmp(arg, "--overcommit=always") == 0) {
+    overcommit_mode = OVERCOMMIT_ALWAYS;
+    return;
+  }
+
+  if (strncmp(arg, "--stack-size=", 13) == 0) {
+    stack_rlimit = parse_size(arg + 13);
+    return;
+  }
+
   if (strcmp(arg, "--randomize-mapping") == 0) {
     randomize_mapping = 1;
     return;
@@ -106,15 +160,16 @@ static void init_tf(trapframe_t* tf, long pc, long sp)
 
 static void run_loaded_program(size_t argc, char** argv, uintptr_t kstack_top)
 {
-  size_t mem_pages = mem_size >> RISCV_PGSHIFT;
-  size_t stack_size = MIN(mem_pages >> 5, 2048) * RISCV_PGSIZE;
-  size_t stack_bottom = __do_mmap(current.mmap_max - stack_size, stack_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
-  kassert(stack_bottom != (uintptr_t)-1);
-  current.stack_top = stack_bottom + stack_size;
+  // the stack is not mapped up front; page faults between stack_min and
+  // stack_top grow it on demand, and nothing else is mapped in the guard gap
+  size_t stack_size = CLAMP(ROUNDUP(stack_rlimit, RISCV_PGSIZE), RISCV_PGSIZE, current.mmap_max / 4);
+  current.stack_top = current.mmap_max;
+  current.stack_min = current.stack_top - stack_size;
+  current.brk_max = MIN(current.brk_max, current.stack_min - STACK_GUARD_GAP);
 
   if (zicfiss_enabled) {
     size_t shadow_stack_size = MAX(RISCV_PGSIZE, stack_size >> 5);
-    size_t shadow_stack_bottom = __do_mmap(stack_bottom - shadow_stack_size, shadow_stack_size, PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
+    size_t shadow_stack_bottom = __do_mmap(current.stack_min - STACK_GUARD_GAP - shadow_stack_size, shadow_stack_size, PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, 0, 0);
     kassert(shadow_stack_bottom != (uintptr_t)-1);
     size_t shadow_stack_top = shadow_stack_bottom + shadow_stack_size;
 
@@ -192,6 +247,9 @@ static void run_loaded_program(size_t argc, char** argv, uintptr_t kstack_top)
   } while (0)
 
   STACK_INIT(uintptr_t);
+  boot_trace("stack setup");
+  if (boot_trace_enabled)
+    boot_trace_print(printk);
 
   if (current.cycle0) { // start timer if so requested
     current.time0 = rdtime64();
@@ -220,18 +278,22 @@ rest_of_boot_loader:\n\
 
 void rest_of_boot_loader_2(uintptr_t kstack_top)
 {
+  zero_pool_start();
   file_init();
+  boot_trace("file init");
 
   static arg_buf args; // avoid large stack allocation
   size_t argc = parse_args(&args);
   if (!argc)
     panic("tell me what ELF to load!");
+  boot_trace("parse args");
 
   // load program named by argv[0]
   static long phdrs[128]; // avoid large stack allocation
   current.phdr = (uintptr_t)phdrs;
   current.phdr_size = sizeof(phdrs);
   load_elf(args.argv[0], &current);
+  boot_trace("load elf");
 
   run_loaded_program(argc, args.argv, kstack_top);
 }
@@ -239,6 +301,7 @@ void rest_of_boot_loader_2(uintptr_t kstack_top)
 void boot_loader(uintptr_t dtb)
 {
   uintptr_t kernel_stack_top = pk_vm_init();
+  boot_trace("vm init");
 
   extern char trap_entry;
   write_csr(stvec, pa2kva(&trap_entry));
@@ -251,7 +314,15 @@ void boot_loader(uintptr_t dtb)
 
 void boot_other_hart(uintptr_t dtb)
 {
-  // stall all harts besides hart 0
-  while (1)
+  // harts besides hart 0 zero pages for it in the background.  They
+  // sleep in M-mode, so the zero pool's IPIs must come through MSWI,
+  // which send_ipi uses for harts that are not STARTED.
+  kassert(HLS()->hsm_state == SBI_HSM_STATE_STOPPED);
+  zero_pool_add_helper(read_csr(mhartid));
+
+  while (1) {
+    zero_pool_fill();
     wfi();
+    hsm_poll_ipis();
+  }
 }
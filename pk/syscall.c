@@ -5,6 +5,9 @@
 #include "file.h"
 #include "bits.h"
 #include "frontend.h"
+#include "htif.h"
+#include "mtrap.h"
+#include "emulation_stat.h"
 #include "mmap.h"
 #include "boot.h"
 #include "usermem.h"
@@ -23,6 +26,63 @@ struct iovec {
 
 #define MAX_BUF 512
 
+static void print_lock_stat(const char* name, const lock_stat_t* stat)
+{
+  printk("%s: %ld acquisitions, %ld contended, %ld spins\n", name,
+      (long)stat->acquired, (long)stat->contended, (long)stat->spins);
+}
+
+// Where M-mode emulated for us, and the PCs that cost it the most
+static void print_emulation_stat()
+{
+  static const char* names[EMULATION_CATEGORIES] = {
+    "misaligned load", "misaligned store", "misaligned vector",
+    "floating point", "mul/div", "csr", "not emulated"
+  };
+
+  for (uintptr_t hart = 0; hart < MAX_HARTS; hart++) {
+    emulation_stat_t s = *emulation_stat(hart);
+    if (!s.hot[0].total.count)
+      continue;
+
+    printk("hart %ld emulation:\n", (long)hart);
+    for (int i = 0; i < EMULATION_CATEGORIES; i++)
+      if (s.category[i].count)
+        printk("  %s: %ld in %ld cycles\n", names[i],
+            (long)s.category[i].count, (long)s.category[i].cycles);
+    if (s.run_ahead)
+      printk("  run ahead: %ld\n", (long)s.run_ahead);
+
+    // costliest first
+    for (int i = 0; i < EMULATION_HOT_PCS && s.hot[i].total.count; i++) {
+      int max = i;
+      for (int j = i + 1; j < EMULATION_HOT_PCS; j++)
+        if (s.hot[j].total.cycles > s.hot[max].total.cycles)
+          max = j;
+      typeof(s.hot[0]) t = s.hot[i];
+      s.hot[i] = s.hot[max];
+      s.hot[max] = t;
+      if (s.hot[i].total.count)
+        printk("  pc %lx: %ld in %ld cycles\n", (long)s.hot[i].mepc,
+            (long)s.hot[i].total.count, (long)s.hot[i].total.cycles);
+    }
+  }
+}
+
+static void print_ipi_stat()
+{
+  for (uintptr_t hart = 0; hart < MAX_HARTS; hart++) {
+    ipi_stat_t s = *ipi_stat(hart);
+    if (!s.sent && !s.waits)
+      continue;
+
+    printk("hart %ld: %ld IPIs, %ld waits for fences, %ld cycles mean wait, %ld max\n",
+        (long)hart, (long)s.sent, (long)s.waits,
+        (long)(s.waits ? s.wait_cycles / s.waits : 0),
+        (long)s.max_wait_cycles);
+  }
+}
+
 void sys_exit(int code)
 {
   if (current.cycle0) {
@@ -35,7 +95,14 @@ void sys_exit(int code)
     printk("%lld instructions\n", di);
     printk("%d.%d%d CPI\n", (int)(dc/di), (int)(10ULL*dc/di % 10),
         (int)((100ULL*dc)/di % 10));
+    printk("%ld of %ld page allocations served pre-zeroed\n",
+        (long)pages_prezeroed, (long)pages_allocated);
+    print_lock_stat("vm_lock", vm_lock_stat());
+    print_lock_stat("htif_lock", htif_lock_stat());
+    print_ipi_stat();
+    print_emulation_stat();
   }
+  sync_shared_mappings(NULL);
   shutdown(code);
 }
 
@@ -52,7 +119,10 @@ ssize_t sys_read(int fd, char* buf, size_t n)
       if (r < 0)
         break;
 
-      memcpy_to_user(buf, kbuf, r);
+      if (memcpy_to_user(buf, kbuf, r)) {
+        r = -EFAULT;
+        break;
+      }
 
       total += r;
       buf += r;
@@ -81,7 +151,10 @@ ssize_t sys_pread(int fd, char* buf, size_t n, off_t offset)
       if (r < 0)
         break;
 
-      memcpy_to_user(buf, kbuf, r);
+      if (memcpy_to_user(buf, kbuf, r)) {
+        r = -EFAULT;
+        break;
+      }
 
       total += r;
       buf += r;
@@ -107,7 +180,10 @@ ssize_t sys_write(int fd, const char* buf, size_t n)
   if (f) {
     for (size_t total = 0; ; ) {
       size_t cur = MIN(n - total, MAX_BUF);
-      memcpy_from_user(kbuf, buf, cur);
+      if (memcpy_from_user(kbuf, buf, cur)) {
+        r = -EFAULT;
+        break;
+      }
 
       r = file_write(f, kbuf, cur);
 
@@ -145,8 +221,9 @@ int sys_openat(int dirfd, const char* name, int flags, int mode)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     char kname[MAX_BUF];
-    if (!strcpy_from_user(kname, name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err = strcpy_from_user(kname, name, MAX_BUF);
+    if (err)
+      return err;
 
     file_t* file = file_openat(kfd, kname, flags, mode);
     if (IS_ERR_VALUE(file))
@@ -182,8 +259,10 @@ int sys_renameat(int old_fd, const char *old_path, int new_fd, const char *new_p
   int new_kfd = at_kfd(new_fd);
   if(old_kfd != -1 && new_kfd != -1) {
     char kold_path[MAX_BUF], knew_path[MAX_BUF];
-    if (!strcpy_from_user(kold_path, old_path, MAX_BUF) || !strcpy_from_user(knew_path, new_path, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err;
+    if ((err = strcpy_from_user(kold_path, old_path, MAX_BUF)) ||
+        (err = strcpy_from_user(knew_path, new_path, MAX_BUF)))
+      return err;
 
     size_t old_size = strlen(kold_path)+1;
     size_t new_size = strlen(knew_path)+1;
@@ -203,7 +282,8 @@ int sys_fstat(int fd, void* st)
   {
     struct frontend_stat buf;
     r = frontend_syscall(SYS_fstat, f->kfd, kva2pa(&buf), 0, 0, 0, 0, 0);
-    memcpy_to_user(st, &buf, sizeof(buf));
+    if (memcpy_to_user(st, &buf, sizeof(buf)))
+      r = -EFAULT;
     file_decref(f);
   }
 
@@ -238,6 +318,20 @@ int sys_ftruncate(int fd, off_t len)
   return r;
 }
 
+int sys_fsync(int fd)
+{
+  int r = -EBADF;
+  file_t* f = file_get(fd);
+
+  if (f)
+  {
+    r = sync_shared_mappings(f);
+    file_decref(f);
+  }
+
+  return r;
+}
+
 int sys_dup(int fd)
 {
   int r = -EBADF;
@@ -286,8 +380,9 @@ long sys_lstat(const char* name, void* st)
   struct frontend_stat buf;
 
   char kname[MAX_BUF];
-  if (!strcpy_from_user(kname, name, MAX_BUF))
-    return -ENAMETOOLONG;
+  int err = strcpy_from_user(kname, name, MAX_BUF);
+  if (err)
+    return err;
 
   size_t name_size = strlen(kname)+1;
 
@@ -303,13 +398,15 @@ long sys_fstatat(int dirfd, const char* name, void* st, int flags)
     struct frontend_stat buf;
 
     char kname[MAX_BUF];
-    if (!strcpy_from_user(kname, name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err = strcpy_from_user(kname, name, MAX_BUF);
+    if (err)
+      return err;
 
     size_t name_size = strlen(kname)+1;
 
     long ret = frontend_syscall(SYS_fstatat, kfd, kva2pa(kname), name_size, kva2pa(&buf), flags, 0, 0);
-    memcpy_to_user(st, &buf, sizeof(buf));
+    if (memcpy_to_user(st, &buf, sizeof(buf)))
+      return -EFAULT;
     return ret;
   }
   return -EBADF;
@@ -327,13 +424,15 @@ long sys_statx(int dirfd, const char* name, int flags, unsigned int mask, void *
     char buf[FRONTEND_STATX_SIZE];
 
     char kname[MAX_BUF];
-    if (!strcpy_from_user(kname, name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err = strcpy_from_user(kname, name, MAX_BUF);
+    if (err)
+      return err;
 
     size_t name_size = strlen(kname)+1;
 
     long ret = frontend_syscall(SYS_statx, kfd, kva2pa(kname), name_size, flags, mask, kva2pa(&buf), 0);
-    memcpy_to_user(st, &buf, sizeof(buf));
+    if (memcpy_to_user(st, &buf, sizeof(buf)))
+      return -EFAULT;
     return ret;
   }
   return -EBADF;
@@ -344,8 +443,9 @@ long sys_faccessat(int dirfd, const char *name, int mode)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     char kname[MAX_BUF];
-    if (!strcpy_from_user(kname, name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err = strcpy_from_user(kname, name, MAX_BUF);
+    if (err)
+      return err;
 
     size_t name_size = strlen(kname)+1;
 
@@ -366,8 +466,10 @@ long sys_linkat(int old_dirfd, const char* old_name, int new_dirfd, const char*
   if (old_kfd != -1 && new_kfd != -1) {
 
     char kold_name[MAX_BUF], knew_name[MAX_BUF];
-    if (!strcpy_from_user(kold_name, old_name, MAX_BUF) || !strcpy_from_user(knew_name, new_name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err;
+    if ((err = strcpy_from_user(kold_name, old_name, MAX_BUF)) ||
+        (err = strcpy_from_user(knew_name, new_name, MAX_BUF)))
+      return err;
 
     size_t old_size = strlen(kold_name)+1;
     size_t new_size = strlen(knew_name)+1;
@@ -389,8 +491,9 @@ long sys_unlinkat(int dirfd, const char* name, int flags)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     char kname[MAX_BUF];
-    if (!strcpy_from_user(kname, name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err = strcpy_from_user(kname, name, MAX_BUF);
+    if (err)
+      return err;
 
     size_t name_size = strlen(kname)+1;
 
@@ -409,8 +512,9 @@ long sys_mkdirat(int dirfd, const char* name, int mode)
   int kfd = at_kfd(dirfd);
   if (kfd != -1) {
     char kname[MAX_BUF];
-    if (!strcpy_from_user(kname, name, MAX_BUF))
-      return -ENAMETOOLONG;
+    int err = strcpy_from_user(kname, name, MAX_BUF);
+    if (err)
+      return err;
 
     size_t name_size = strlen(kname)+1;
 
@@ -428,8 +532,8 @@ long sys_getcwd(char* buf, size_t size)
 {
   char kbuf[MAX_BUF];
   long ret = frontend_syscall(SYS_getcwd, kva2pa(kbuf), MIN(size, MAX_BUF), 0, 0, 0, 0, 0);
-  if (ret > 0)
-    memcpy_to_user(buf, kbuf, strlen(kbuf) + 1);
+  if (ret > 0 && memcpy_to_user(buf, kbuf, strlen(kbuf) + 1))
+    return -EFAULT;
   return ret;
 }
 
@@ -451,9 +555,7 @@ int sys_uname(void* buf)
   strcpy(kbuf + 4*sz, "");
   strcpy(kbuf + 5*sz, "");
 
-  memcpy_to_user(buf, kbuf, sz_total);
-
-  return 0;
+  return memcpy_to_user(buf, kbuf, sz_total);
 }
 
 pid_t sys_getpid()
@@ -481,6 +583,11 @@ int sys_munmap(uintptr_t addr, size_t length)
   return do_munmap(addr, length);
 }
 
+int sys_msync(uintptr_t addr, size_t length, int flags)
+{
+  return do_msync(addr, length, flags);
+}
+
 uintptr_t sys_mremap(uintptr_t addr, size_t old_size, size_t new_size, int flags)
 {
   return do_mremap(addr, old_size, new_size, flags);
@@ -495,7 +602,8 @@ int sys_rt_sigaction(int sig, const void* act, void* oact, size_t sssz)
 {
   if (oact) {
     long koact[3] = {0};
-    memcpy_to_user(oact, koact, sizeof(koact));
+    if (memcpy_to_user(oact, koact, sizeof(koact)))
+      return -EFAULT;
   }
 
   return 0;
@@ -504,8 +612,8 @@ int sys_rt_sigaction(int sig, const void* act, void* oact, size_t sssz)
 long sys_time(long* loc)
 {
   long t = (long)(rdcycle64() / CLOCK_FREQ);
-  if (loc)
-    memcpy_to_user(loc, &t, sizeof(t));
+  if (loc && memcpy_to_user(loc, &t, sizeof(t)))
+    return -EFAULT;
   return t;
 }
 
@@ -518,7 +626,8 @@ ssize_t sys_getrandom(void *buf, size_t buflen, unsigned int flags)
   for (uint64_t r64 = rdcycle64(); ; ) {
     r64 = r64 * 6364136223846793005 + 1442695040888963407; // knuth
 
-    memcpy_to_user(buf, &r64, MIN(buflen, sizeof(r64)));
+    if (memcpy_to_user(buf, &r64, MIN(buflen, sizeof(r64))))
+      return -EFAULT;
 
     if (buflen <= sizeof(r64))
       break;
@@ -538,9 +647,7 @@ int sys_times(long* loc)
   long kloc[4] = {0};
   kloc[0] = t / (CLOCK_FREQ / 1000000);
 
-  memcpy_to_user(loc, kloc, sizeof(kloc));
-
-  return 0;
+  return memcpy_to_user(loc, kloc, sizeof(kloc));
 }
 
 int sys_gettimeofday(long* loc)
@@ -551,9 +658,7 @@ int sys_gettimeofday(long* loc)
   kloc[0] = t / CLOCK_FREQ;
   kloc[1] = (t % CLOCK_FREQ) / (CLOCK_FREQ / 1000000);
 
-  memcpy_to_user(loc, kloc, sizeof(kloc));
-
-  return 0;
+  return memcpy_to_user(loc, kloc, sizeof(kloc));
 }
 
 long sys_clock_gettime(int clk_id, long *loc)
@@ -564,9 +669,7 @@ long sys_clock_gettime(int clk_id, long *loc)
   kloc[0] = t / CLOCK_FREQ;
   kloc[1] = (t % CLOCK_FREQ) / (CLOCK_FREQ / 1000000000);
 
-  memcpy_to_user(loc, kloc, sizeof(kloc));
-
-  return 0;
+  return memcpy_to_user(loc, kloc, sizeof(kloc));
 }
 
 ssize_t sys_writev(int fd, const long* iov, int cnt)
@@ -574,7 +677,8 @@ ssize_t sys_writev(int fd, const long* iov, int cnt)
   ssize_t ret = 0;
   for (int i = 0; i < cnt; i++) {
     long kiov[2];
-    memcpy_from_user(kiov, iov + 2*i, 2*sizeof(long));
+    if (memcpy_from_user(kiov, iov + 2*i, 2*sizeof(long)))
+      return -EFAULT;
 
     ssize_t r = sys_write(fd, (void*)kiov[0], kiov[1]);
     if (r < 0)
@@ -587,8 +691,9 @@ ssize_t sys_writev(int fd, const long* iov, int cnt)
 int sys_chdir(const char *path)
 {
   char kbuf[MAX_BUF];
-  if (!strcpy_from_user(kbuf, path, MAX_BUF))
-    return -ENAMETOOLONG;
+  int err = strcpy_from_user(kbuf, path, MAX_BUF);
+  if (err)
+    return err;
 
   return frontend_syscall(SYS_chdir, kva2pa(kbuf), 0, 0, 0, 0, 0, 0);
 }
@@ -603,8 +708,9 @@ int sys_readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz)
     return -EBADF;
 
   char kpathname[MAX_BUF];
-  if (!strcpy_from_user(kpathname, pathname, MAX_BUF))
-    return -ENAMETOOLONG;
+  int err = strcpy_from_user(kpathname, pathname, MAX_BUF);
+  if (err)
+    return err;
   const size_t pathname_len = strlen(kpathname);
 
   char kbuf[MAX_BUF];
@@ -613,8 +719,8 @@ int sys_readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz)
   if (ret < 0)
     return ret;
 
-  if (ret > 0)
-    memcpy_to_user(buf, kbuf, ret);
+  if (ret > 0 && memcpy_to_user(buf, kbuf, ret))
+    return -EFAULT;
   return ret;
 }
 
@@ -632,7 +738,10 @@ ssize_t sys_readv(int fd, const struct iovec *iov, int iovcnt)
   ssize_t ret = 0;
   for (int cur_iovcnt = 0; cur_iovcnt < iovcnt; ++cur_iovcnt) {
     struct iovec kiov;
-    memcpy_from_user(&kiov, iov + cur_iovcnt, sizeof(struct iovec));
+    if (memcpy_from_user(&kiov, iov + cur_iovcnt, sizeof(struct iovec))) {
+      ret = -EFAULT;
+      goto out_decref_f;
+    }
 
     // iov_len is too large to be represented in ssize_t
     if (kiov.iov_len & (1ULL << (sizeof(kiov.iov_len) * 8 - 1))) {
@@ -650,7 +759,10 @@ ssize_t sys_readv(int fd, const struct iovec *iov, int iovcnt)
         goto out_decref_f;
       }
 
-      memcpy_to_user(buf, kread_buf, read_res);
+      if (memcpy_to_user(buf, kread_buf, read_res)) {
+        ret = -EFAULT;
+        goto out_decref_f;
+      }
 
       already_read_size += read_res;
       if (read_res < to_read_size) {
@@ -709,7 +821,8 @@ long sys_riscv_hwprobe(struct riscv_hwprobe* probes, size_t count, size_t reserv
 
   for (size_t i=0; i < count; i++) {
     struct riscv_hwprobe kv;
-    memcpy_from_user(&kv, &probes[i], sizeof(kv));
+    if (memcpy_from_user(&kv, &probes[i], sizeof(kv)))
+      return -EFAULT;
 
     if (kv.key == RISCV_HWPROBE_KEY_IMA_EXT_0) {
         kv.value = 0;
@@ -727,7 +840,8 @@ long sys_riscv_hwprobe(struct riscv_hwprobe* probes, size_t count, size_t reserv
         kv.value = 0;
     }
 
-    memcpy_to_user(&probes[i], &kv, sizeof(kv));
+    if (memcpy_to_user(&probes[i], &kv, sizeof(kv)))
+      return -EFAULT;
   }
 
   return 0;
@@ -775,6 +889,7 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
     [SYS_munmap] = sys_munmap,
     [SYS_mremap] = sys_mremap,
     [SYS_mprotect] = sys_mprotect,
+    [SYS_msync] = sys_msync,
     [SYS_rt_sigaction] = sys_rt_sigaction,
     [SYS_gettimeofday] = sys_gettimeofday,
     [SYS_times] = sys_times,
@@ -782,6 +897,8 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, unsigned l
     [SYS_faccessat] = sys_faccessat,
     [SYS_fcntl] = sys_fcntl,
     [SYS_ftruncate] = sys_ftruncate,
+    [SYS_fsync] = sys_fsync,
+    [SYS_fdatasync] = sys_fsync,
     [SYS_getdents] = sys_getdents,
     [SYS_dup] = sys_dup,
     [SYS_dup3] = sys_dup3,
@@ -36,6 +36,9 @@
 #define SYS_munmap 215
 #define SYS_mremap 216
 #define SYS_mprotect 226
+#define SYS_msync 227
+#define SYS_fsync 82
+#define SYS_fdatasync 83
 #define SYS_prlimit64 261
 #define SYS_getmainvars 2011
 #define SYS_rt_sigaction 134
@@ -2,66 +2,106 @@
 
 #include "usermem.h"
 #include "mmap.h"
+#include "bits.h"
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 
-void memset_user(void* dst, int ch, size_t n)
+// Every page of a user buffer is faulted in and permission-checked up
+// front, so the copies below run with SUM set and never trap.
+
+int memset_user(void* dst, int ch, size_t n)
 {
-  if ((uintptr_t)dst + n < (uintptr_t)dst || !is_uva(dst + n - 1))
-    handle_page_fault((uintptr_t)dst, PROT_WRITE);
+  if (prefault_user_range((uintptr_t)dst, n, PROT_WRITE))
+    return -EFAULT;
 
   uintptr_t sstatus = set_csr(sstatus, SSTATUS_SUM);
 
   memset(dst, ch, n);
 
   write_csr(sstatus, sstatus);
+
+  return 0;
 }
 
-void memcpy_to_user(void* dst, const void* src, size_t n)
+int memcpy_to_user(void* dst, const void* src, size_t n)
 {
-  if ((uintptr_t)dst + n < (uintptr_t)dst || !is_uva(dst + n - 1))
-    handle_page_fault((uintptr_t)dst, PROT_WRITE);
+  if (prefault_user_range((uintptr_t)dst, n, PROT_WRITE))
+    return -EFAULT;
 
   uintptr_t sstatus = set_csr(sstatus, SSTATUS_SUM);
 
   memcpy(dst, src, n);
 
   write_csr(sstatus, sstatus);
+
+  return 0;
 }
 
-void memcpy_from_user(void* dst, const void* src, size_t n)
+int memcpy_from_user(void* dst, const void* src, size_t n)
 {
-  if ((uintptr_t)src + n < (uintptr_t)src || !is_uva(src + n - 1))
-    handle_page_fault((uintptr_t)src, PROT_READ);
+  if (prefault_user_range((uintptr_t)src, n, PROT_READ))
+    return -EFAULT;
 
   uintptr_t sstatus = set_csr(sstatus, SSTATUS_SUM);
 
   memcpy(dst, src, n);
 
   write_csr(sstatus, sstatus);
+
+  return 0;
 }
 
-bool strcpy_from_user(char* dst, const char* src, size_t n)
+#define ONES ((uintptr_t)-1 / 0xFF)
+#define has_zero_byte(w) (((w) - ONES) & ~(w) & (ONES << 7))
+
+// Length of s, or n if there is no NUL in the first n bytes.  Aligned
+// words never cross a page, so this reads no further than s + n's page.
+static size_t strnlen_word(const char* s, size_t n)
 {
-  bool res = false;
+  size_t i = 0;
+
+  for (; i < n && (uintptr_t)(s + i) % sizeof(uintptr_t); i++)
+    if (s[i] == 0)
+      return i;
+
+  for (; i + sizeof(uintptr_t) <= n; i += sizeof(uintptr_t))
+    if (has_zero_byte(*(const uintptr_t*)(s + i)))
+      break;
+
+  for (; i < n; i++)
+    if (s[i] == 0)
+      return i;
+
+  return n;
+}
+
+int strcpy_from_user(char* dst, const char* src, size_t n)
+{
+  int res = -ENAMETOOLONG;
 
   uintptr_t sstatus = set_csr(sstatus, SSTATUS_SUM);
 
   while (n > 0) {
-    if (!is_uva(src))
-      handle_page_fault((uintptr_t)src, PROT_READ);
+    // the string's length is unknown, so fault it in a page at a time
+    if (prefault_user_range((uintptr_t)src, 1, PROT_READ)) {
+      res = -EFAULT;
+      break;
+    }
 
-    char ch = *(volatile const char*)src;
-    *dst = ch;
+    size_t chunk = MIN(n, RISCV_PGSIZE - (uintptr_t)src % RISCV_PGSIZE);
+    size_t len = strnlen_word(src, chunk);
 
-    if (ch == 0) {
-      res = true;
+    if (len < chunk) {
+      memcpy(dst, src, len + 1);
+      res = 0;
       break;
     }
 
-    src++;
-    dst++;
-    n--;
+    memcpy(dst, src, chunk);
+    src += chunk;
+    dst += chunk;
+    n -= chunk;
   }
 
   write_csr(sstatus, sstatus);
@@ -3,12 +3,13 @@
 #ifndef _PK_USERMEM_H
 #define _PK_USERMEM_H
 
-#include <stdbool.h>
 #include <stddef.h>
 
-void memset_user(void* dst, int ch, size_t n);
-void memcpy_to_user(void* dst, const void* src, size_t n);
-void memcpy_from_user(void* dst, const void* src, size_t n);
-bool strcpy_from_user(char* dst, const char* src, size_t n);
+// These return 0, or -EFAULT if the user buffer is not accessible.
+// strcpy_from_user also fails with -ENAMETOOLONG if src does not fit in n.
+int memset_user(void* dst, int ch, size_t n);
+int memcpy_to_user(void* dst, const void* src, size_t n);
+int memcpy_from_user(void* dst, const void* src, size_t n);
+int strcpy_from_user(char* dst, const char* src, size_t n);
 
 #endif
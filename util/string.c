@@ -9,47 +9,112 @@
 #pragma GCC optimize ("no-tree-loop-distribute-patterns")
 #endif
 
+// Zicboz block size common to all harts, or 0 if cbo.zero can't be used.
+// Set by the boot code once the device tree has been scanned.
+size_t cbo_zero_block_size;
+
+#define WORD_MASK (sizeof(uintptr_t) - 1)
+#define ONES ((uintptr_t)-1 / 0xFF)
+#define has_zero_byte(w) (((w) - ONES) & ~(w) & (ONES << 7))
+
+// combine the tail of aligned word lo with the head of hi
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define merge_words(lo, hi, shift) (((lo) << (shift)) | ((hi) >> (8 * sizeof(uintptr_t) - (shift))))
+#else
+# define merge_words(lo, hi, shift) (((lo) >> (shift)) | ((hi) << (8 * sizeof(uintptr_t) - (shift))))
+#endif
+
 void* memcpy(void* dest, const void* src, size_t len)
 {
   const char* s = src;
   char *d = dest;
-
-  if ((((uintptr_t)dest | (uintptr_t)src) & (sizeof(uintptr_t)-1)) == 0) {
-    while ((void*)d < (dest + len - (sizeof(uintptr_t)-1))) {
-      *(uintptr_t*)d = *(const uintptr_t*)s;
-      d += sizeof(uintptr_t);
-      s += sizeof(uintptr_t);
+  char *end = d + len;
+
+  if (len >= 2 * sizeof(uintptr_t)) {
+    while ((uintptr_t)d & WORD_MASK)
+      *d++ = *s++;
+
+    uintptr_t *dw = (uintptr_t*)d;
+    size_t nwords = (end - d) / sizeof(uintptr_t);
+    size_t shift = ((uintptr_t)s & WORD_MASK) * 8;
+
+    if (shift == 0) {
+      const uintptr_t *sw = (const uintptr_t*)s;
+      for (size_t i = 0; i < nwords; i++)
+        dw[i] = sw[i];
+    } else {
+      // only ever load aligned words, and only ones holding source bytes
+      const uintptr_t *sw = (const uintptr_t*)(s - shift / 8);
+      uintptr_t lo = *sw++;
+      for (size_t i = 0; i < nwords; i++) {
+        uintptr_t hi = *sw++;
+        dw[i] = merge_words(lo, hi, shift);
+        lo = hi;
+      }
     }
+
+    d += nwords * sizeof(uintptr_t);
+    s += nwords * sizeof(uintptr_t);
   }
 
-  while (d < (char*)(dest + len))
+  while (d < end)
     *d++ = *s++;
 
   return dest;
 }
 
+static inline void cbo_zero(void* addr)
+{
+  asm volatile (".insn i 0x0F, 2, x0, %0, 4" : : "r" (addr) : "memory");
+}
+
 void* memset(void* dest, int byte, size_t len)
 {
-  if ((((uintptr_t)dest | len) & (sizeof(uintptr_t)-1)) == 0) {
+  char *d = dest;
+  char *end = d + len;
+
+  if (len >= 2 * sizeof(uintptr_t)) {
+    while ((uintptr_t)d & WORD_MASK)
+      *d++ = byte;
+
     uintptr_t word = byte & 0xFF;
     word |= word << 8;
     word |= word << 16;
     word |= word << 16 << 16;
 
-    uintptr_t *d = dest;
-    while (d < (uintptr_t*)(dest + len))
-      *d++ = word;
-  } else {
-    char *d = dest;
-    while (d < (char*)(dest + len))
-      *d++ = byte;
+    // zero whole cache blocks without fetching them first
+    size_t block = cbo_zero_block_size;
+    if (word == 0 && block && (size_t)(end - d) >= 2 * block) {
+      for (; (uintptr_t)d & (block - 1); d += sizeof(uintptr_t))
+        *(uintptr_t*)d = 0;
+      for (; (size_t)(end - d) >= block; d += block)
+        cbo_zero(d);
+    }
+
+    for (; (size_t)(end - d) >= sizeof(uintptr_t); d += sizeof(uintptr_t))
+      *(uintptr_t*)d = word;
   }
+
+  while (d < end)
+    *d++ = byte;
+
   return dest;
 }
 
 size_t strlen(const char *s)
 {
   const char *p = s;
+
+  for (; (uintptr_t)p & WORD_MASK; p++)
+    if (*p == 0)
+      return p - s;
+
+  // aligned words never cross a page, so reading past the NUL is safe
+  const uintptr_t *w = (const uintptr_t*)p;
+  while (!has_zero_byte(*w))
+    w++;
+
+  p = (const char*)w;
   while (*p)
     p++;
   return p - s;
@@ -59,6 +124,24 @@ int strcmp(const char* s1, const char* s2)
 {
   unsigned char c1, c2;
 
+  if ((((uintptr_t)s1 ^ (uintptr_t)s2) & WORD_MASK) == 0) {
+    for (; (uintptr_t)s1 & WORD_MASK; s1++, s2++) {
+      c1 = *s1;
+      c2 = *s2;
+      if (c1 == 0 || c1 != c2)
+        return c1 - c2;
+    }
+
+    // skip equal words; the byte loop below settles the last one
+    const uintptr_t *w1 = (const uintptr_t*)s1, *w2 = (const uintptr_t*)s2;
+    while (*w1 == *w2 && !has_zero_byte(*w1)) {
+      w1++;
+      w2++;
+    }
+    s1 = (const char*)w1;
+    s2 = (const char*)w2;
+  }
+
   do {
     c1 = *s1++;
     c2 = *s2++;
@@ -67,6 +150,20 @@ int strcmp(const char* s1, const char* s2)
   return c1 - c2;
 }
 
+int strncmp(const char* s1, const char* s2, size_t n)
+{
+  unsigned char c1 = 0, c2 = 0;
+
+  while (n-- > 0) {
+    c1 = *s1++;
+    c2 = *s2++;
+    if (c1 == 0 || c1 != c2)
+      break;
+  }
+
+  return c1 - c2;
+}
+
 char* strcpy(char* dest, const char* src)
 {
   char* d = dest;